@@ -0,0 +1,341 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../xquery_processor.h"
+#include "../xquery_alloc.h"
+
+/*
+ * Benchmark driver
+ *
+ *   xquery_bench generate (shakespeare|xmark) size output.xml
+ *   xquery_bench run [-r repetitions] document.xml query.xq...
+ *
+ * `run' evaluates every query in a forked process and prints one JSON
+ * object per query on the standard output. The queries read
+ * `doc(bench.xml)', which stands for the document given.
+ */
+
+namespace
+{
+
+const char* kWords[] = {
+    "the", "and", "of", "to", "my", "you", "that", "in", "is", "not", "me", "it",
+    "with", "his", "be", "your", "for", "this", "he", "have", "as", "thou", "so",
+    "him", "will", "what", "but", "her", "thy", "all", "do", "no", "shall", "by",
+    "noble", "Rome", "Caesar", "honour", "blood", "senate", "Brutus", "friends",
+    "countrymen", "ambition", "sword", "night", "fortune", "tide", "lend", "ears"
+};
+const char* kSpeakers[] = {
+    "CAESAR", "BRUTUS", "CASSIUS", "ANTONY", "CASCA", "PORTIA", "CALPURNIA",
+    "OCTAVIUS", "LEPIDUS", "CICERO", "DECIUS BRUTUS", "METELLUS CIMBER",
+    "TREBONIUS", "LIGARIUS", "FLAVIUS", "MARULLUS", "Soothsayer", "LUCIUS",
+    "TITINIUS", "MESSALA", "PINDARUS", "First Citizen", "Second Citizen"
+};
+const char* kRegions[] = {
+    "africa", "asia", "australia", "europe", "namerica", "samerica"
+};
+
+template <typename T, size_t N>
+constexpr size_t CountOf(T (&)[N])
+{
+    return N;
+}
+
+class Generator
+{
+    public:
+        Generator(std::ostream& out, uint64_t target)
+          : out_(out), target_{target}, rng_{42} {}
+
+        void Shakespeare();
+        void XMark();
+
+    private:
+        size_t Pick(size_t n)
+        {
+            return std::uniform_int_distribution<size_t>{0, n - 1}(rng_);
+        }
+        std::string Sentence(size_t min_words, size_t max_words)
+        {
+            std::string s;
+            auto n = min_words + Pick(max_words - min_words + 1);
+            for (size_t i = 0; i < n; ++i)
+                s += (i ? " " : "") + std::string{kWords[Pick(CountOf(kWords))]};
+            return s;
+        }
+        void Emit(const std::string& str)
+        {
+            out_ << str;
+            written_ += str.size();
+        }
+        bool Full() const
+        {
+            return written_ >= target_;
+        }
+
+        std::ostream& out_;
+        uint64_t      target_;
+        uint64_t      written_ = 0;
+        std::mt19937  rng_;
+};
+
+void Generator::Shakespeare()
+{
+    Emit("<?xml version=\"1.0\"?>\n<PLAY>\n<TITLE>The Generated Tragedy</TITLE>\n");
+    Emit("<FM>\n<P>Generated by xquery_bench.</P>\n</FM>\n<PERSONAE>\n<TITLE>Dramatis Personae</TITLE>\n");
+    for (auto speaker : kSpeakers)
+        Emit("<PERSONA>" + std::string{speaker} + "</PERSONA>\n");
+    Emit("</PERSONAE>\n");
+
+    for (size_t act = 1; !Full() || act == 1; ++act) {
+        Emit("<ACT><TITLE>ACT " + std::to_string(act) + "</TITLE>\n");
+        for (size_t scene = 1; scene <= 3 + Pick(5); ++scene) {
+            Emit("<SCENE><TITLE>SCENE " + std::to_string(scene) + ". " + Sentence(3, 8) + "</TITLE>\n");
+            Emit("<STAGEDIR>" + Sentence(2, 6) + "</STAGEDIR>\n");
+            for (size_t speech = 0; speech < 20 + Pick(40); ++speech) {
+                Emit("<SPEECH>\n<SPEAKER>" + std::string{kSpeakers[Pick(CountOf(kSpeakers))]} + "</SPEAKER>\n");
+                for (size_t line = 0; line < 1 + Pick(8); ++line)
+                    Emit("<LINE>" + (Pick(5000) ? Sentence(4, 12) : "Et tu, Brute! Then fall, Caesar.") + "</LINE>\n");
+                if (Pick(10) == 0)
+                    Emit("<STAGEDIR>" + Sentence(1, 4) + "</STAGEDIR>\n");
+                Emit("</SPEECH>\n");
+            }
+            Emit("</SCENE>\n");
+        }
+        Emit("</ACT>\n");
+    }
+    Emit("</PLAY>\n");
+}
+
+void Generator::XMark()
+{
+    size_t items = 0, people = 0, auctions = 0;
+
+    Emit("<?xml version=\"1.0\"?>\n<site>\n<regions>\n");
+    for (size_t r = 0; r < CountOf(kRegions); ++r) {
+        std::string region{kRegions[r]};
+        Emit("<" + region + ">\n");
+        while (written_ < target_ / 2 * (r + 1) / CountOf(kRegions) || items == 0) {
+            Emit("<item><location>" + std::string{kRegions[Pick(CountOf(kRegions))]} + "</location>");
+            Emit("<quantity>" + std::to_string(1 + Pick(5)) + "</quantity>");
+            Emit("<name>item" + std::to_string(items++) + "</name>");
+            Emit("<payment>" + std::string{Pick(2) ? "Creditcard" : "Cash"} + "</payment>");
+            Emit("<description><text>" + Sentence(10, 40) + "</text></description>");
+            Emit("<price>" + std::to_string(1 + Pick(1000)) + "</price></item>\n");
+        }
+        Emit("</" + region + ">\n");
+    }
+    Emit("</regions>\n<people>\n");
+    while (written_ < target_ * 3 / 4 || people == 0) {
+        Emit("<person><name>" + std::string{kSpeakers[Pick(CountOf(kSpeakers))]} + " " +
+             std::to_string(people) + "</name>");
+        Emit("<emailaddress>person" + std::to_string(people++) + "@example.org</emailaddress>");
+        if (Pick(2))
+            Emit("<profile><interest>" + std::string{kWords[Pick(CountOf(kWords))]} + "</interest>"
+                 "<age>" + std::to_string(18 + Pick(60)) + "</age></profile>");
+        Emit("</person>\n");
+    }
+    Emit("</people>\n<open_auctions>\n");
+    while ( !Full() || auctions == 0) {
+        Emit("<open_auction><initial>" + std::to_string(1 + Pick(200)) + "</initial>");
+        for (size_t bid = 0; bid < Pick(6); ++bid)
+            Emit("<bidder><personref>person" + std::to_string(Pick(people)) + "</personref>"
+                 "<increase>" + std::to_string(1 + Pick(50)) + "</increase></bidder>");
+        Emit("<itemref>item" + std::to_string(Pick(items)) + "</itemref>");
+        Emit("<seller>person" + std::to_string(Pick(people)) + "</seller></open_auction>\n");
+        ++auctions;
+    }
+    Emit("</open_auctions>\n</site>\n");
+}
+
+uint64_t ParseSize(const std::string& size)
+{
+    char* end;
+    auto value = std::strtod(size.c_str(), &end);
+
+    switch (std::toupper(*end)) {
+        case 'G': value *= 1024; // fall through
+        case 'M': value *= 1024; // fall through
+        case 'K': value *= 1024;
+    }
+    return value;
+}
+
+int Generate(const std::string& shape, const std::string& size, const std::string& filename)
+{
+    std::ofstream fs{filename};
+    Generator gen{fs, ParseSize(size)};
+
+    if ( !fs.good()) {
+        std::cerr << "Could not open " << filename << std::endl;
+        return 1;
+    }
+    if (shape == "shakespeare")
+        gen.Shakespeare();
+    else if (shape == "xmark")
+        gen.XMark();
+    else {
+        std::cerr << "Unknown shape " << shape << std::endl;
+        return 1;
+    }
+    fs.close();
+    return fs.good() ? 0 : 1;
+}
+
+std::string QueryName(const std::string& filename)
+{
+    auto base = filename.substr(filename.find_last_of('/') + 1);
+    return base.substr(0, base.rfind(".xq"));
+}
+
+// Writes `query' to a temporary file where `doc(bench.xml)' reads the
+// document instead, and moves to the directory of the document since the
+// names of doc() hold no path. Returns the temporary file, empty on failure.
+std::string Substitute(const std::string& query, const std::string& document)
+{
+    const std::string kPlaceholder = "doc(bench.xml)";
+
+    std::ifstream in{query};
+    std::string text{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    if ( !in)
+        return "";
+    auto slash = document.find_last_of('/');
+    auto name = "doc(" + document.substr(slash + 1) + ")";
+    for (auto pos = text.find(kPlaceholder); pos != std::string::npos;
+         pos = text.find(kPlaceholder, pos + name.size()))
+        text.replace(pos, kPlaceholder.size(), name);
+
+    char filename[] = "/tmp/xquery_bench_XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0)
+        return "";
+    bool written = write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size());
+    close(fd);
+    if ( !written || (slash != std::string::npos && chdir(document.substr(0, slash + 1).c_str()) != 0)) {
+        unlink(filename);
+        return "";
+    }
+    return filename;
+}
+
+// Runs in the forked child, the query output goes to /dev/null
+void Measure(const std::string& document, const std::string& query, int repetitions, int report_fd)
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<double> latencies;
+    struct stat st;
+    struct rusage usage;
+    int status = 0;
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    if (stat(document.c_str(), &st) != 0)
+        std::exit(1);
+    auto substituted = Substitute(query, document);
+    if (substituted.empty())
+        std::exit(1);
+
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+
+    auto allocs_before = xquery::ProcessAllocCounters();
+    for (int i = 0; i < repetitions && status == 0; ++i) {
+        auto start = Clock::now();
+        {
+            xquery::Processor process;
+            status = process.Run(substituted.c_str());
+        }
+        std::cout.flush();
+        latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    }
+    auto allocs = xquery::ProcessAllocCounters();
+    getrusage(RUSAGE_SELF, &usage);
+    unlink(substituted.c_str());
+    std::sort(std::begin(latencies), std::end(latencies));
+
+    auto median = latencies[latencies.size() / 2];
+    std::ostringstream json;
+    json << "{\"query\": \"" << QueryName(query) << "\""
+         << ", \"document\": \"" << document << "\""
+         << ", \"document_bytes\": " << st.st_size
+         << ", \"status\": \"" << (status == 0 ? "ok" : "failed") << "\""
+         << ", \"repetitions\": " << latencies.size()
+         << ", \"latency_ms\": {\"min\": " << latencies.front()
+         << ", \"median\": " << median
+         << ", \"max\": " << latencies.back() << "}"
+         << ", \"throughput_mb_s\": " << st.st_size / (1024.0 * 1024.0) / (median / 1000.0)
+         << ", \"peak_rss_kb\": " << usage.ru_maxrss
+         << ", \"allocations\": " << (allocs.allocations - allocs_before.allocations) / latencies.size()
+         << ", \"allocated_bytes\": " << (allocs.bytes - allocs_before.bytes) / latencies.size()
+         << "}\n";
+    auto str = json.str();
+    if (write(report_fd, str.data(), str.size()) < 0)
+        std::exit(1);
+}
+
+int Run(const std::string& document, const std::vector<std::string>& queries, int repetitions)
+{
+    int failures = 0;
+
+    for (const auto& query : queries) {
+        std::cout.flush();
+        auto pid = fork();
+        if (pid == 0) {
+            Measure(document, query, repetitions, dup(STDOUT_FILENO));
+            std::_Exit(0);
+        }
+
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            std::cout << "{\"query\": \"" << QueryName(query) << "\", \"status\": \"crashed\"}" << std::endl;
+            ++failures;
+        }
+    }
+    return failures ? 1 : 0;
+}
+
+void Usage(const char* progname)
+{
+    std::cerr << "Usage: " << progname << " generate (shakespeare|xmark) size output.xml" << std::endl
+              << "       " << progname << " run [-r repetitions] document.xml query.xq..." << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    // The allocations of libxml2 are reported too
+    xquery::TrackXmlAllocations();
+
+    std::vector<std::string> args{argv + 1, argv + argc};
+
+    if (args.size() == 4 && args[0] == "generate")
+        return Generate(args[1], args[2], args[3]);
+    if (args.size() >= 3 && args[0] == "run") {
+        int repetitions = 3;
+        auto it = std::begin(args) + 1;
+        if (*it == "-r" && args.size() >= 5) {
+            repetitions = std::max(1, std::atoi((++it)->c_str()));
+            ++it;
+        }
+        auto document = *it++;
+        return Run(document, {it, std::end(args)}, repetitions);
+    }
+    Usage(argv[0]);
+    return 1;
+}
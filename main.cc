@@ -1,15 +1,231 @@
 #include <iostream>
+#include <vector>
+#include <string>
+#include <getopt.h>
+#include <cstdlib>
+#include <iomanip>
 
+#include "xquery_misc.h"
 #include "xquery_processor.h"
+#include "xquery_alloc.h"
 
-int main(const int argc, const char* argv[])
+static void Usage(const char* progname)
 {
-    if (argc != 2) {
-        std::cout << "Usage: " << argv[0] << " filename" << std::endl;
-        return 1;
-    }
+    std::cout << "Usage: " << progname << " [options] filename" << std::endl
+              << "       " << progname << " [options] --batch filename..." << std::endl
+              << "Options:" << std::endl
+              << "  -c, --compile-doc   convert the XML document `filename' to its binary form"
+              << std::endl
+              << "  -s, --in-situ       parse documents in place instead of using libxml2"
+              << std::endl
+              << "  -A, --arena         allocate the nodes of each document in an arena, released"
+              << std::endl
+              << "                      at once" << std::endl
+              << "  -H, --huge-pages    same, with the arenas on huge pages" << std::endl
+              << "  -n, --no-projection load the documents entirely" << std::endl
+              << "  -a, --analyze       report the time and cardinalities of every node"
+              << std::endl
+              << "  -p, --perf          analyze with the hardware counters of every node (IPC,"
+              << std::endl
+              << "                      cache and branch misses)" << std::endl
+              << "  -m, --mem-report    print the live and peak bytes per category of memory"
+              << std::endl
+              << "                      (documents, bindings...) at exit" << std::endl
+              << "  -e, --explain       print the query plan without evaluating the query"
+              << std::endl
+              << "  -i, --text-index    index the words of the texts for `contains()'"
+              << std::endl
+              << "  -r, --range-index TAG" << std::endl
+              << "                      index the values of the `TAG' elements for comparisons"
+              << std::endl
+              << "  -l, --limit N       output the first `N' items of the result only"
+              << std::endl
+              << "  -j, --jobs N        parse and evaluate the documents of a collection and"
+              << std::endl
+              << "                      evaluate the queries of a batch with `N' threads"
+              << std::endl
+              << "  -k, --cache DIR     reuse the results stored in `DIR' for the same query on"
+              << std::endl
+              << "                      unchanged documents" << std::endl
+              << "  -K, --cache-size MB" << std::endl
+              << "                      evict the least recently used results over `MB' MiB (64)"
+              << std::endl
+              << "  -x, --emit-cpp      print the paths of the query translated to C++, to be"
+              << std::endl
+              << "                      built as a shared object" << std::endl
+              << "  -X, --native LIB    evaluate the paths of the query with `LIB', built from"
+              << std::endl
+              << "                      their translation" << std::endl
+              << "  -t, --trace FILE    write the timeline of the evaluation to `FILE', in the"
+              << std::endl
+              << "                      Chrome trace event format" << std::endl
+              << "  -w, --watch         evaluate the query again whenever its documents change,"
+              << std::endl
+              << "                      printing the items removed (-) and added (+)" << std::endl
+              << "  -b, --batch         evaluate every query `filename' on documents loaded once,"
+              << std::endl
+              << "                      writing its result to `filename.out'" << std::endl;
+}
+
+static void MemoryReport()
+{
+    std::cerr << "Memory usage :"_green << std::endl;
+    for (const auto& usage : xquery::MemoryReport())
+        std::cerr << "  " << std::left << std::setw(12) << usage.category << std::right
+                  << " live=" << usage.live << "B"
+                  << " peak=" << usage.peak << "B"
+                  << " allocations=" << usage.allocations << std::endl;
+}
 
+int main(int argc, char* argv[])
+{
+    const struct option long_options[] = {
+        {"compile-doc",   no_argument, nullptr, 'c'},
+        {"in-situ",       no_argument, nullptr, 's'},
+        {"arena",         no_argument, nullptr, 'A'},
+        {"huge-pages",    no_argument, nullptr, 'H'},
+        {"no-projection", no_argument, nullptr, 'n'},
+        {"analyze",       no_argument, nullptr, 'a'},
+        {"perf",          no_argument, nullptr, 'p'},
+        {"mem-report",    no_argument, nullptr, 'm'},
+        {"explain",       no_argument, nullptr, 'e'},
+        {"text-index",    no_argument, nullptr, 'i'},
+        {"range-index",   required_argument, nullptr, 'r'},
+        {"limit",         required_argument, nullptr, 'l'},
+        {"jobs",          required_argument, nullptr, 'j'},
+        {"batch",         no_argument, nullptr, 'b'},
+        {"watch",         no_argument, nullptr, 'w'},
+        {"cache",         required_argument, nullptr, 'k'},
+        {"cache-size",    required_argument, nullptr, 'K'},
+        {"emit-cpp",      no_argument, nullptr, 'x'},
+        {"native",        required_argument, nullptr, 'X'},
+        {"trace",         required_argument, nullptr, 't'},
+        {"help",          no_argument, nullptr, 'h'},
+        {nullptr,         0,           nullptr, 0}
+    };
     xquery::Processor process;
+    bool compile_doc = false;
+    bool batch = false;
+    bool watch = false;
+    bool emit_cpp = false;
+    bool mem_report = false;
+    bool track_allocations = false;
+    std::string cache_directory;
+    unsigned long cache_size = 64;
+    unsigned long limit;
+    char* end;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "csAHnapmeir:l:j:bwk:K:xX:t:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'c':
+                compile_doc = true;
+                break;
+            case 's':
+                process.set_loader(xquery::DocumentStore::IN_SITU);
+                break;
+            case 'A':
+                process.set_allocation(xquery::DocumentStore::ARENA);
+                track_allocations = true;
+                break;
+            case 'H':
+                process.set_allocation(xquery::DocumentStore::HUGE_PAGE_ARENA);
+                track_allocations = true;
+                break;
+            case 'n':
+                process.set_projection(false);
+                break;
+            case 'a':
+                process.set_analyze(true);
+                track_allocations = true;
+                break;
+            case 'p':
+                process.set_analyze(true);
+                process.set_perf(true);
+                track_allocations = true;
+                break;
+            case 'm':
+                mem_report = true;
+                track_allocations = true;
+                break;
+            case 'e':
+                process.set_explain(true);
+                break;
+            case 'i':
+                process.set_text_index(true);
+                break;
+            case 'r':
+                process.add_range_index(optarg);
+                break;
+            case 'l':
+                limit = std::strtoul(optarg, &end, 10);
+                if (*end != '\0' || limit == 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                process.set_limit(limit);
+                break;
+            case 'j':
+                process.set_threads(std::strtoul(optarg, &end, 10));
+                if (*end != '\0') {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b':
+                batch = true;
+                break;
+            case 'w':
+                watch = true;
+                break;
+            case 'k':
+                cache_directory = optarg;
+                break;
+            case 'K':
+                cache_size = std::strtoul(optarg, &end, 10);
+                if (*end != '\0') {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'x':
+                emit_cpp = true;
+                break;
+            case 'X':
+                process.set_native(optarg);
+                break;
+            case 't':
+                process.set_trace(optarg);
+                break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    // Before any document or node is allocated
+    if (track_allocations)
+        xquery::TrackXmlAllocations();
+    if ( !cache_directory.empty())
+        process.set_cache(cache_directory, static_cast<uint64_t>(cache_size) << 20);
+    auto run = [&]() {
+        if (batch && !compile_doc && optind < argc)
+            return process.RunBatch(std::vector<std::string>(argv + optind, argv + argc));
+        if (optind != argc - 1) {
+            Usage(argv[0]);
+            return 1;
+        }
+
+        if (compile_doc)
+            return process.CompileDocument(argv[optind]);
+        if (emit_cpp)
+            return process.EmitNative(argv[optind]);
+        if (watch)
+            return process.Watch(argv[optind]);
+        return process.Run(argv[optind]);
+    };
 
-    return process.Run(argv[1]);
+    auto status = run();
+    if (mem_report)
+        MemoryReport();
+    return status;
 }
@@ -0,0 +1,415 @@
+#include <new>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sys/mman.h>
+#include <libxml/xmlmemory.h>
+
+#include "xquery_alloc.h"
+
+namespace
+{
+
+using xquery::MemoryCategory;
+
+const size_t kCategories = static_cast<size_t>(MemoryCategory::COUNT);
+
+const char* const kCategoryNames[] = {
+    "other",
+    "query",
+    "documents",
+    "constructed",
+    "sequences",
+    "bindings",
+    "total"
+};
+
+// Written by the thread owning it only, read by the reports
+struct Usage
+{
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<int64_t>  live{0};
+    std::atomic<int64_t>  peak{0};
+};
+
+// Per category then the total, of a thread. The threads are listed once
+// they allocate, their figures are added to the retired ones when they exit.
+struct ThreadUsage
+{
+    Usage        usages[kCategories + 1];
+    ThreadUsage* next = nullptr;
+    bool         listed = false;
+    bool         retired = false;
+};
+
+// Prepended to every block, keeps the alignment of `malloc'
+struct alignas(16) Header
+{
+    uint64_t size;
+    uint64_t category;
+};
+
+// Category of the blocks of an arena, released with it
+const uint64_t kArenaBlock = ~0ULL;
+// Mapped at once by an arena, doubling up to the maximum
+const size_t kFirstChunk = 256 << 10;
+const size_t kMaxChunk = 64 << 20;
+const size_t kHugePage = 2 << 20;
+
+thread_local xquery::AllocCounters thread_counters;
+thread_local MemoryCategory thread_category = MemoryCategory::OTHER;
+thread_local xquery::Arena* thread_arena = nullptr;
+thread_local ThreadUsage thread_usage;
+
+std::mutex threads_mutex;
+ThreadUsage* threads = nullptr;
+// Usage of the threads which exited
+ThreadUsage retired_usage;
+
+// Retires the usage of its thread when the thread exits
+struct ThreadExit
+{
+    ~ThreadExit()
+    {
+        std::lock_guard<std::mutex> lock{threads_mutex};
+
+        for (auto it = &threads; *it != nullptr; it = &(*it)->next)
+            if (*it == &thread_usage) {
+                *it = thread_usage.next;
+                break;
+            }
+        for (size_t i = 0; i <= kCategories; ++i) {
+            auto& from = thread_usage.usages[i];
+            auto& to = retired_usage.usages[i];
+            to.allocations += from.allocations.load(std::memory_order_relaxed);
+            to.bytes += from.bytes.load(std::memory_order_relaxed);
+            to.live += from.live.load(std::memory_order_relaxed);
+            to.peak += from.peak.load(std::memory_order_relaxed);
+        }
+        thread_usage.retired = true;
+    }
+};
+
+// Usage of the calling thread, which is listed on its first allocation. Once
+// it is retired, its last frees go to the retired usage.
+inline Usage* Usages()
+{
+    if (thread_usage.listed)
+        return thread_usage.retired ? retired_usage.usages : thread_usage.usages;
+
+    thread_usage.listed = true;
+    static thread_local ThreadExit on_exit;
+    std::lock_guard<std::mutex> lock{threads_mutex};
+    thread_usage.next = threads;
+    threads = &thread_usage;
+    return thread_usage.usages;
+}
+
+inline void Add(std::atomic<uint64_t>& counter, uint64_t value, Usage* usages)
+{
+    if (usages == retired_usage.usages)
+        counter.fetch_add(value, std::memory_order_relaxed);
+    else
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+inline void Charge(Usage& usage, int64_t bytes, Usage* usages)
+{
+    if (usages == retired_usage.usages) {
+        usage.live.fetch_add(bytes, std::memory_order_relaxed);
+        return;
+    }
+
+    auto live = usage.live.load(std::memory_order_relaxed) + bytes;
+    usage.live.store(live, std::memory_order_relaxed);
+    if (live > usage.peak.load(std::memory_order_relaxed))
+        usage.peak.store(live, std::memory_order_relaxed);
+}
+
+// Charges `bytes' to `category' and to the total
+inline void Charge(uint64_t category, int64_t bytes)
+{
+    auto usages = Usages();
+
+    Charge(usages[category], bytes, usages);
+    Charge(usages[kCategories], bytes, usages);
+}
+
+inline void* Allocate(size_t size)
+{
+    auto header = static_cast<Header*>(std::malloc(sizeof(Header) + size));
+
+    if (header == nullptr)
+        return nullptr;
+    header->size = size;
+    header->category = static_cast<uint64_t>(thread_category);
+    ++thread_counters.allocations;
+    thread_counters.bytes += size;
+
+    auto usages = Usages();
+    Add(usages[header->category].allocations, 1, usages);
+    Add(usages[header->category].bytes, size, usages);
+    Charge(header->category, size);
+    return header + 1;
+}
+
+inline void Release(void* ptr)
+{
+    if (ptr == nullptr)
+        return;
+
+    auto header = static_cast<Header*>(ptr) - 1;
+    if (header->category == kArenaBlock)
+        return;
+    Charge(header->category, -static_cast<int64_t>(header->size));
+    std::free(header);
+}
+
+/*
+ * libxml2 allocation functions
+ */
+void* XmlMalloc(size_t size)
+{
+    if (thread_arena == nullptr)
+        return Allocate(size);
+
+    auto header = static_cast<Header*>(thread_arena->Allocate(sizeof(Header) + size));
+    if (header == nullptr)
+        return nullptr;
+    header->size = size;
+    header->category = kArenaBlock;
+    ++thread_counters.allocations;
+    thread_counters.bytes += size;
+    return header + 1;
+}
+
+// The block stays in its category. A block of an arena grows in place if it
+// is the last one of the arena of the thread, it is copied otherwise.
+void* XmlRealloc(void* ptr, size_t size)
+{
+    if (ptr == nullptr)
+        return XmlMalloc(size);
+
+    auto header = static_cast<Header*>(ptr) - 1;
+    auto old_size = static_cast<int64_t>(header->size);
+    if (header->category == kArenaBlock) {
+        if (thread_arena != nullptr &&
+            thread_arena->Resize(header, sizeof(Header) + old_size, sizeof(Header) + size)) {
+            if (static_cast<int64_t>(size) > old_size)
+                thread_counters.bytes += size - old_size;
+            header->size = size;
+            return ptr;
+        }
+        auto moved = XmlMalloc(size);
+        if (moved != nullptr)
+            std::memcpy(moved, ptr, std::min<size_t>(size, old_size));
+        return moved;
+    }
+    header = static_cast<Header*>(std::realloc(header, sizeof(Header) + size));
+    if (header == nullptr)
+        return nullptr;
+    header->size = size;
+    if (static_cast<int64_t>(size) > old_size)
+        thread_counters.bytes += size - old_size;
+    Charge(header->category, size - old_size);
+    return header + 1;
+}
+
+char* XmlStrdup(const char* str)
+{
+    auto size = std::strlen(str) + 1;
+    auto copy = static_cast<char*>(XmlMalloc(size));
+
+    if (copy != nullptr)
+        std::memcpy(copy, str, size);
+    return copy;
+}
+
+}
+
+namespace xquery
+{
+
+AllocCounters ThreadAllocCounters()
+{
+    return thread_counters;
+}
+
+AllocCounters ProcessAllocCounters()
+{
+    AllocCounters counters;
+
+    for (const auto& usage : MemoryReport())
+        if (usage.category == kCategoryNames[kCategories]) {
+            counters.allocations = usage.allocations;
+            counters.bytes = usage.bytes;
+        }
+    return counters;
+}
+
+void TrackXmlAllocations()
+{
+    xmlMemSetup(Release, XmlMalloc, XmlRealloc, XmlStrdup);
+}
+
+std::vector<MemoryUsage> MemoryReport()
+{
+    std::vector<MemoryUsage> report;
+    std::lock_guard<std::mutex> lock{threads_mutex};
+
+    for (size_t i = 0; i <= kCategories; ++i) {
+        MemoryUsage usage{kCategoryNames[i], 0, 0, 0, 0};
+        int64_t live = 0;
+        auto add = [&](const Usage* usages) {
+            live += usages[i].live.load(std::memory_order_relaxed);
+            usage.peak += usages[i].peak.load(std::memory_order_relaxed);
+            // The allocations are counted per category only
+            for (size_t j = 0; j < kCategories; ++j)
+                if (i == j || i == kCategories) {
+                    usage.allocations += usages[j].allocations.load(std::memory_order_relaxed);
+                    usage.bytes += usages[j].bytes.load(std::memory_order_relaxed);
+                }
+        };
+        for (auto thread = threads; thread != nullptr; thread = thread->next)
+            add(thread->usages);
+        add(retired_usage.usages);
+        // A thread may free more than it allocated
+        usage.live = static_cast<uint64_t>(std::max<int64_t>(live, 0));
+        report.push_back(usage);
+    }
+    return report;
+}
+
+MemoryScope::MemoryScope(MemoryCategory category) : outer_{thread_category}
+{
+    thread_category = category;
+}
+
+MemoryScope::~MemoryScope()
+{
+    thread_category = outer_;
+}
+
+Arena::Arena(bool huge_pages) : huge_pages_{huge_pages} {}
+
+Arena::~Arena()
+{
+    for (const auto& chunk : chunks_) {
+        munmap(chunk.base, chunk.size);
+        Charge(static_cast<uint64_t>(chunk.category), -static_cast<int64_t>(chunk.size));
+    }
+}
+
+void* Arena::Allocate(size_t size)
+{
+    size = (size + 15) & ~static_cast<size_t>(15);
+    if (static_cast<size_t>(end_ - next_) < size) {
+        // Large blocks get a chunk of their own
+        auto chunk_size = chunks_.empty() ? kFirstChunk : std::min(2 * chunks_.back().size, kMaxChunk);
+        if ( !Map(std::max(chunk_size, size)))
+            return nullptr;
+    }
+
+    auto ptr = next_;
+    next_ += size;
+    return ptr;
+}
+
+bool Arena::Resize(void* block, size_t old_size, size_t size)
+{
+    old_size = (old_size + 15) & ~static_cast<size_t>(15);
+    size = (size + 15) & ~static_cast<size_t>(15);
+    if (static_cast<char*>(block) + old_size != next_ ||
+        static_cast<size_t>(end_ - static_cast<char*>(block)) < size)
+        return false;
+
+    next_ = static_cast<char*>(block) + size;
+    return true;
+}
+
+bool Arena::Map(size_t size)
+{
+    auto category = thread_category;
+    void* base = MAP_FAILED;
+
+    if (huge_pages_) {
+        size = (size + kHugePage - 1) & ~(kHugePage - 1);
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return false;
+        if (huge_pages_)
+            madvise(base, size, MADV_HUGEPAGE);
+    }
+
+    chunks_.push_back({base, size, category});
+    next_ = static_cast<char*>(base);
+    end_ = next_ + size;
+    size_ += size;
+    auto usages = Usages();
+    Add(usages[static_cast<size_t>(category)].allocations, 1, usages);
+    Add(usages[static_cast<size_t>(category)].bytes, size, usages);
+    Charge(static_cast<uint64_t>(category), size);
+    return true;
+}
+
+ArenaScope::ArenaScope(Arena& arena) : outer_{thread_arena}
+{
+    thread_arena = &arena;
+}
+
+ArenaScope::~ArenaScope()
+{
+    thread_arena = outer_;
+}
+
+}
+
+void* operator new(size_t size)
+{
+    void* ptr = Allocate(size);
+
+    if (ptr == nullptr)
+        throw std::bad_alloc{};
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return Allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    Release(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    Release(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    Release(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    Release(ptr);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "xquery_misc.h"
+
+namespace xquery
+{
+
+/*
+ * Heap accounting through the replaced global `operator new' and, once
+ * `TrackXmlAllocations' is called, the allocation functions of libxml2.
+ * Every thread updates counters of its own, the process figures add them
+ * up when they are read. The counters of the calling thread are exact and
+ * cheap to sample.
+ */
+struct AllocCounters
+{
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+};
+
+AllocCounters ThreadAllocCounters();
+AllocCounters ProcessAllocCounters();
+
+// Routes the allocations of libxml2 through the accounting, to be called
+// before any other libxml2 call. Only the memory reports, the allocations
+// per node of `--analyze' and the arenas need it, libxml2 allocates with
+// `malloc' otherwise.
+void TrackXmlAllocations();
+
+/*
+ * The live bytes are accounted per category: an allocation goes to the
+ * category of the innermost `MemoryScope' of its thread and is given back
+ * to it once freed, wherever it is.
+ */
+enum class MemoryCategory
+{
+    OTHER,
+    QUERY,       // Parsed queries
+    DOCUMENTS,   // Loaded documents and their indexes
+    CONSTRUCTED, // Nodes constructed by the queries and results
+    SEQUENCES,   // Intermediate sequences of the evaluations
+    BINDINGS,    // Variables in scope
+    COUNT
+};
+
+struct MemoryUsage
+{
+    const char* category;
+    uint64_t    live;
+    uint64_t    peak;
+    uint64_t    allocations;
+    uint64_t    bytes;
+};
+
+// Usage per category, then the total. The peaks are the sums of the peaks
+// of the threads, which bound the peak of the process.
+std::vector<MemoryUsage> MemoryReport();
+
+class MemoryScope : public NonCopyable, public NonMoveable
+{
+    public:
+        MemoryScope(MemoryCategory category);
+        ~MemoryScope();
+
+    private:
+        MemoryCategory outer_;
+};
+
+/*
+ * Bump allocator taking the libxml2 allocations of a thread within an
+ * `ArenaScope', once `TrackXmlAllocations' is called. Its blocks are not freed one
+ * by one, they are all released with the arena. The chunks count in the
+ * memory category of the thread mapping them.
+ */
+class Arena : public NonCopyable, public NonMoveable
+{
+    public:
+        // On huge pages if `huge_pages', reserved ones if the system has
+        // any, transparent ones otherwise
+        Arena(bool huge_pages);
+        ~Arena();
+
+        // 16 bytes aligned, null if no chunk can be mapped
+        void* Allocate(size_t size);
+        // Resizes in place the last block allocated if its chunk has room,
+        // false for any other block
+        bool Resize(void* block, size_t old_size, size_t size);
+        // Bytes mapped
+        size_t size() const
+        {
+            return size_;
+        }
+
+    private:
+        struct Chunk
+        {
+            void*          base;
+            size_t         size;
+            MemoryCategory category;
+        };
+
+        bool Map(size_t size);
+
+        std::vector<Chunk> chunks_;
+        char*              next_ = nullptr;
+        char*              end_ = nullptr;
+        size_t             size_ = 0;
+        bool               huge_pages_;
+};
+
+class ArenaScope : public NonCopyable, public NonMoveable
+{
+    public:
+        ArenaScope(Arena& arena);
+        ~ArenaScope();
+
+    private:
+        Arena* outer_;
+};
+
+}
@@ -1,11 +1,22 @@
 #include <functional>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include "xquery_misc.h"
 #include "xquery_ast.h"
 #include "xquery_ast_utils.h"
+#include "xquery_nodes.h"
+#include "xquery_alloc.h"
+#include "xquery_trace.h"
 
 #ifdef USE_BOOST_GRAPHVIZ
 #include <boost/graph/graphviz.hpp>
@@ -19,7 +30,7 @@ class graphviz_label_writer
         template <class VertexId>
         void operator()(std::ostream& out, const VertexId& id) const
         {
-            out << "[label=\"" << container_[id]->label() << "\"]";
+            out << "[label=\"" << container_[id] << "\"]";
         }
 
     private:
@@ -36,7 +47,233 @@ inline graphviz_label_writer<Container> make_graphviz_label_writer(const Contain
 namespace xquery
 {
 
-void Ast::PlotGraph() const
+namespace
+{
+
+// Set by `Ast::Evaluate' for the duration of the evaluation
+thread_local ExecutionContext* current_context = nullptr;
+
+class ContextScope
+{
+    public:
+        ContextScope(ExecutionContext& context) : outer_{current_context}
+        {
+            current_context = &context;
+        }
+        ~ContextScope()
+        {
+            current_context = outer_;
+        }
+
+    private:
+        ExecutionContext* outer_;
+};
+
+// Resolves the variables of `node' to their definitions, `scope' holds the
+// visible ones, the innermost last. The bindings of a clause are visible to
+// the next ones and to the rest of the expression of the clause.
+void Resolve(const Node* node, std::vector<const lang::VariableDef*>& scope)
+{
+    auto size = scope.size();
+
+    if (auto var = dynamic_cast<const lang::Variable*>(node)) {
+        auto it = std::find_if(scope.rbegin(), scope.rend(),
+          [var](const lang::VariableDef* def) { return def->varname() == var->varname(); });
+        var->set_definition(it != scope.rend() ? *it : nullptr);
+        return;
+    }
+    if (dynamic_cast<const lang::ForClause*>(node) || dynamic_cast<const lang::LetClause*>(node) ||
+        dynamic_cast<const lang::SomeClause*>(node)) {
+        for (auto edge : *node) {
+            auto def = static_cast<const lang::VariableDef*>(edge);
+            Resolve(*std::begin(*def), scope);
+            scope.push_back(def);
+        }
+        return;
+    }
+    for (auto edge : *node)
+        if (edge)
+            Resolve(edge, scope);
+    scope.resize(size);
+}
+
+// Checks the kinds of the results of the edges of `node' and of its
+// descendants, `context' if `node' is evaluated on context nodes
+// Throws `std::runtime_error'
+void Check(const Node* node, bool context)
+{
+    size_t idx = 0;
+
+    if (node->ReadsContext() && !context)
+        throw std::runtime_error(node->label() + " has no context node");
+    for (auto edge : *node) {
+        if (edge) {
+            if ( !node->Accepts(idx, edge->kind()))
+                throw std::runtime_error(edge->label() + " is not a valid operand of " + node->label());
+            Check(edge, node->EdgeContext(idx, context));
+        }
+        ++idx;
+    }
+}
+
+}
+
+void Node::Project(Projection& proj, bool whole) const
+{
+    for (auto edge : edges_)
+        if (edge)
+            edge->Project(proj, whole);
+}
+
+bool Node::DoExists(const EvalResult& res) const
+{
+    auto ret_res = DoEval(res);
+
+    if (kind() == ResultKind::CONDITION)
+        return ret_res.condition;
+    return kind() == ResultKind::NODES && !ret_res.nodes.empty();
+}
+
+Node::EvalResult Node::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    auto ret_res = DoEval(res);
+
+    if (kind() == ResultKind::NODES && ret_res.nodes.size() > limit)
+        ret_res.nodes.resize(limit);
+    return ret_res;
+}
+
+void Ast::Compile()
+{
+    auto skip = [](const Node* node) {
+        while (dynamic_cast<const lang::NonTerminalNode*>(node) || dynamic_cast<const lang::Precedence*>(node))
+            node = *std::begin(*node);
+        return node;
+    };
+
+    assert(root_ != nullptr);
+    root_ = skip(root_);
+    for (const auto& node : nodes_)
+        for (auto& edge : node->edges_)
+            if (edge)
+                edge = skip(edge);
+
+    std::vector<const lang::VariableDef*> scope;
+    Resolve(root_, scope);
+
+    Check(root_, false);
+    if (root_->kind() != ResultKind::NODES)
+        throw std::runtime_error(root_->label() + " is not a sequence");
+    Lower();
+}
+
+void Ast::Bind(const NativeQuery& native)
+{
+    const auto& roots = native.nodes();
+    size_t index = 0;
+    // Nodes numbered in prefix order, as in `Fingerprint'
+    std::function<const Node* (const Node*)> bind =
+        [&](const Node* node) -> const Node* {
+            auto it = std::find(std::begin(roots), std::end(roots), index++);
+            for (auto& edge : node->edges_)
+                if (edge)
+                    edge = bind(edge);
+            if (it == std::end(roots))
+                return node;
+            return AddNode(new lang::Native{native, static_cast<size_t>(it - std::begin(roots)), {node}});
+        };
+
+    assert(native.plan() == Fingerprint());
+    root_ = bind(root_);
+    // The paths holding translated ones are left to the interpreter, on the
+    // calling thread
+    Lower();
+}
+
+void Ast::Lower()
+{
+    for (const auto& node : nodes_)
+        if (auto sep = dynamic_cast<const lang::PathSeparator*>(node.get())) {
+            sep->set_lowered(LoweredPath::Lower(sep));
+            sep->Prepare();
+        }
+        else if (auto filter = dynamic_cast<const lang::Filter*>(node.get()))
+            filter->set_lowered(LoweredPath::Lower(filter));
+        else if (auto flwr = dynamic_cast<const lang::FLWRExpression*>(node.get()))
+            flwr->Prepare();
+}
+
+void Ast::ProjectDocuments()
+{
+    Projection proj;
+
+    proj.keep_all = false;
+    Project(proj);
+    documents_.set_projection(std::move(proj));
+}
+
+void Ast::Project(Projection& proj) const
+{
+    std::unordered_set<std::string> projected;
+
+    assert(root_ != nullptr);
+    root_->Project(proj, true);
+
+    // Variables consumed as a whole extend to their definitions
+    for (bool changed = true; changed && !proj.keep_all; ) {
+        changed = false;
+        auto variables = proj.variables;
+        for (const auto& var : variables)
+            if (projected.insert(var).second) {
+                auto range = proj.definitions.equal_range(var);
+                for (auto it = range.first; it != range.second; ++it)
+                    it->second->Project(proj, true);
+                changed = true;
+            }
+    }
+}
+
+std::string Ast::Fingerprint() const
+{
+    std::ostringstream plan;
+    std::function<void (const Node*)> print =
+        [&](const Node* node) {
+            if (node == nullptr) {
+                plan << "()";
+                return;
+            }
+            // Escaped, constants hold any character
+            plan << "(";
+            for (auto c : node->label()) {
+                if (c == '(' || c == ')' || c == '\\')
+                    plan << '\\';
+                plan << c;
+            }
+            for (auto child : *node)
+                print(child);
+            plan << ")";
+        };
+
+    assert(root_ != nullptr);
+    print(root_);
+    return plan.str();
+}
+
+std::vector<std::string> Ast::Inputs() const
+{
+    std::vector<std::string> inputs;
+
+    for (const auto& node : nodes_)
+        if (auto doc = dynamic_cast<const lang::Document*>(node.get()))
+            inputs.push_back(doc->name());
+        else if (auto collection = dynamic_cast<const lang::Collection*>(node.get())) {
+            auto filenames = DocumentStore::List(collection->directory());
+            inputs.insert(std::end(inputs), std::begin(filenames), std::end(filenames));
+        }
+    return inputs;
+}
+
+void Ast::PlotGraph(const ExecutionContext* analyzed) const
 {
 #ifdef USE_BOOST_GRAPHVIZ
     using GraphEdge = std::pair<size_t, size_t>;
@@ -58,30 +295,324 @@ void Ast::PlotGraph() const
     trace(root_);
 
     Graph g{std::begin(graph_edges), std::end(graph_edges), nodes_.size()};
+    std::vector<std::string> labels;
     std::ofstream fs{filename};
 
+    for (const auto& node : nodes_) {
+        auto label = node->label();
+        if ( !PlanLabel(node.get()).empty())
+            label += "\\n" + PlanLabel(node.get());
+        if (analyzed && !analyzed->stats().empty())
+            label += "\\n" + StatsLabel(analyzed->stats()[node->id()]);
+        labels.push_back(label);
+    }
     if ( !fs.good())
         throw std::ios_base::failure{"Could not open " + filename};
-    boost::write_graphviz(fs, g, ::make_graphviz_label_writer(nodes_));
+    boost::write_graphviz(fs, g, ::make_graphviz_label_writer(labels));
     fs.close();
     std::cerr << "AST generated successfully"_green << std::endl;
 #else
+    static_cast<void>(analyzed);
     std::cerr << "Graphiz plotting is not supported. "_yellow <<
       "Try compiling with USE_BOOST_GRAPHVIZ=true"_yellow << std::endl;
 #endif
 }
 
-void Ast::Evaluate() const
+void Ast::Evaluate(ExecutionContext& context) const
 {
-    auto out_res = root_->Eval({});
+    ContextScope scope{context};
+    MemoryScope sequences{MemoryCategory::SEQUENCES};
+    Node::EvalResult out_res;
+
+    context.stats_.clear();
+    context.forks_.clear();
+    if (analyze_)
+        context.stats_.assign(nodes_.size(), {});
+    if (analyze_ && perf_ && !context.counters_) {
+        static std::once_flag reported;
+        context.counters_.reset(new PerfCounters);
+        if ( !context.counters_->available())
+            std::call_once(reported, [&context]() {
+                std::cerr << "Hardware counters not available: "_yellow
+                          << context.counters_->error() << std::endl;
+            });
+    }
+    // The items of a query made of a constructor (`<result>{...}</result>')
+    // are the ones of its content
+    auto top = root_;
+    while (dynamic_cast<const lang::NonTerminalNode*>(top))
+        top = *std::begin(*top);
+    auto tag = dynamic_cast<const lang::Tag*>(top);
+    if (limit_ == 0)
+        out_res = root_->Eval({});
+    else if (tag)
+        out_res = tag->Construct({}, limit_);
+    else
+        out_res = root_->EvalFirst({}, limit_);
 
     assert(out_res.type == Node::EvalResult::NODES);
+    context.SetResult(out_res.nodes);
+}
+
+ExecutionContext& Ast::context() const
+{
+    assert(current_context != nullptr);
+    return *current_context;
+}
+
+xml::NodeList Ast::Distribute(const Node* collection, const std::function<xml::NodeList ()>& eval,
+                              size_t limit) const
+{
+    std::vector<xml::NodeList>      results;
+    std::vector<std::exception_ptr> errors;
+    std::vector<char>               evaluated;
+    std::vector<ExecutionContext*>  forks;
+    std::vector<std::thread>        workers;
+    std::atomic<size_t>             next{0};
+    std::atomic<bool>               enough{false};
+    std::mutex                      mutex;
+    size_t                          merged = 0, found = 0;
+    xml::NodeList                   ret_nodes;
+
+    auto threads = threads_ ? threads_ : std::max(1u, std::thread::hardware_concurrency());
+    // The statistics, the spans and the results kept are recorded by the
+    // calling thread
+    if (context().shard() || context().memo() || instrumented() || threads < 2)
+        return eval();
+    auto roots = collection->Eval({}).nodes;
+    threads = std::min(threads, roots.size());
+    if (threads < 2)
+        return eval();
+
+    std::vector<xml::Node*> shards(std::begin(roots), std::end(roots));
+    results.resize(shards.size());
+    errors.resize(shards.size());
+    evaluated.resize(shards.size(), false);
+    for (size_t i = 0; i < threads; ++i)
+        forks.push_back(&context().Fork());
+
+    // The workers take the next document until there are none left or the
+    // documents evaluated first give `limit' nodes, each one in its own
+    // context
+    auto work = [&](ExecutionContext& fork) {
+        ContextScope scope{fork};
+        MemoryScope sequences{MemoryCategory::SEQUENCES};
+        fork.shard_ = collection;
+        for (size_t i; !enough && (i = next++) < shards.size(); ) {
+            fork.shard_root_ = shards[i];
+            try {
+                results[i] = eval();
+            }
+            catch (...) {
+                errors[i] = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock{mutex};
+            evaluated[i] = true;
+            for (; merged < shards.size() && evaluated[merged]; ++merged) {
+                found += results[merged].size();
+                if (errors[merged] || found >= limit)
+                    enough = true;
+            }
+        }
+    };
+
+    for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back(work, std::ref(*forks[i]));
+    work(*forks[0]);
+    for (auto& worker : workers)
+        worker.join();
+
+    // The errors of the documents after the first `limit' nodes are not
+    // reported, as by a serial evaluation
+    for (size_t i = 0; i < shards.size() && ret_nodes.size() < limit; ++i) {
+        if (errors[i])
+            std::rethrow_exception(errors[i]);
+        ret_nodes.splice(std::end(ret_nodes), results[i]);
+    }
+    if (ret_nodes.size() > limit)
+        ret_nodes.resize(limit);
+    return ret_nodes;
+}
+
+ExecutionContext& ExecutionContext::Fork()
+{
+    MemoryScope scope{MemoryCategory::BINDINGS};
+
+    forks_.emplace_back(new ExecutionContext);
+    forks_.back()->context_stack_ = context_stack_;
+    return *forks_.back();
+}
+
+void ExecutionContext::SetResult(const xml::NodeList& nodes)
+{
+    MemoryScope scope{MemoryCategory::CONSTRUCTED};
     output_doc_.create_root_node("root");
     auto root = output_doc_.get_root_node();
-    for (const auto node : out_res.nodes)
+    for (const auto node : nodes)
         root->import_node(node);
+}
+
+void ExecutionContext::Output(std::ostream& out) const
+{
     std::cerr << "Request result :"_green << std::endl;
-    output_doc_.write_to_stream_formatted(std::cout);
+    output_doc_.write_to_stream_formatted(out);
+}
+
+std::vector<std::string> ExecutionContext::ResultItems() const
+{
+    std::vector<std::string> items;
+    auto buffer = xmlBufferCreate();
+
+    for (auto node = output_doc_.get_root_node()->cobj()->children; node; node = node->next) {
+        xmlBufferEmpty(buffer);
+        xmlNodeDump(buffer, node->doc, node, 0, 0);
+        items.emplace_back(reinterpret_cast<const char*>(xmlBufferContent(buffer)));
+    }
+    xmlBufferFree(buffer);
+    return items;
+}
+
+template <typename Eval>
+auto Ast::Instrument(const Node* node, const char* category, const Node::EvalResult& res,
+                     Eval eval) const -> decltype(eval())
+{
+    using Clock = std::chrono::steady_clock;
+    using EvalResult = Node::EvalResult;
+
+    TraceSpan span{category, node->label(), node->id()};
+    if ( !analyze_)
+        return eval();
+
+    auto& context = this->context();
+    auto counters = context.counters_.get();
+    auto outer_ns = context.children_ns_;
+    auto outer_bytes = context.children_bytes_;
+    auto outer_counters = context.children_counters_;
+    auto bytes = ThreadAllocCounters().bytes;
+    auto events = counters ? counters->Read() : PerfValues{};
+    auto start = Clock::now();
+
+    context.children_ns_ = context.children_bytes_ = 0;
+    context.children_counters_ = {};
+    auto ret = eval();
+
+    uint64_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    auto counted = counters ? counters->Read() - events : PerfValues{};
+    auto allocated = ThreadAllocCounters().bytes - bytes;
+    auto& stats = context.stats_[node->id()];
+    ++stats.calls;
+    stats.inclusive_ns += elapsed_ns;
+    stats.exclusive_ns += elapsed_ns - std::min(elapsed_ns, context.children_ns_);
+    stats.bytes += allocated - std::min(allocated, context.children_bytes_);
+    stats.counters += counted - context.children_counters_;
+    if (res.type == EvalResult::NODES)
+        stats.input_items += res.nodes.size();
+
+    context.children_ns_ = outer_ns + elapsed_ns;
+    context.children_bytes_ = outer_bytes + allocated;
+    context.children_counters_ = outer_counters;
+    context.children_counters_ += counted;
+    return ret;
+}
+
+Node::EvalResult Ast::InstrumentEval(const Node* node, const Node::EvalResult& res) const
+{
+    auto ret_res = Instrument(node, "eval", res, [node, &res]() { return node->DoEval(res); });
+
+    if (analyze_ && ret_res.type == Node::EvalResult::NODES)
+        context().stats_[node->id()].output_items += ret_res.nodes.size();
+    return ret_res;
+}
+
+Node::EvalResult Ast::InstrumentEvalFirst(const Node* node, const Node::EvalResult& res,
+                                          size_t limit) const
+{
+    auto ret_res = Instrument(node, "eval-first", res,
+                              [node, &res, limit]() { return node->DoEvalFirst(res, limit); });
+
+    if (analyze_ && ret_res.type == Node::EvalResult::NODES)
+        context().stats_[node->id()].output_items += ret_res.nodes.size();
+    return ret_res;
+}
+
+bool Ast::InstrumentExists(const Node* node, const Node::EvalResult& res) const
+{
+    return Instrument(node, "exists", res, [node, &res]() { return node->DoExists(res); });
+}
+
+std::string Ast::StatsLabel(const EvalStats& stats) const
+{
+    std::ostringstream label;
+
+    label << std::fixed << std::setprecision(3)
+          << "calls=" << stats.calls
+          << " time=" << stats.inclusive_ns / 1e6 << "ms"
+          << " self=" << stats.exclusive_ns / 1e6 << "ms"
+          << " in=" << stats.input_items
+          << " out=" << stats.output_items
+          << " alloc=" << stats.bytes << "B";
+    // Misses per node output tell the cost of the navigation
+    const auto& counters = stats.counters;
+    if (counters.cycles != 0) {
+        auto per_output = [&stats](uint64_t count) {
+            return stats.output_items ? 1.0 * count / stats.output_items : 0.0;
+        };
+        label << std::setprecision(2)
+              << " cycles=" << counters.cycles
+              << " ipc=" << 1.0 * counters.instructions / counters.cycles
+              << " llc-miss=" << counters.cache_misses << " (" << per_output(counters.cache_misses) << "/out)"
+              << " br-miss=" << counters.branch_misses << " (" << per_output(counters.branch_misses) << "/out)";
+    }
+    return label.str();
+}
+
+std::string Ast::PlanLabel(const Node* node) const
+{
+    auto clause = dynamic_cast<const ContextIterator*>(node);
+
+    if (clause == nullptr || clause->planned() == nullptr)
+        return "";
+    return "plan: " + clause->planned()->Describe();
+}
+
+void Ast::Explain(std::ostream& out, const ExecutionContext* analyzed) const
+{
+    static const std::vector<EvalStats> kNone;
+    const auto& stats = analyzed ? analyzed->stats() : kNone;
+    std::function<bool (const Node*)> reached =
+        [&](const Node* node) {
+            return stats[node->id()].calls > 0 ||
+                   std::any_of(std::begin(*node), std::end(*node),
+                     [&](const Node* child) { return child && reached(child); });
+        };
+    std::function<void (const Node*, size_t)> print =
+        [&](const Node* node, size_t depth) {
+            // Subtrees never evaluated (e.g. under an empty for binding) are
+            // skipped, a where clause is only evaluated through its conjuncts
+            if ( !stats.empty() && !reached(node))
+                return;
+            // Clauses are planned before their bindings are estimated
+            if (auto clause = dynamic_cast<const ContextIterator*>(node))
+                clause->plan(node);
+
+            out << std::string(2 * depth, ' ') << node->label();
+            if ( !PlanLabel(node).empty())
+                out << "  [" << PlanLabel(node) << "]";
+            if ( !stats.empty())
+                out << "  (" << StatsLabel(stats[node->id()]) << ")";
+            out << std::endl;
+            for (auto child : *node)
+                if (child)
+                    print(child, depth + 1);
+        };
+
+    assert(root_ != nullptr);
+    if (stats.empty())
+        out << "Query plan :"_green << std::endl;
+    else
+        out << "Evaluation analysis :"_green << std::endl;
+    print(root_, 0);
 }
 
 }
@@ -4,14 +4,32 @@
 #include <vector>
 #include <algorithm>
 #include <iostream>
+#include <cstdint>
+#include <functional>
+#include <limits>
 
 #include "xquery_xml.h"
 #include "xquery_misc.h"
+#include "xquery_document.h"
+#include "xquery_planner.h"
+#include "xquery_perf.h"
+#include "xquery_alloc.h"
 
 namespace xquery
 {
 
 class Ast;
+class NativeQuery;
+class ResultMemo;
+
+// Kind of the results of a node, known once the query is compiled
+enum class ResultKind
+{
+    NODES,
+    CONDITION,
+    BINDINGS,  // Iterator on the bindings of a clause
+    NONE
+};
 
 class Node : public NonCopyable, public NonMoveable
 {
@@ -27,7 +45,48 @@ class Node : public NonCopyable, public NonMoveable
         virtual ~Node() = default;
 
         // Throws `std::runtime_error' or `xml::validity_error'
-        virtual EvalResult Eval(const EvalResult& res) const = 0;
+        EvalResult Eval(const EvalResult& res) const;
+        // Tells if the evaluation has any result (a non empty sequence or a
+        // true condition), navigation stops at the first one
+        // Throws `std::runtime_error' or `xml::validity_error'
+        bool Exists(const EvalResult& res) const;
+        // Evaluation keeping the first `limit' items of the sequence, the
+        // evaluation stops once they are found
+        // Throws `std::runtime_error' or `xml::validity_error'
+        EvalResult EvalFirst(const EvalResult& res, size_t limit) const;
+        // Evaluation proper, always called through `Eval'
+        virtual EvalResult DoEval(const EvalResult& res) const = 0;
+        // Existential evaluation proper, always called through `Exists',
+        // defaults to a complete evaluation
+        virtual bool DoExists(const EvalResult& res) const;
+        // Limited evaluation proper, always called through `EvalFirst',
+        // defaults to a complete evaluation
+        virtual EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const;
+        // Records the document parts reachable from this node, `whole' if
+        // its result is consumed as complete subtrees
+        virtual void Project(Projection& proj, bool whole) const;
+        // Kind of the results of `Eval'
+        virtual ResultKind kind() const
+        {
+            return ResultKind::NODES;
+        }
+        // Tells if the edge at an index may evaluate to `kind', only to
+        // nodes by default
+        virtual bool Accepts(size_t, ResultKind kind) const
+        {
+            return kind == ResultKind::NODES;
+        }
+        // Tells if the edge at an index is evaluated on context nodes, given
+        // if this node is
+        virtual bool EdgeContext(size_t, bool context) const
+        {
+            return context;
+        }
+        // Tells if the result is read from the context nodes
+        virtual bool ReadsContext() const
+        {
+            return false;
+        }
 
         const_iterator begin() const
         {
@@ -74,11 +133,31 @@ class Node : public NonCopyable, public NonMoveable
         }
 };
 
-class Ast : public NonCopyable, public NonMoveable
+// Gathered for every node when the evaluation is analyzed, times,
+// allocations and hardware events are exclusive of the children unless
+// stated otherwise
+struct EvalStats
 {
-    friend class Parser;
+    uint64_t   calls = 0;
+    uint64_t   inclusive_ns = 0;
+    uint64_t   exclusive_ns = 0;
+    uint64_t   input_items = 0;
+    uint64_t   output_items = 0;
+    uint64_t   bytes = 0;
+    // 0 unless counted (see `Ast::set_perf')
+    PerfValues counters;
+};
+
+/*
+ * State of one evaluation of a query: the variables in scope, the nodes
+ * constructed, the result and the statistics when analyzed. The evaluation
+ * only reads the AST and the loaded documents, threads evaluate the same or
+ * different queries at once, each one with its own context.
+ */
+class ExecutionContext : public NonCopyable, public NonMoveable
+{
+    friend class Ast;
 
-    using NodeUPtr = std::unique_ptr<const Node>;
     #define SCOPE_DELIM "{SD}"
 
     public:
@@ -86,31 +165,70 @@ class Ast : public NonCopyable, public NonMoveable
         using Context = std::vector<VarDef>;
         using ContextStack = std::deque<VarDef>;
 
-        Ast()
+        ExecutionContext()
         {
             collector_.create_root_node("collector");
         }
-        ~Ast() = default;
+        ~ExecutionContext() = default;
 
-        void PlotGraph() const; // Throws `std::ios_base'
-        void Evaluate() const;  // Throws `std::runtime_error'
+        // Replaces the result by `nodes'
+        void SetResult(const xml::NodeList& nodes);
+        void Output(std::ostream& out) const;
+        // Items of the result, serialized
+        std::vector<std::string> ResultItems() const;
+        // Statistics of the last analyzed evaluation per node id, empty if
+        // the evaluation was not analyzed
+        const std::vector<EvalStats>& stats() const
+        {
+            return stats_;
+        }
+        // Context of a thread evaluating a part of this evaluation (see
+        // `Ast::Distribute'), with the variables in scope. It is kept with
+        // the nodes it constructs until the next evaluation.
+        ExecutionContext& Fork();
+        // Collection evaluated to the document `shard_root' alone in this
+        // context, null unless it evaluates a part of a collection
+        const Node* shard() const
+        {
+            return shard_;
+        }
+        xml::Node* shard_root() const
+        {
+            return shard_root_;
+        }
+        // Results kept from the previous evaluations and reused by this one
+        // (see `ResultMemo'), null if none are
+        ResultMemo* memo() const
+        {
+            return memo_;
+        }
+        void set_memo(ResultMemo* memo)
+        {
+            memo_ = memo;
+        }
+        // Document holding the nodes constructed
+        const xmlDoc* collector() const
+        {
+            return collector_.get_root_node()->cobj()->doc;
+        }
 
         /*
          * Node specific
          */
         xml::Element* CollectElement(const std::string& name)
         {
+            MemoryScope scope{MemoryCategory::CONSTRUCTED};
             return collector_.get_root_node()->add_child(name);
         }
         xml::TextNode* CollectTextNode(const std::string& content)
         {
-            static size_t id = 0;
-
-            auto node = collector_.get_root_node()->add_child("#" + std::to_string(id++));
+            MemoryScope scope{MemoryCategory::CONSTRUCTED};
+            auto node = collector_.get_root_node()->add_child("#" + std::to_string(texts_++));
             return node->add_child_text(content);
         }
         void CtxNew()
         {
+            MemoryScope scope{MemoryCategory::BINDINGS};
             context_stack_.emplace_front(SCOPE_DELIM, xml::NodeList{});
         }
         void CtxDestroy()
@@ -121,10 +239,18 @@ class Ast : public NonCopyable, public NonMoveable
         }
         void CtxPushVarDef(const std::string& varname, xml::NodeList&& nodes)
         {
+            MemoryScope scope{MemoryCategory::BINDINGS};
             context_stack_.emplace_front(varname, std::move(nodes));
         }
+        // Binds `varname' to `node' alone
+        void CtxPushVarDef(const std::string& varname, xml::Node* node)
+        {
+            MemoryScope scope{MemoryCategory::BINDINGS};
+            context_stack_.emplace_front(varname, xml::NodeList{node});
+        }
         VarDef CtxPopVarDef()
         {
+            MemoryScope scope{MemoryCategory::BINDINGS};
             auto vdef = context_stack_.front();
             context_stack_.pop_front();
             return vdef;
@@ -138,6 +264,140 @@ class Ast : public NonCopyable, public NonMoveable
             return it->second;
         }
 
+    private:
+        ContextStack                  context_stack_;
+        xml::Document                 collector_; // XXX: xmlpp pseudo factory
+        size_t                        texts_ = 0; // Text nodes collected
+        mutable xml::Document         output_doc_;
+        std::vector<EvalStats>        stats_;
+        // Counters of the thread evaluating, opened on the first evaluation
+        std::unique_ptr<PerfCounters> counters_;
+        // Inclusive totals of the children of the node being evaluated
+        uint64_t                      children_ns_ = 0;
+        uint64_t                      children_bytes_ = 0;
+        PerfValues                    children_counters_;
+        // Contexts of the threads of the evaluation
+        std::vector<std::unique_ptr<ExecutionContext>> forks_;
+        const Node*                   shard_ = nullptr;
+        xml::Node*                    shard_root_ = nullptr;
+        ResultMemo*                   memo_ = nullptr;
+};
+
+class Ast : public NonCopyable, public NonMoveable
+{
+    friend class Parser;
+
+    using NodeUPtr = std::unique_ptr<const Node>;
+
+    public:
+        // Queries sharing `documents' load them once
+        Ast(DocumentStore& documents) : documents_(documents) {}
+        ~Ast() = default;
+
+        // Labels the nodes with the statistics of `analyzed' if any
+        void PlotGraph(const ExecutionContext* analyzed = nullptr) const; // Throws `std::ios_base'
+        // Stores the result in `context', threads may evaluate the query at
+        // once with their own contexts
+        // Throws `std::runtime_error'
+        void Evaluate(ExecutionContext& context) const;
+        // Prints the node tree annotated with the plans of the clauses and
+        // the statistics of `analyzed' (if any), plans the clauses not
+        // evaluated yet
+        // Throws `std::runtime_error'
+        void Explain(std::ostream& out, const ExecutionContext* analyzed = nullptr) const;
+        // Removes the nodes evaluating to their single edge (grammar non
+        // terminals and parentheses) from the evaluated tree, resolves the
+        // variables to their definitions, checks the kinds of the results
+        // and lowers the paths (see `LoweredPath' and `Distribute')
+        // Throws `std::runtime_error' if a result is not of the kind its
+        // consumer expects or a step has no context node
+        void Compile();
+        // Evaluates the paths translated in `native' with it, `native' must
+        // have the plan of the query
+        void Bind(const NativeQuery& native);
+        // Restricts the documents loaded to the parts the query can reach
+        void ProjectDocuments();
+        // Adds the document parts the query can reach to `proj'
+        void Project(Projection& proj) const;
+        const Node* root() const
+        {
+            return root_;
+        }
+        // Normalized form of the query, the node labels (with their
+        // parentheses escaped) in prefix order
+        std::string Fingerprint() const;
+        // Files the query reads (`doc()' inputs and collection files)
+        // Throws `std::runtime_error'
+        std::vector<std::string> Inputs() const;
+
+        /*
+         * Node specific
+         */
+        DocumentStore& documents()
+        {
+            return documents_;
+        }
+        Planner& planner()
+        {
+            return planner_;
+        }
+        // Context of the evaluation running on the calling thread
+        ExecutionContext& context() const;
+        bool analyzing() const
+        {
+            return analyze_;
+        }
+        void set_analyze(bool enabled)
+        {
+            analyze_ = enabled;
+        }
+        // Adds the hardware events (see `PerfCounters') of every node to the
+        // statistics of the analyzed evaluations
+        void set_perf(bool enabled)
+        {
+            perf_ = enabled;
+        }
+        // Records the evaluation of every node in the tracer started (see
+        // `Tracer')
+        void set_trace(bool enabled)
+        {
+            trace_ = enabled;
+        }
+        // Tells if the evaluation of a node goes through `Instrument*'
+        bool instrumented() const
+        {
+            return analyze_ || trace_;
+        }
+        // `Node::Eval' recording the statistics and the span of `node'
+        Node::EvalResult InstrumentEval(const Node* node, const Node::EvalResult& res) const;
+        // `Node::Exists' recording the statistics and the span of `node'
+        bool InstrumentExists(const Node* node, const Node::EvalResult& res) const;
+        // `Node::EvalFirst' recording the statistics and the span of `node'
+        Node::EvalResult InstrumentEvalFirst(const Node* node, const Node::EvalResult& res,
+                                             size_t limit) const;
+        // Evaluates the first `limit' items of the query only, 0 for all
+        void set_limit(size_t limit)
+        {
+            limit_ = limit;
+        }
+        // Threads evaluating the documents of a collection, 0 for one per
+        // core
+        void set_threads(size_t threads)
+        {
+            threads_ = threads;
+        }
+        // First `limit' nodes of the results of `eval' evaluated once per
+        // document of `collection', concatenated in the order of the
+        // documents. The documents are evaluated on the threads of the
+        // query, each thread with its own context, in which `collection'
+        // evaluates to the document alone, until the first documents give
+        // `limit' nodes. The evaluations already on a part of a collection,
+        // the instrumented ones and the ones reusing results stay on the
+        // calling thread.
+        // Throws the first error of the documents, in their order
+        xml::NodeList Distribute(const Node* collection, const std::function<xml::NodeList ()>& eval,
+                                 size_t limit = std::numeric_limits<size_t>::max()) const;
+
     private:
         /*
          * Parser specific
@@ -165,12 +425,28 @@ class Ast : public NonCopyable, public NonMoveable
             root_ = node;
         }
 
+        // Runs `eval' on behalf of `node', recording its statistics if
+        // analyzing and its span (in `category') if tracing
+        template <typename Eval>
+        auto Instrument(const Node* node, const char* category, const Node::EvalResult& res,
+                        Eval eval) const -> decltype(eval());
+        // Lowers the paths of the query (see `LoweredPath'), finds the ones
+        // evaluated one document of a collection at a time and the paths and
+        // tuples whose results can be kept (see `ResultMemo')
+        void Lower();
+        std::string StatsLabel(const EvalStats& stats) const;
+        std::string PlanLabel(const Node* node) const;
+
         std::vector<NodeUPtr> nodes_;
-        ContextStack          context_stack_;
         Node::Edges           edges_buf_;
         const Node*           root_ = nullptr;
-        xml::Document         collector_; // XXX: xmlpp pseudo factory
-        mutable xml::Document output_doc_;
+        DocumentStore&        documents_;
+        Planner               planner_{documents_};
+        size_t                limit_ = 0;
+        size_t                threads_ = 0;
+        bool                  analyze_ = false;
+        bool                  perf_ = false;
+        bool                  trace_ = false;
 };
 
 }
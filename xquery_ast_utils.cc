@@ -1,53 +1,215 @@
 #include <vector>
 #include <cassert>
+#include <algorithm>
 
 #include "xquery_ast_utils.h"
+#include "xquery_trace.h"
 
 namespace xquery
 {
 
-void ContextIterator::ctx_iterator::IncSetIterator(size_t idx)
+size_t SequenceHash(const xml::NodeList& nodes)
+{
+    size_t hash = nodes.size();
+
+    for (auto node : nodes)
+        hash = hash * 31 + StructuralHash(node->cobj());
+    return hash;
+}
+
+std::vector<size_t> ContextIterator::ctx_iterator::SourcePositions() const
 {
-    auto& it = set_iter_[idx];
-
-    ref_node_->ast_->CtxPopVarDef();
-    if (++it == std::end(ctx_[idx].second)) {
-        if (idx == 0)
-            ended_ = true;
-        else
-            IncSetIterator(idx - 1);
+    std::vector<size_t> positions(positions_.size());
+
+    for (size_t i = 0; i < positions_.size(); ++i)
+        positions[plan_->order[i]] = positions_[i];
+    return positions;
+}
+
+bool ContextIterator::ctx_iterator::Satisfies() const
+{
+    return Accepts(plan_->residual);
+}
+
+bool ContextIterator::ctx_iterator::Accepts(const std::vector<const Node*>& conditions) const
+{
+    return std::all_of(std::begin(conditions), std::end(conditions),
+      [](const Node* condition) { return condition->Exists({}); });
+}
+
+bool ContextIterator::ctx_iterator::First(size_t idx)
+{
+    const auto& nodes = ctx_[idx].second;
+    const auto& sides = plan_->joins[idx];
+    auto& join = joins_[idx];
+
+    if ( !sides.build) {
+        set_iter_[idx] = std::begin(nodes);
+        positions_[idx] = 0;
+        return true;
     }
-    else
-        ref_node_->ast_->CtxPushVarDef(ctx_[idx].first, {*it});
 
-    // Reevaluate the upper variable definitions
-    if (!ended_ && idx < ctx_.size() - 1) {
-        ++idx;
-        // XXX: Here an empty `EvalResult' is tolerated (see xquery_nodes.cc)
-        ref_node_->edges_[idx]->Eval({});
-        auto vdef = ref_node_->ast_->CtxPopVarDef();
-        auto it = std::begin(vdef.second);
-        ref_node_->ast_->CtxPushVarDef(vdef.first, {*it});
-        ctx_[idx] = std::move(vdef);
-        set_iter_[idx] = std::move(it);
+    auto& context = ref_node_->ast_->context();
+    if ( !join.built) {
+        // An empty sequence equals none
+        size_t pos = 0;
+        for (auto it = std::begin(nodes); it != std::end(nodes); ++it, ++pos) {
+            context.CtxPushVarDef(ctx_[idx].first, *it);
+            auto build_res = sides.build->Eval({});
+            context.CtxPopVarDef();
+            if ( !build_res.nodes.empty())
+                join.table[SequenceHash(build_res.nodes)].emplace_back(pos, it);
+        }
+        join.built = true;
+    }
+    auto probe_res = sides.probe->Eval({});
+    join.candidates = nullptr;
+    if ( !probe_res.nodes.empty()) {
+        auto it = join.table.find(SequenceHash(probe_res.nodes));
+        if (it != std::end(join.table))
+            join.candidates = &it->second;
+    }
+    if ( !join.candidates)
+        return false;
+    join.next = 1;
+    positions_[idx] = join.candidates->front().first;
+    set_iter_[idx] = join.candidates->front().second;
+    return true;
+}
+
+bool ContextIterator::ctx_iterator::Next(size_t idx)
+{
+    auto& join = joins_[idx];
+
+    if ( !plan_->joins[idx].build) {
+        ++positions_[idx];
+        return ++set_iter_[idx] != std::end(ctx_[idx].second);
+    }
+    if (join.next == join.candidates->size())
+        return false;
+    const auto& candidate = (*join.candidates)[join.next++];
+    positions_[idx] = candidate.first;
+    set_iter_[idx] = candidate.second;
+    return true;
+}
+
+void ContextIterator::ctx_iterator::IncSetIterator(size_t idx)
+{
+    auto& context = ref_node_->ast_->context();
+    TraceSpan span{"advance", ref_node_->label(), ref_node_->id()};
+
+    for (;;) {
+        // Advance the binding, the lower ones are advanced when it is exhausted
+        context.CtxPopVarDef();
+        while ( !Next(idx)) {
+            if (idx == 0) {
+                ended_ = true;
+                return;
+            }
+            context.CtxPopVarDef();
+            --idx;
+        }
+        context.CtxPushVarDef(ctx_[idx].first, *set_iter_[idx]);
+        if ( !Accepts(plan_->conditions[idx]))
+            continue;
+
+        // Reevaluate the upper variable definitions, invariant ones are reused
+        bool accepted = true;
+        while (accepted && idx < ctx_.size() - 1) {
+            if ( !plan_->invariant[idx + 1]) {
+                // XXX: Here an empty `EvalResult' is tolerated (see xquery_nodes.cc)
+                ref_node_->edges_[plan_->order[idx + 1]]->Eval({});
+                auto vdef = context.CtxPopVarDef();
+                // Nothing to bind, the current binding is advanced again
+                if (vdef.second.empty())
+                    break;
+                ctx_[idx + 1] = std::move(vdef);
+            }
+            // No hashed node matches, likewise
+            if ( !First(idx + 1))
+                break;
+            ++idx;
+            context.CtxPushVarDef(ctx_[idx].first, *set_iter_[idx]);
+            accepted = Accepts(plan_->conditions[idx]);
+        }
+        if (accepted && idx == ctx_.size() - 1)
+            return;
     }
 }
 
 ContextIterator::ctx_iterator ContextIterator::begin(const Node* node) const
 {
-    Ast::Context  ctx;
-    NodeListSetIt set_iter;
+    TraceSpan span{"advance", node->label(), node->id()};
+    const auto& plan = this->plan(node);
+    auto& context = node->ast_->context();
+    ctx_iterator ctx_it{node, &plan};
+    auto& ctx = ctx_it.ctx_;
+    auto& set_iter = ctx_it.set_iter_;
 
-    for (auto edge : node->edges_) {
+    while (ctx.size() < node->edges_.size() && !ctx_it.ended_) {
         // XXX: Here an empty `EvalResult' is tolerated (see xquery_nodes.cc)
-        edge->Eval({});
-        auto vdef = node->ast_->CtxPopVarDef();
-        auto it = std::begin(vdef.second);
-        node->ast_->CtxPushVarDef(vdef.first, {*it});
+        node->edges_[plan.order[ctx.size()]]->Eval({});
+        auto vdef = context.CtxPopVarDef();
+        // Nothing to bind, the lower bindings are advanced before retrying
+        // (an invariant binding stays empty)
+        if (vdef.second.empty()) {
+            if (ctx.empty() || plan.invariant[ctx.size()]) {
+                for (size_t i = 0; i < ctx.size(); ++i)
+                    context.CtxPopVarDef();
+                ctx_it.ended_ = true;
+            }
+            else
+                ctx_it.IncSetIterator(ctx.size() - 1);
+            continue;
+        }
         ctx.push_back(std::move(vdef));
-        set_iter.push_back(std::move(it));
+        set_iter.push_back(std::begin(ctx.back().second));
+        ctx_it.positions_.push_back(0);
+        // No hashed node matches, the lower bindings are advanced (the
+        // level is kept, its binding is invariant)
+        if ( !ctx_it.First(ctx.size() - 1)) {
+            if (ctx.size() == 1)
+                ctx_it.ended_ = true;
+            else
+                ctx_it.IncSetIterator(ctx.size() - 2);
+            continue;
+        }
+        context.CtxPushVarDef(ctx.back().first, *set_iter.back());
+        // The first binding accepted is searched at this level
+        if ( !ctx_it.Accepts(plan.conditions[ctx.size() - 1]))
+            ctx_it.IncSetIterator(ctx.size() - 1);
     }
-    return {node, std::move(ctx), std::move(set_iter)};
+    return ctx_it;
+}
+
+const BindingPlan& ContextIterator::plan(const Node* node) const
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+
+    // Concurrent evaluations share the plan and wait for a concurrent
+    // planning, a failed one is tried again
+    planned_.wait(lock, [this]() { return !planning_; });
+    if (plan_)
+        return *plan_;
+    planning_ = true;
+    lock.unlock();
+
+    std::unique_ptr<BindingPlan> plan;
+    try {
+        plan.reset(new BindingPlan{node->ast_->planner().PlanBindings(node, condition_, late_bindings_)});
+    }
+    catch (...) {
+        lock.lock();
+        planning_ = false;
+        planned_.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    plan_ = std::move(plan);
+    planning_ = false;
+    planned_.notify_all();
+    return *plan_;
 }
 
 Node::EvalResult::EvalResult(EvalResult&& res) : type{res.type}
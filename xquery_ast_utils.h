@@ -1,13 +1,21 @@
 #pragma once
 
 #include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 #include "xquery_xml.h"
 #include "xquery_ast.h"
+#include "xquery_planner.h"
 
 namespace xquery
 {
 
+// Hash of a sequence of nodes, value equal sequences (see `Equality') have
+// the same hash
+size_t SequenceHash(const xml::NodeList& nodes);
+
 class ContextIterator
 {
     protected:
@@ -17,19 +25,35 @@ class ContextIterator
     public:
         class ctx_iterator
         {
+            friend class ContextIterator;
+
             public:
-                ctx_iterator(const Node* ref_node, Ast::Context&& ctx, NodeListSetIt&& set_iter)
+                ctx_iterator(const Node* ref_node, const BindingPlan* plan)
                   : ref_node_{ref_node},
-                    ctx_{std::move(ctx)},
-                    set_iter_{std::move(set_iter)} {}
+                    plan_{plan},
+                    joins_(plan->joins.size()) {}
                 ctx_iterator(bool ended) : ended_{ended} {}
                 ctx_iterator(ctx_iterator&& it)
                   : ref_node_{it.ref_node_},
+                    plan_{it.plan_},
                     ctx_{std::move(it.ctx_)},
                     set_iter_{std::move(it.set_iter_)},
+                    positions_{std::move(it.positions_)},
+                    joins_{std::move(it.joins_)},
                     ended_{it.ended_} {}
                 ~ctx_iterator() = default;
 
+                bool reordered() const
+                {
+                    return plan_->reordered;
+                }
+                // Positions of the bound nodes in their sequences, in the
+                // order of the clause (the order of the results without
+                // reordering)
+                std::vector<size_t> SourcePositions() const;
+                // Checks the conditions left once every binding is done
+                bool Satisfies() const;
+
                 ctx_iterator& operator++()
                 {
                     IncSetIterator(set_iter_.size() - 1);
@@ -45,12 +69,33 @@ class ContextIterator
                 }
 
             private:
+                // Positions of the hashed nodes of a hash join level by hash,
+                // and the ones left to bind for the current probe
+                struct Join
+                {
+                    using Candidates = std::vector<std::pair<size_t, NodeListIt>>;
+
+                    std::unordered_map<size_t, Candidates> table;
+                    bool                                   built = false;
+                    const Candidates*                      candidates = nullptr;
+                    size_t                                 next = 0;
+                };
+
                 void IncSetIterator(size_t idx);
+                // Moves the level to its first node, its next one, tells if
+                // there is none
+                bool First(size_t idx);
+                bool Next(size_t idx);
+                bool Accepts(const std::vector<const Node*>& conditions) const;
 
-                const Node*   ref_node_ = nullptr;
-                Ast::Context  ctx_;
-                NodeListSetIt set_iter_;
-                bool          ended_ = false;
+                const Node*               ref_node_ = nullptr;
+                const BindingPlan*        plan_ = nullptr;
+                // Per loop level
+                ExecutionContext::Context ctx_;
+                NodeListSetIt             set_iter_;
+                std::vector<size_t>       positions_;
+                std::vector<Join>         joins_;
+                bool                      ended_ = false;
         };
 
         ctx_iterator begin(const Node* node) const;
@@ -58,6 +103,30 @@ class ContextIterator
         {
             return true;
         }
+        // The conjuncts of `condition' are checked as soon as the variables
+        // they reference are bound, but the ones referencing the variables
+        // of `late_bindings' (defined once every binding is done)
+        void set_condition(const Node* condition, const Node* late_bindings) const
+        {
+            condition_ = condition;
+            late_bindings_ = late_bindings;
+        }
+        // Planned on the first call
+        const BindingPlan& plan(const Node* node) const;
+        const BindingPlan* planned() const
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            return plan_.get();
+        }
+
+    private:
+        // Planned once (`planning' while a thread plans it)
+        mutable std::unique_ptr<BindingPlan> plan_;
+        mutable bool                         planning_ = false;
+        mutable std::mutex                   mutex_;
+        mutable std::condition_variable      planned_;
+        mutable const Node*                  condition_ = nullptr;
+        mutable const Node*                  late_bindings_ = nullptr;
 };
 
 struct Node::EvalResult
@@ -87,4 +156,25 @@ struct Node::EvalResult
     UnionType type;
 };
 
+inline Node::EvalResult Node::Eval(const EvalResult& res) const
+{
+    if (ast_->instrumented())
+        return ast_->InstrumentEval(this, res);
+    return DoEval(res);
+}
+
+inline Node::EvalResult Node::EvalFirst(const EvalResult& res, size_t limit) const
+{
+    if (ast_->instrumented())
+        return ast_->InstrumentEvalFirst(this, res, limit);
+    return DoEvalFirst(res, limit);
+}
+
+inline bool Node::Exists(const EvalResult& res) const
+{
+    if (ast_->instrumented())
+        return ast_->InstrumentExists(this, res);
+    return DoExists(res);
+}
+
 }
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <deque>
+#include <functional>
+
+#include "xquery_batch.h"
+#include "xquery_nodes.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+namespace xql = lang;
+
+// Appends the steps of `node', the first one being a descendant step if
+// `descendants'
+bool CollectSteps(const Node* node, bool descendants, std::string& document, PathSteps& steps)
+{
+    if (auto doc = dynamic_cast<const xql::Document*>(node)) {
+        if ( !document.empty())
+            return false;
+        document = doc->name();
+        return true;
+    }
+    // Steps apply once the document is known
+    if (auto tag = dynamic_cast<const xql::TagName*>(node)) {
+        if (document.empty())
+            return false;
+        steps.push_back({tag->tagname(), descendants});
+    }
+    else if (auto sep = dynamic_cast<const xql::PathSeparator*>(node))
+        return CollectSteps(*std::begin(*sep), descendants, document, steps) &&
+               CollectSteps(*(std::begin(*sep) + 1), sep->descendants(), document, steps);
+    else
+        return false;
+    return true;
+}
+
+}
+
+bool SimplePath(const Node* root, std::string& document, PathSteps& steps)
+{
+    document.clear();
+    steps.clear();
+    return CollectSteps(root, false, document, steps) && !steps.empty();
+}
+
+struct PathAutomaton::Traversal
+{
+    size_t                                                            position = 0;
+    std::deque<Derivation>                                            derivations;
+    std::vector<std::vector<std::pair<const Derivation*, xmlNode*>>> matches;
+    std::vector<bool>                                                 repeated;
+};
+
+size_t PathAutomaton::Add(const PathSteps& steps)
+{
+    size_t state = 0;
+
+    for (const auto& step : steps) {
+        if (step.descendants) {
+            if (states_[state].descendants == 0) {
+                states_.emplace_back();
+                states_.back().loops = true;
+                states_[state].descendants = states_.size() - 1;
+            }
+            state = states_[state].descendants;
+            states_[state].paths.push_back(paths_);
+        }
+        auto it = states_[state].next.find(step.tag);
+        if (it == std::end(states_[state].next)) {
+            states_.emplace_back();
+            it = states_[state].next.emplace(step.tag, states_.size() - 1).first;
+        }
+        state = it->second;
+        states_[state].paths.push_back(paths_);
+    }
+    states_[state].accepts.push_back(paths_);
+    return paths_++;
+}
+
+namespace
+{
+
+// Order of the derivations of the same path in the result of the
+// interpreter, negative if `a' comes first
+template <typename Derivation>
+int CompareDerivations(const Derivation* a, const Derivation* b)
+{
+    if (a == b)
+        return 0;
+    if (auto previous = CompareDerivations(a->previous, b->previous))
+        return previous;
+    if (a->parent != b->parent)
+        return a->parent < b->parent ? -1 : 1;
+    return a->position < b->position ? -1 : a->position > b->position;
+}
+
+}
+
+PathAutomaton::Matches PathAutomaton::Run(xml::Element* root) const
+{
+    Matches matches;
+    Traversal traversal;
+    std::vector<Active> active{{0, nullptr}};
+
+    matches.nodes.resize(paths_);
+    matches.repeated.assign(paths_, false);
+    if (root == nullptr)
+        return matches;
+    traversal.matches.resize(paths_);
+    traversal.repeated.assign(paths_, false);
+    Close(active, traversal);
+    Match(root->cobj(), traversal.position++, active, traversal);
+
+    auto precedes = [](const std::pair<const Derivation*, xmlNode*>& a,
+                       const std::pair<const Derivation*, xmlNode*>& b) {
+        return CompareDerivations(a.first, b.first) < 0;
+    };
+    for (size_t path = 0; path < paths_; ++path) {
+        auto& found = traversal.matches[path];
+        matches.repeated[path] = traversal.repeated[path];
+        if (matches.repeated[path])
+            continue;
+        // In document order unless a step matches nested elements
+        if ( !std::is_sorted(std::begin(found), std::end(found), precedes))
+            std::stable_sort(std::begin(found), std::end(found), precedes);
+        for (const auto& match : found) {
+            xml::Node::create_wrapper(match.second);
+            matches.nodes[path].push_back(static_cast<xml::Node*>(match.second->_private));
+        }
+    }
+    return matches;
+}
+
+void PathAutomaton::Close(std::vector<Active>& active, Traversal& traversal) const
+{
+    auto less = [](const Active& a, const Active& b) {
+        return a.state < b.state ||
+               (a.state == b.state && std::less<const Derivation*>{}(a.derivation, b.derivation));
+    };
+    auto same = [](const Active& a, const Active& b) {
+        return a.state == b.state && a.derivation == b.derivation;
+    };
+
+    for (size_t i = 0; i < active.size(); ++i)
+        if (states_[active[i].state].descendants)
+            active.push_back({states_[active[i].state].descendants, active[i].derivation});
+    std::sort(std::begin(active), std::end(active), less);
+    active.erase(std::unique(std::begin(active), std::end(active), same), std::end(active));
+
+    // A looping state entered by nested matches of a step leads to nodes
+    // derived twice, two of its derivations are enough to tell. The
+    // other states keep one, the paths going through them are flagged.
+    size_t kept = 0;
+    for (size_t i = 0, count = 0; i < active.size(); ++i) {
+        const auto& state = states_[active[i].state];
+        count = (i > 0 && active[i - 1].state == active[i].state) ? count + 1 : 1;
+        if (count > 1 && !state.loops)
+            for (auto path : state.paths)
+                traversal.repeated[path] = true;
+        if (count <= (state.loops ? 2 : 1))
+            active[kept++] = active[i];
+    }
+    active.resize(kept);
+}
+
+void PathAutomaton::Match(xmlNode* parent, size_t position, const std::vector<Active>& active,
+                          Traversal& traversal) const
+{
+    std::vector<Active> next;
+
+    // Steps match the children by name, texts included (as `get_children')
+    for (auto child = parent->children; child; child = child->next) {
+        std::string tag{reinterpret_cast<const char*>(child->name)};
+        auto child_position = traversal.position++;
+        next.clear();
+        for (const auto& entry : active) {
+            const auto& state = states_[entry.state];
+            auto it = state.next.find(tag);
+            if (state.loops)
+                next.push_back(entry);
+            if (it != std::end(state.next)) {
+                traversal.derivations.push_back({entry.derivation, position, child_position});
+                next.push_back({it->second, &traversal.derivations.back()});
+            }
+        }
+        // No path goes through the subtree
+        if (next.empty())
+            continue;
+
+        Close(next, traversal);
+        for (const auto& entry : next)
+            for (auto path : states_[entry.state].accepts)
+                traversal.matches[path].push_back({entry.derivation, child});
+        if (child->type == XML_ELEMENT_NODE)
+            Match(child, child_position, next, traversal);
+    }
+}
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+
+namespace xquery
+{
+
+class Node;
+
+// Child (`/') or descendant (`//') step on a tag name
+struct PathStep
+{
+    std::string tag;
+    bool        descendants;
+};
+
+using PathSteps = std::vector<PathStep>;
+
+// Tells if the query `root' is a path of tag steps from a document, stored
+// in `document' and `steps' if so
+bool SimplePath(const Node* root, std::string& document, PathSteps& steps);
+
+/*
+ * Automaton of many paths (YFilter): the paths share the states of their
+ * common prefixes and a descendant step goes through a state looping on any
+ * element, so that a single traversal of a document matches all of them.
+ * The matches are listed as the interpreter does, step after step: by the
+ * match of the first step, then of the second one, and so on, each one
+ * after its parent.
+ */
+class PathAutomaton : public NonCopyable, public NonMoveable
+{
+    public:
+        struct Matches
+        {
+            // Nodes matched per path
+            std::vector<xml::NodeList> nodes;
+            // Paths reaching a node through several matches of a step (the
+            // interpreter lists it more than once), their nodes are not kept
+            std::vector<bool>          repeated;
+        };
+
+        PathAutomaton() : states_(1) {}
+        ~PathAutomaton() = default;
+
+        // Returns the index of the path in the matches
+        size_t Add(const PathSteps& steps);
+        // Matches the descendants of `root' (the result of `doc()')
+        Matches Run(xml::Element* root) const;
+
+    private:
+        struct State
+        {
+            std::unordered_map<std::string, size_t> next;
+            size_t              descendants = 0; // Looping state, 0 if none
+            bool                loops = false;
+            std::vector<size_t> accepts;         // Paths ending here
+            std::vector<size_t> paths;           // Paths going through
+        };
+        // Matches of the steps of a path up to a node, by their position in
+        // the traversal
+        struct Derivation
+        {
+            const Derivation* previous; // Null for the first step
+            size_t            parent;
+            size_t            position;
+        };
+        struct Active
+        {
+            size_t            state;
+            const Derivation* derivation;
+        };
+        struct Traversal;
+
+        // Adds the looping states reached without consuming an element
+        void Close(std::vector<Active>& active, Traversal& traversal) const;
+        void Match(xmlNode* parent, size_t position, const std::vector<Active>& active,
+                   Traversal& traversal) const;
+
+        // The first state is the initial one
+        std::vector<State> states_;
+        size_t             paths_ = 0;
+};
+
+}
@@ -0,0 +1,305 @@
+#include <fstream>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "xquery_binary.h"
+
+#define BYTE_ORDER_MARK 0x01020304
+
+namespace xquery
+{
+
+namespace
+{
+
+const char kMagic[4] = {'X', 'Q', 'B', '\n'};
+
+class BinaryWriter
+{
+    using NodeRecord = BinaryDocument::NodeRecord;
+
+    public:
+        // Throws `std::runtime_error' on the nodes the format can not hold
+        void Write(const xmlNode* node);
+        void Save(const std::string& filename) const; // Throws `std::runtime_error'
+
+    private:
+        uint32_t AddTag(const xmlChar* name);
+        uint64_t AddString(const char* str, size_t len);
+        void AddRecord(uint8_t kind, uint32_t name, const xmlChar* value)
+        {
+            const char* str = value ? reinterpret_cast<const char*>(value) : "";
+            auto len = std::strlen(str);
+
+            records_.push_back(NodeRecord{kind, {}, name, 0, 0, AddString(str, len), len});
+            records_.back().end = records_.size();
+        }
+
+        std::unordered_map<std::string, uint32_t> tag_ids_;
+        std::vector<BinaryDocument::TagRecord>    tags_;
+        std::vector<NodeRecord>                   records_;
+        std::string                               heap_;
+};
+
+uint32_t BinaryWriter::AddTag(const xmlChar* name)
+{
+    std::string tag{reinterpret_cast<const char*>(name)};
+    auto it = tag_ids_.find(tag);
+
+    if (it != std::end(tag_ids_))
+        return it->second;
+    tags_.push_back({AddString(tag.data(), tag.size()), tag.size()});
+    return tag_ids_[tag] = tags_.size() - 1;
+}
+
+uint64_t BinaryWriter::AddString(const char* str, size_t len)
+{
+    auto offset = heap_.size();
+
+    heap_.append(str, len);
+    heap_.push_back('\0');
+    return offset;
+}
+
+void BinaryWriter::Write(const xmlNode* node)
+{
+    switch (node->type) {
+        case XML_ELEMENT_NODE: {
+            auto idx = records_.size();
+            // Names are stored without their namespace
+            if (node->ns || node->nsDef)
+                throw std::runtime_error("namespaces are not supported");
+            AddRecord(BinaryDocument::ELEMENT, AddTag(node->name), nullptr);
+            for (auto attr = node->properties; attr; attr = attr->next) {
+                if (attr->ns)
+                    throw std::runtime_error("namespaces are not supported");
+                auto value = xmlNodeListGetString(node->doc, attr->children, 1);
+                AddRecord(BinaryDocument::ATTRIBUTE, AddTag(attr->name), value);
+                xmlFree(value);
+            }
+            for (auto child = node->children; child; child = child->next)
+                Write(child);
+            records_[idx].end = records_.size();
+            break;
+        }
+        case XML_TEXT_NODE:
+            AddRecord(BinaryDocument::TEXT, 0, node->content);
+            break;
+        case XML_CDATA_SECTION_NODE:
+            AddRecord(BinaryDocument::CDATA, 0, node->content);
+            break;
+        case XML_COMMENT_NODE:
+            AddRecord(BinaryDocument::COMMENT, 0, node->content);
+            break;
+        case XML_PI_NODE:
+            AddRecord(BinaryDocument::PI, AddTag(node->name), node->content);
+            break;
+        case XML_ENTITY_REF_NODE: // Not substituted by the loader
+            throw std::runtime_error("user defined entities are not supported");
+        default: // DTD and declarations are not needed by the evaluation
+            break;
+    }
+}
+
+void BinaryWriter::Save(const std::string& filename) const
+{
+    BinaryDocument::Header header;
+    auto tmp_filename = filename + ".tmp";
+    std::ofstream fs{tmp_filename, std::ios::binary | std::ios::trunc};
+
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = BinaryDocument::kVersion;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.reserved = 0;
+    header.tag_count = tags_.size();
+    header.node_count = records_.size();
+    header.tags_offset = sizeof(header);
+    header.nodes_offset = header.tags_offset + tags_.size() * sizeof(tags_[0]);
+    header.heap_offset = header.nodes_offset + records_.size() * sizeof(records_[0]);
+    header.heap_size = heap_.size();
+
+    fs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fs.write(reinterpret_cast<const char*>(tags_.data()), tags_.size() * sizeof(tags_[0]));
+    fs.write(reinterpret_cast<const char*>(records_.data()), records_.size() * sizeof(records_[0]));
+    fs.write(heap_.data(), heap_.size());
+    fs.close();
+    if ( !fs.good() || std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(tmp_filename.c_str());
+        throw std::runtime_error("Could not write " + filename);
+    }
+}
+
+}
+
+BinaryDocument::BinaryDocument(const std::string& filename) : filename_{filename}
+{
+    struct stat st;
+    int fd = open(filename_.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw std::runtime_error("Could not open " + filename_);
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_ = st.st_size;
+        map_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map_ == nullptr || map_ == MAP_FAILED) {
+        map_ = nullptr;
+        throw std::runtime_error("Could not map " + filename_);
+    }
+    madvise(map_, size_, MADV_SEQUENTIAL);
+
+    try {
+        Validate();
+    }
+    catch (...) {
+        munmap(map_, size_);
+        throw;
+    }
+}
+
+BinaryDocument::~BinaryDocument()
+{
+    munmap(map_, size_);
+}
+
+void BinaryDocument::Validate()
+{
+    auto fail = [this](const std::string& what) {
+        throw std::runtime_error(filename_ + ": " + what);
+    };
+
+    if (size_ < sizeof(Header))
+        fail("truncated header");
+    header_ = static_cast<const Header*>(map_);
+    if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0)
+        fail("not a binary document");
+    if (header_->version != kVersion || header_->byte_order != BYTE_ORDER_MARK)
+        fail("unsupported version " + std::to_string(header_->version));
+    // The regions follow the header in order. Counts are divided rather
+    // than multiplied, so corrupted ones cannot overflow past the checks.
+    auto fits = [](uint64_t offset, uint64_t count, uint64_t size, uint64_t end) {
+        return offset >= sizeof(Header) && offset <= end && count <= (end - offset) / size;
+    };
+    if (header_->heap_offset > size_ || header_->heap_size > size_ - header_->heap_offset ||
+        !fits(header_->nodes_offset, header_->node_count, sizeof(NodeRecord), header_->heap_offset) ||
+        !fits(header_->tags_offset, header_->tag_count, sizeof(TagRecord), header_->nodes_offset) ||
+        header_->node_count > UINT32_MAX)
+        fail("corrupted layout");
+
+    tags_ = reinterpret_cast<const TagRecord*>(heap(0) - header_->heap_offset + header_->tags_offset);
+    nodes_ = reinterpret_cast<const NodeRecord*>(heap(0) - header_->heap_offset + header_->nodes_offset);
+
+    auto in_heap = [this](uint64_t offset, uint64_t length) {
+        return offset < header_->heap_size && length < header_->heap_size - offset &&
+               heap(offset)[length] == '\0';
+    };
+    for (size_t i = 0; i < header_->tag_count; ++i)
+        if ( !in_heap(tags_[i].offset, tags_[i].length))
+            fail("corrupted tag dictionary");
+    for (size_t i = 0; i < header_->node_count; ++i) {
+        const auto& rec = nodes_[i];
+        bool named = rec.kind == ELEMENT || rec.kind == ATTRIBUTE || rec.kind == PI;
+        if (rec.kind > PI || rec.end <= i || rec.end > header_->node_count ||
+            (named && rec.name >= header_->tag_count) ||
+            !in_heap(rec.value, rec.length))
+            fail("corrupted node " + std::to_string(i));
+    }
+}
+
+xmlDoc* BinaryDocument::Materialize(const Projection& projection) const
+{
+    using xml_str = const xmlChar*;
+
+    auto doc = xmlNewDoc(reinterpret_cast<xml_str>("1.0"));
+    std::vector<xml_str> names;
+    std::vector<std::pair<xmlNode*, uint32_t>> parents{{reinterpret_cast<xmlNode*>(doc), header_->node_count}};
+    size_t covered = 0;
+
+    // Names are interned once in the document dictionary
+    doc->dict = xmlDictCreate();
+    names.reserve(header_->tag_count);
+    for (size_t i = 0; i < header_->tag_count; ++i)
+        names.push_back(xmlDictLookup(doc->dict, reinterpret_cast<xml_str>(heap(tags_[i].offset)),
+                                      tags_[i].length));
+
+    for (uint32_t i = 0; i < header_->node_count; ++i) {
+        const auto& rec = nodes_[i];
+        auto value = reinterpret_cast<xml_str>(heap(rec.value));
+        xmlNode* node = nullptr;
+
+        for (; i >= parents.back().second; parents.pop_back())
+            projection.Close(parents.back().first, covered);
+        auto parent = parents.back().first;
+
+        switch (rec.kind) {
+            case ELEMENT:
+                node = xmlNewDocNode(doc, nullptr, names[rec.name], nullptr);
+                parents.push_back({node, rec.end});
+                break;
+            case ATTRIBUTE:
+                xmlNewProp(parent, names[rec.name], value);
+                continue;
+            case TEXT:
+                node = xmlNewDocTextLen(doc, value, rec.length);
+                break;
+            case CDATA:
+                node = xmlNewCDataBlock(doc, value, rec.length);
+                break;
+            case COMMENT:
+                node = xmlNewDocComment(doc, value);
+                break;
+            case PI:
+                node = xmlNewDocPI(doc, names[rec.name], value);
+                break;
+        }
+        AppendChild(parent, node);
+        if (rec.kind == ELEMENT)
+            projection.Open(node, covered);
+    }
+    for (; parents.size() > 1; parents.pop_back())
+        projection.Close(parents.back().first, covered);
+    return doc;
+}
+
+void BinaryDocument::Convert(const std::string& xml_filename)
+{
+    BinaryWriter writer;
+    // Parsed as `DocumentStore' does, the binary form replaces that load
+    auto doc = xmlReadFile(xml_filename.c_str(), nullptr, DocumentStore::kParseOptions);
+
+    if (doc == nullptr)
+        throw std::runtime_error("Could not parse " + xml_filename);
+    try {
+        for (auto node = doc->children; node; node = node->next)
+            writer.Write(node);
+    }
+    catch (const std::runtime_error& e) {
+        xmlFreeDoc(doc);
+        throw std::runtime_error(xml_filename + ": " + e.what());
+    }
+    xmlFreeDoc(doc);
+    writer.Save(PathFor(xml_filename));
+}
+
+bool BinaryDocument::IsFresh(const std::string& xml_filename)
+{
+    struct stat xml_st, bin_st;
+
+    if (stat(xml_filename.c_str(), &xml_st) != 0 ||
+        stat(PathFor(xml_filename).c_str(), &bin_st) != 0)
+        return false;
+    // Strictly newer, the XML may have been modified within the timestamp
+    // the binary form was written in
+    return bin_st.st_mtim.tv_sec > xml_st.st_mtim.tv_sec ||
+           (bin_st.st_mtim.tv_sec == xml_st.st_mtim.tv_sec &&
+            bin_st.st_mtim.tv_nsec > xml_st.st_mtim.tv_nsec);
+}
+
+}
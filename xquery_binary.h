@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+#include "xquery_document.h"
+
+namespace xquery
+{
+
+/*
+ * Binary form of a parsed document (`<filename>.xqb'), mapped read-only:
+ *
+ *   Header | tag dictionary | node records (pre-order) | string heap
+ *
+ * Each record stores the pre-order index following its subtree, so the
+ * structure can be rebuilt, or whole subtrees skipped, without any parsing.
+ * Strings of the heap are NUL terminated.
+ */
+class BinaryDocument : public NonCopyable, public NonMoveable
+{
+    public:
+        static constexpr uint32_t kVersion = 1;
+
+        enum NodeKind : uint8_t
+        {
+            ELEMENT,
+            ATTRIBUTE,
+            TEXT,
+            CDATA,
+            COMMENT,
+            PI
+        };
+
+        struct Header
+        {
+            char     magic[4];
+            uint32_t version;
+            uint32_t byte_order;
+            uint32_t reserved;
+            uint64_t tag_count;
+            uint64_t node_count;
+            uint64_t tags_offset;
+            uint64_t nodes_offset;
+            uint64_t heap_offset;
+            uint64_t heap_size;
+        };
+
+        struct TagRecord
+        {
+            uint64_t offset;
+            uint64_t length;
+        };
+
+        struct NodeRecord
+        {
+            uint8_t  kind;
+            uint8_t  reserved[3];
+            uint32_t name;  // Tag dictionary index
+            uint32_t end;   // Pre-order index past the subtree
+            uint32_t reserved2;
+            uint64_t value; // Heap offset
+            uint64_t length;
+        };
+
+        // Throws `std::runtime_error'
+        BinaryDocument(const std::string& filename);
+        ~BinaryDocument();
+
+        // Builds a libxml2 tree out of the mapping, throws `std::runtime_error'
+        xmlDoc* Materialize(const Projection& projection) const;
+
+        // Parses `xml_filename' and writes its binary form, throws
+        // `std::runtime_error' (also if it uses namespaces or user defined
+        // entities, which the form does not hold)
+        static void Convert(const std::string& xml_filename);
+        static std::string PathFor(const std::string& xml_filename)
+        {
+            return xml_filename + ".xqb";
+        }
+        // True if the binary form exists and is newer than `xml_filename'
+        static bool IsFresh(const std::string& xml_filename);
+
+    private:
+        void Validate(); // Throws `std::runtime_error'
+        const char* heap(uint64_t offset) const
+        {
+            return static_cast<const char*>(map_) + header_->heap_offset + offset;
+        }
+
+        std::string       filename_;
+        void*             map_ = nullptr;
+        size_t            size_ = 0;
+        const Header*     header_ = nullptr;
+        const TagRecord*  tags_ = nullptr;
+        const NodeRecord* nodes_ = nullptr;
+};
+
+}
@@ -0,0 +1,144 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "xquery_cache.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+const std::string kEntryExtension = ".result";
+
+// FNV-1a
+uint64_t HashBytes(uint64_t hash, const std::string& bytes)
+{
+    for (auto c : bytes)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    return hash;
+}
+
+}
+
+ResultCache::ResultCache(const std::string& directory, uint64_t capacity)
+  : directory_{directory},
+    capacity_{capacity}
+{
+    if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST)
+        throw std::ios_base::failure{"Could not create " + directory_};
+}
+
+std::string ResultCache::Key(const std::string& plan, const std::vector<std::string>& inputs)
+{
+    std::ostringstream key;
+
+    key << plan;
+    // The lengths keep the names apart from their version
+    for (const auto& input : inputs) {
+        struct stat st;
+
+        key << '\0' << input.size() << ':' << input;
+        if (stat(input.c_str(), &st) == 0)
+            key << ':' << st.st_size << ':' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+    }
+    return key.str();
+}
+
+std::string ResultCache::Path(const std::string& key) const
+{
+    std::ostringstream path;
+
+    path << directory_ << "/" << std::hex << std::setw(16) << std::setfill('0')
+         << HashBytes(14695981039346656037ULL, key) << kEntryExtension;
+    return path.str();
+}
+
+bool ResultCache::Lookup(const std::string& key, std::string& result) const
+{
+    auto path = Path(key);
+    std::ifstream fs{path, std::ios::binary};
+    std::ostringstream content;
+    size_t length = 0;
+
+    // The key, preceded by its length, then the result
+    if ( !(fs >> length) || fs.get() != '\n' || length != key.size())
+        return false;
+    std::string stored(length, '\0');
+    if ( !fs.read(&stored[0], length) || stored != key)
+        return false;
+    content << fs.rdbuf();
+    if (fs.bad())
+        return false;
+    result = content.str();
+    // Marks the entry as the most recently used one
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return true;
+}
+
+void ResultCache::Store(const std::string& key, const std::string& result)
+{
+    // Written aside then renamed, a concurrent lookup never reads a partial
+    // entry
+    auto path = Path(key);
+    auto tmp_path = path + "." + std::to_string(getpid());
+    std::ofstream fs{tmp_path, std::ios::binary};
+
+    if ( !fs.good())
+        throw std::ios_base::failure{"Could not open " + tmp_path};
+    fs << key.size() << '\n' << key << result;
+    fs.close();
+    if (fs.fail() || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw std::ios_base::failure{"Could not write " + path};
+    }
+    Evict();
+}
+
+void ResultCache::Evict() const
+{
+    struct Entry
+    {
+        std::string path;
+        uint64_t    size;
+        uint64_t    used;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    auto dir = opendir(directory_.c_str());
+
+    if (dir == nullptr)
+        return;
+    for (auto entry = readdir(dir); entry; entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        struct stat st;
+
+        if (name.size() <= kEntryExtension.size() ||
+            name.compare(name.size() - kEntryExtension.size(), kEntryExtension.size(), kEntryExtension) != 0)
+            continue;
+        auto path = directory_ + "/" + name;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        entries.push_back({path, static_cast<uint64_t>(st.st_size),
+                           static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec});
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    std::sort(std::begin(entries), std::end(entries),
+      [](const Entry& e1, const Entry& e2) { return e1.used < e2.used; });
+    for (auto it = std::begin(entries); total > capacity_ && it != std::end(entries); ++it)
+        if (std::remove(it->path.c_str()) == 0)
+            total -= it->size;
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "xquery_misc.h"
+
+namespace xquery
+{
+
+/*
+ * Serialized results of queries stored in a directory, one file per key.
+ * Reading an entry marks it as used, the least recently used ones are
+ * evicted once the entries take more than `capacity' bytes.
+ */
+class ResultCache : public NonCopyable, public NonMoveable
+{
+    public:
+        // Throws `std::ios_base::failure' if the directory can not be created
+        ResultCache(const std::string& directory, uint64_t capacity);
+        ~ResultCache() = default;
+
+        // Key of the query `plan' on the files `inputs', identified by their
+        // size and modification time (they are not read)
+        static std::string Key(const std::string& plan, const std::vector<std::string>& inputs);
+
+        // False if there is no readable entry for `key'
+        bool Lookup(const std::string& key, std::string& result) const;
+        // Throws `std::ios_base::failure'
+        void Store(const std::string& key, const std::string& result);
+
+    private:
+        // Entries are named after a hash of their key, which they hold to
+        // tell the keys of the same hash apart
+        std::string Path(const std::string& key) const;
+        void Evict() const;
+
+        std::string directory_;
+        uint64_t    capacity_;
+};
+
+}
@@ -0,0 +1,725 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "xquery_misc.h"
+#include "xquery_document.h"
+#include "xquery_binary.h"
+#include "xquery_insitu.h"
+#include "xquery_trace.h"
+#include "xquery_alloc.h"
+
+namespace xquery
+{
+
+bool Projection::Retains(const xmlNode* element) const
+{
+    auto name = reinterpret_cast<const char*>(element->name);
+
+    if (keep_all || steps.count(name) || subtrees.count(name))
+        return true;
+    for (auto child = element->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE)
+            return true;
+    return false;
+}
+
+void Projection::Prune(xmlNode* element) const
+{
+    if (Covers(element->name))
+        return;
+    for (auto child = element->children; child; ) {
+        auto next = child->next;
+        if (child->type == XML_ELEMENT_NODE) {
+            Prune(child);
+            if ( !Retains(child)) {
+                xmlUnlinkNode(child);
+                xmlFreeNode(child);
+            }
+        }
+        child = next;
+    }
+}
+
+void Projection::Close(xmlNode* element, size_t& covered) const
+{
+    if (Covers(element->name))
+        --covered;
+    // The root element is always kept
+    else if (covered == 0 && element->parent->type == XML_ELEMENT_NODE && !Retains(element)) {
+        xmlUnlinkNode(element);
+        xmlFreeNode(element);
+    }
+}
+
+namespace
+{
+
+size_t HashBytes(const xmlChar* str)
+{
+    // FNV-1a
+    auto hash = static_cast<size_t>(14695981039346656037ULL);
+    for (; str && *str; ++str)
+        hash = (hash ^ *str) * static_cast<size_t>(1099511628211ULL);
+    return hash;
+}
+
+size_t Combine(size_t seed, size_t value)
+{
+    return seed ^ (value + static_cast<size_t>(0x9e3779b97f4a7c15ULL) + (seed << 6) + (seed >> 2));
+}
+
+// Hash of `node' before its children are combined, only the name of the
+// nodes other than elements and texts is compared
+size_t NodeHash(const xmlNode* node)
+{
+    auto hash = HashBytes(node->name);
+    if (node->type == XML_TEXT_NODE)
+        hash = Combine(hash, HashBytes(node->content));
+    return hash;
+}
+
+// Hashes bottom-up (the children are cached before their parent is hashed)
+// and encodes the texts
+void IndexSubtree(xmlNode* node, TextDictionary& texts)
+{
+    xml::Node::create_wrapper(node);
+    if (node->type == XML_TEXT_NODE && node->content)
+        SetTextId(node, texts.Intern(reinterpret_cast<const char*>(node->content)));
+    if (node->type != XML_ELEMENT_NODE)
+        return;
+    for (auto child = node->children; child; child = child->next)
+        IndexSubtree(child, texts);
+    node->psvi = reinterpret_cast<void*>(static_cast<uintptr_t>(StructuralHash(node)));
+}
+
+// Last modification of a file in nanoseconds, 0 if it can not be read
+uint64_t ModificationTime(const std::string& filename)
+{
+    struct stat st;
+
+    if (stat(filename.c_str(), &st) != 0)
+        return 0;
+    return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+using ContentHashes = std::unordered_map<const xmlNode*, size_t>;
+
+// Hash of what the serialization of `node' shows before its children (name,
+// namespace, attributes and content)
+size_t ShellHash(const xmlNode* node)
+{
+    auto hash = Combine(HashBytes(node->name), node->type);
+    hash = Combine(hash, HashBytes(node->content));
+    if (node->ns)
+        hash = Combine(hash, HashBytes(node->ns->href));
+    if (node->type == XML_ELEMENT_NODE) {
+        for (auto ns = node->nsDef; ns; ns = ns->next)
+            hash = Combine(Combine(hash, HashBytes(ns->prefix)), HashBytes(ns->href));
+        for (auto attr = node->properties; attr; attr = attr->next) {
+            hash = Combine(hash, HashBytes(attr->name));
+            if (attr->ns)
+                hash = Combine(hash, HashBytes(attr->ns->href));
+            for (auto value = attr->children; value; value = value->next)
+                hash = Combine(hash, HashBytes(value->content));
+        }
+    }
+    return hash;
+}
+
+// Hash of all the serialization of `node' shows (names, namespaces,
+// attributes and the contents of every node), cached per element in
+// `hashes'. Unlike `StructuralHash', which follows the value equality of the
+// queries, it tells apart any two differing subtrees.
+size_t ContentHash(const xmlNode* node, ContentHashes& hashes)
+{
+    auto it = hashes.find(node);
+    if (it != std::end(hashes))
+        return it->second;
+
+    auto hash = ShellHash(node);
+    for (auto child = node->children; child; child = child->next)
+        hash = Combine(hash, ContentHash(child, hashes));
+    if (node->type == XML_ELEMENT_NODE)
+        hashes.emplace(node, hash);
+    return hash;
+}
+
+// Edits of a loaded tree into another version of it
+struct TreePatch
+{
+    xmlDoc*               doc;
+    ContentHashes         hashes;
+    DocumentChanges       changes;
+    // Copies inserted, not indexed yet
+    std::vector<xmlNode*> inserted;
+};
+
+void CollectTags(const xmlNode* node, std::unordered_set<std::string>& tags)
+{
+    if (node->type != XML_ELEMENT_NODE)
+        return;
+    tags.insert(reinterpret_cast<const char*>(node->name));
+    for (auto child = node->children; child; child = child->next)
+        CollectTags(child, tags);
+}
+
+void CollectNodes(const xmlNode* node, std::unordered_set<const xmlNode*>& nodes)
+{
+    nodes.insert(node);
+    for (auto child = node->children; child; child = child->next)
+        CollectNodes(child, nodes);
+}
+
+// Links `node' before `next', the last child of `parent' if `next' is null
+// (adjacent text nodes are not merged)
+void InsertBefore(xmlNode* parent, xmlNode* next, xmlNode* node)
+{
+    if (next == nullptr) {
+        AppendChild(parent, node);
+        return;
+    }
+    node->parent = parent;
+    node->next = next;
+    node->prev = next->prev;
+    if (next->prev)
+        next->prev->next = node;
+    else
+        parent->children = node;
+    next->prev = node;
+}
+
+void Remove(xmlNode* node, TreePatch& patch)
+{
+    CollectTags(node, patch.changes.tags);
+    CollectNodes(node, patch.changes.removed);
+    xml::Node::free_wrappers(node);
+    xmlUnlinkNode(node);
+    xmlFreeNode(node);
+}
+
+xmlNode* Copy(const xmlNode* node, TreePatch& patch)
+{
+    auto copy = xmlDocCopyNode(const_cast<xmlNode*>(node), patch.doc, 1);
+
+    if (copy == nullptr)
+        throw std::bad_alloc{};
+    CollectTags(copy, patch.changes.tags);
+    patch.inserted.push_back(copy);
+    return copy;
+}
+
+// Edits the children of `previous' into the ones of `updated' (of the same
+// name and attributes): the children before and after the changed ones are
+// skipped, the changed elements of the same name and attributes are patched
+// in turn, the other changed nodes are replaced
+void PatchChildren(xmlNode* previous, const xmlNode* updated, TreePatch& patch)
+{
+    std::vector<xmlNode*>       previous_children;
+    std::vector<const xmlNode*> updated_children;
+    size_t                      edited = 0;
+
+    auto same = [&patch](const xmlNode* a, const xmlNode* b) {
+        return ContentHash(a, patch.hashes) == ContentHash(b, patch.hashes);
+    };
+    for (auto child = previous->children; child; child = child->next)
+        previous_children.push_back(child);
+    for (auto child = updated->children; child; child = child->next)
+        updated_children.push_back(child);
+
+    auto p_begin = std::begin(previous_children), p_end = std::end(previous_children);
+    auto u_begin = std::begin(updated_children), u_end = std::end(updated_children);
+    for (; p_begin != p_end && u_begin != u_end && same(*p_begin, *u_begin); ++p_begin, ++u_begin);
+    for (; p_begin != p_end && u_begin != u_end && same(*(p_end - 1), *(u_end - 1)); --p_end, --u_end);
+    for (; p_begin != p_end && u_begin != u_end; ++p_begin, ++u_begin) {
+        if (same(*p_begin, *u_begin))
+            continue;
+        if ((*p_begin)->type == XML_ELEMENT_NODE && (*u_begin)->type == XML_ELEMENT_NODE &&
+            ShellHash(*p_begin) == ShellHash(*u_begin)) {
+            PatchChildren(*p_begin, *u_begin, patch);
+            continue;
+        }
+        InsertBefore(previous, *p_begin, Copy(*u_begin, patch));
+        Remove(*p_begin, patch);
+        ++edited;
+    }
+
+    auto next = p_end == std::end(previous_children) ? nullptr : *p_end;
+    for (; p_begin != p_end; ++p_begin, ++edited)
+        Remove(*p_begin, patch);
+    for (; u_begin != u_end; ++u_begin, ++edited)
+        InsertBefore(previous, next, Copy(*u_begin, patch));
+    if (edited) {
+        patch.changes.subtrees += edited;
+        patch.changes.parents.push_back(previous);
+    }
+}
+
+void CollectElements(const xmlNode* element, const std::unordered_set<std::string>& tags,
+                     std::unordered_map<std::string, std::vector<const xmlNode*>>& elements)
+{
+    auto name = reinterpret_cast<const char*>(element->name);
+
+    if (tags.count(name))
+        elements[name].push_back(element);
+    for (auto child = element->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE)
+            CollectElements(child, tags, elements);
+}
+
+// Returns the number of elements in the subtree of `element'
+size_t CollectSubtree(DocumentStats& stats, const xmlNode* element)
+{
+    std::string tag{reinterpret_cast<const char*>(element->name)};
+    auto& children = stats.children[tag];
+    size_t size = 1;
+
+    for (auto child = element->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE) {
+            ++children[reinterpret_cast<const char*>(child->name)];
+            size += CollectSubtree(stats, child);
+        }
+    ++stats.tags[tag];
+    stats.descendants[tag] += size - 1;
+    return size;
+}
+
+}
+
+size_t StructuralHash(const xmlNode* node)
+{
+    if (node->type != XML_ELEMENT_NODE)
+        return NodeHash(node);
+    if (node->psvi != nullptr)
+        return reinterpret_cast<uintptr_t>(node->psvi);
+
+    auto hash = NodeHash(node);
+    for (auto child = node->children; child; child = child->next)
+        hash = Combine(hash, StructuralHash(child));
+    // 0 marks the elements not hashed yet
+    return hash ? hash : 1;
+}
+
+void DocumentStats::Collect(const xmlNode* root_element)
+{
+    root = reinterpret_cast<const char*>(root_element->name);
+    elements = CollectSubtree(*this, root_element);
+}
+
+size_t DocumentStats::Count(const std::string& tag) const
+{
+    if (tag.empty())
+        return elements;
+
+    auto it = tags.find(tag);
+    return it == std::end(tags) ? 0 : it->second;
+}
+
+double DocumentStats::FanOut(const std::string& parent, const std::string& child) const
+{
+    size_t count = 0;
+
+    if (elements == 0)
+        return 0;
+    if (parent.empty())
+        // Every element but the root is a child
+        return (child.empty() ? elements - 1 : Count(child)) / static_cast<double>(elements);
+
+    auto it = children.find(parent);
+    if (it == std::end(children))
+        return 0;
+    if (child.empty())
+        for (const auto& c : it->second)
+            count += c.second;
+    else if (it->second.count(child))
+        count = it->second.at(child);
+    return count / static_cast<double>(Count(parent));
+}
+
+double DocumentStats::Descendants(const std::string& tag) const
+{
+    size_t total = 0;
+
+    if (elements == 0)
+        return 0;
+    if (tag.empty()) {
+        for (const auto& d : descendants)
+            total += d.second;
+        return total / static_cast<double>(elements);
+    }
+
+    auto it = descendants.find(tag);
+    return it == std::end(descendants) ? 0 : it->second / static_cast<double>(Count(tag));
+}
+
+LoadedDocument::LoadedDocument(ParsedDocument&& parsed, TextDictionary& texts,
+                               const std::unordered_set<std::string>& range_tags)
+  : doc_{parsed.doc},
+    arena_{std::move(parsed.arena)}
+{
+    IndexSubtree(xmlDocGetRootElement(doc_), texts);
+    IndexRanges(range_tags);
+}
+
+LoadedDocument::~LoadedDocument()
+{
+    xml::Node::free_wrappers(reinterpret_cast<xmlNode*>(doc_));
+    // The nodes of an arena are released with it
+    if ( !arena_)
+        xmlFreeDoc(doc_);
+}
+
+xml::Element* LoadedDocument::root() const
+{
+    auto root = xmlDocGetRootElement(doc_);
+
+    if (root == nullptr)
+        return nullptr;
+    xml::Node::create_wrapper(root);
+    return static_cast<xml::Element*>(root->_private);
+}
+
+const DocumentStats& LoadedDocument::stats() const
+{
+    std::lock_guard<std::mutex> lock{stats_mutex_};
+
+    if ( !stats_) {
+        stats_.reset(new DocumentStats);
+        stats_->Collect(xmlDocGetRootElement(doc_));
+    }
+    return *stats_;
+}
+
+DocumentChanges LoadedDocument::Patch(const xmlNode* updated, TextDictionary& texts)
+{
+    // The copies are allocated with the other nodes, the nodes removed from
+    // an arena stay in it until the document is freed
+    std::unique_ptr<ArenaScope> scope{arena_ ? new ArenaScope{*arena_} : nullptr};
+    TreePatch patch{doc_, {}, {}, {}};
+    auto root = xmlDocGetRootElement(doc_);
+
+    if (ContentHash(root, patch.hashes) == ContentHash(updated, patch.hashes))
+        return {};
+    if (ShellHash(root) == ShellHash(updated))
+        PatchChildren(root, updated, patch);
+    else {
+        xmlReplaceNode(root, Copy(updated, patch));
+        Remove(root, patch);
+        patch.changes.subtrees = 1;
+        patch.changes.parents.push_back(reinterpret_cast<xmlNode*>(doc_));
+    }
+
+    for (auto node : patch.inserted)
+        IndexSubtree(node, texts);
+    // The hashes of the ancestors of the edits are computed again, once
+    // none of them is cached
+    for (auto parent : patch.changes.parents)
+        for (auto node = const_cast<xmlNode*>(parent); node->type == XML_ELEMENT_NODE; node = node->parent)
+            node->psvi = nullptr;
+    for (auto parent : patch.changes.parents)
+        for (auto node = const_cast<xmlNode*>(parent); node->type == XML_ELEMENT_NODE; node = node->parent)
+            node->psvi = reinterpret_cast<void*>(static_cast<uintptr_t>(StructuralHash(node)));
+
+    std::unordered_set<std::string> range_tags;
+    for (const auto& range : ranges_)
+        range_tags.insert(range.first);
+    ranges_.clear();
+    IndexRanges(range_tags);
+    std::lock_guard<std::mutex> lock{stats_mutex_};
+    stats_.reset();
+    return std::move(patch.changes);
+}
+
+void LoadedDocument::IndexRanges(const std::unordered_set<std::string>& range_tags)
+{
+    std::unordered_map<std::string, std::vector<const xmlNode*>> elements;
+
+    if (range_tags.empty())
+        return;
+    // Every tag gets an index, even without elements
+    for (const auto& tag : range_tags)
+        elements[tag];
+    CollectElements(xmlDocGetRootElement(doc_), range_tags, elements);
+    for (const auto& tag : elements)
+        ranges_.emplace(tag.first, RangeIndex{tag.second});
+}
+
+DocumentStore::DocumentStore()
+{
+    // Once, before the threads parse
+    xmlInitParser();
+}
+
+const LoadedDocument& DocumentStore::Load(const std::string& filename)
+{
+    Slot* slot;
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        slot = &Find(filename);
+    }
+    return Load(*slot, filename);
+}
+
+DocumentStore::Slot& DocumentStore::Find(const std::string& filename)
+{
+    auto& slot = documents_[filename];
+
+    if ( !slot)
+        slot.reset(new Slot);
+    return *slot;
+}
+
+const LoadedDocument& DocumentStore::Load(Slot& slot, const std::string& filename)
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+
+    // Waits for a concurrent load of the file, a failed load is tried again
+    loaded_.wait(lock, [&slot]() { return !slot.loading; });
+    if (slot.document)
+        return *slot.document;
+    slot.loading = true;
+    lock.unlock();
+
+    std::unique_ptr<LoadedDocument> loaded;
+    auto mtime = ModificationTime(filename);
+    try {
+        TraceSpan span{"load", filename};
+        MemoryScope scope{MemoryCategory::DOCUMENTS};
+        loaded.reset(new LoadedDocument{Parse(filename), texts_, range_tags_});
+    }
+    catch (...) {
+        lock.lock();
+        slot.loading = false;
+        loaded_.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    slot.document = std::move(loaded);
+    slot.loading = false;
+    mtimes_[filename] = mtime;
+    ++generation_;
+    loaded_.notify_all();
+    return *slot.document;
+}
+
+std::vector<std::string> DocumentStore::Modified() const
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    std::vector<std::string> modified;
+
+    for (const auto& mtime : mtimes_)
+        if (ModificationTime(mtime.first) != mtime.second)
+            modified.push_back(mtime.first);
+    std::sort(std::begin(modified), std::end(modified));
+    return modified;
+}
+
+DocumentChanges DocumentStore::Reload(const std::string& filename)
+{
+    TraceSpan span{"reload", filename};
+    MemoryScope scope{MemoryCategory::DOCUMENTS};
+    Slot* slot;
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        // A version failing to parse is not loaded again until it is modified
+        mtimes_[filename] = ModificationTime(filename);
+        slot = &Find(filename);
+    }
+
+    auto updated = Parse(filename);
+    DocumentChanges changes;
+    try {
+        Load(*slot, filename);
+        changes = slot->document->Patch(xmlDocGetRootElement(updated.doc), texts_);
+    }
+    catch (...) {
+        if ( !updated.arena)
+            xmlFreeDoc(updated.doc);
+        throw;
+    }
+    // The nodes of an arena are released with it
+    if ( !updated.arena)
+        xmlFreeDoc(updated.doc);
+    changes.filename = filename;
+    if (changes.subtrees == 0)
+        return changes;
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    // The collections are listed again, with the new version
+    collections_.clear();
+    ++generation_;
+    return changes;
+}
+
+const std::vector<const LoadedDocument*>& DocumentStore::LoadCollection(const std::string& directory)
+{
+    std::unique_lock<std::mutex> lock{mutex_};
+    auto& listed = collections_[directory];
+
+    if ( !listed)
+        listed.reset(new Collection);
+    auto collection = listed.get();
+    // Waits for a concurrent load of the collection
+    loaded_.wait(lock, [collection]() { return !collection->loading; });
+    if (collection->listed)
+        return collection->documents;
+    collection->loading = true;
+    lock.unlock();
+
+    std::vector<const LoadedDocument*> documents;
+    try {
+        TraceSpan span{"load", directory};
+        documents = LoadAll(List(directory));
+    }
+    catch (...) {
+        lock.lock();
+        collection->loading = false;
+        loaded_.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    collection->documents = std::move(documents);
+    collection->listed = true;
+    collection->loading = false;
+    loaded_.notify_all();
+    return collection->documents;
+}
+
+std::vector<std::string> DocumentStore::List(const std::string& directory)
+{
+    std::vector<std::string> filenames;
+    auto dir = opendir(directory.c_str());
+    const std::string kExtension = ".xml";
+
+    if (dir == nullptr)
+        throw std::runtime_error("Could not open directory " + directory);
+    for (auto entry = readdir(dir); entry; entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > kExtension.size() &&
+            name.compare(name.size() - kExtension.size(), kExtension.size(), kExtension) == 0)
+            filenames.push_back(directory + "/" + name);
+    }
+    closedir(dir);
+    std::sort(std::begin(filenames), std::end(filenames));
+    return filenames;
+}
+
+std::vector<const LoadedDocument*> DocumentStore::LoadAll(const std::vector<std::string>& filenames)
+{
+    std::vector<const LoadedDocument*> docs(filenames.size());
+    std::vector<std::string>           errors(filenames.size());
+    std::vector<Slot*>                 slots;
+    std::vector<std::thread>           workers;
+    std::atomic<size_t>                next{0};
+
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (const auto& filename : filenames)
+            slots.push_back(&Find(filename));
+    }
+
+    // The workers take the next file to load until there are none left, the
+    // files loaded already or by other threads are not parsed again
+    auto work = [&]() {
+        for (size_t i; (i = next++) < filenames.size(); ) {
+            try {
+                docs[i] = &Load(*slots[i], filenames[i]);
+            }
+            catch (const std::runtime_error& e) {
+                errors[i] = e.what();
+            }
+        }
+    };
+
+    auto threads = threads_ ? threads_ : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, filenames.size());
+    for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+
+    // The documents loaded stay in the store
+    auto failed = std::find_if(std::begin(errors), std::end(errors),
+      [](const std::string& error) { return !error.empty(); });
+    if (failed != std::end(errors))
+        throw std::runtime_error(*failed);
+    return docs;
+}
+
+std::vector<DocumentStore::DocumentIndex> DocumentStore::RangeIndexes(const std::string& tag) const
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    std::vector<DocumentIndex> indexes;
+
+    // The documents being loaded are not indexed yet
+    for (const auto& slot : documents_)
+        if (slot.second->document)
+            if (auto index = slot.second->document->range_index(tag))
+                indexes.push_back({slot.second->document->doc(), index});
+    return indexes;
+}
+
+ParsedDocument DocumentStore::Parse(const std::string& filename) const
+{
+    ParsedDocument parsed;
+
+    if (allocation_ == MALLOC) {
+        parsed.doc = ParseNodes(filename);
+        return parsed;
+    }
+
+    // Its state is allocated once, out of the arena
+    xmlInitParser();
+    parsed.arena.reset(new Arena{allocation_ == HUGE_PAGE_ARENA});
+    ArenaScope scope{*parsed.arena};
+    try {
+        parsed.doc = ParseNodes(filename);
+    }
+    catch (const std::runtime_error&) {
+        // The last error of the thread is in the arena
+        xmlResetLastError();
+        throw;
+    }
+    xmlResetLastError();
+    return parsed;
+}
+
+xmlDoc* DocumentStore::ParseNodes(const std::string& filename) const
+{
+    TraceSpan span{"parse", filename};
+    MemoryScope scope{MemoryCategory::DOCUMENTS};
+    xmlDoc* doc = nullptr;
+
+    if (BinaryDocument::IsFresh(filename)) {
+        try {
+            return BinaryDocument{BinaryDocument::PathFor(filename)}.Materialize(projection_);
+        }
+        catch (const std::runtime_error& e) {
+            std::cerr << "Ignoring binary document: "_yellow << e.what() << std::endl;
+        }
+    }
+    if (loader_ == IN_SITU) {
+        try {
+            return InSituParser{filename}.Parse(projection_);
+        }
+        catch (const std::runtime_error& e) {
+            std::cerr << "In-situ parsing failed: "_yellow << e.what() << std::endl;
+        }
+    }
+
+    doc = xmlReadFile(filename.c_str(), nullptr, kParseOptions);
+    if (doc == nullptr || xmlDocGetRootElement(doc) == nullptr) {
+        xmlFreeDoc(doc);
+        throw std::runtime_error("Could not parse " + filename);
+    }
+    projection_.Prune(xmlDocGetRootElement(doc));
+    return doc;
+}
+
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+#include "xquery_alloc.h"
+#include "xquery_text.h"
+#include "xquery_index.h"
+
+namespace xquery
+{
+
+class Node;
+
+/*
+ * Parts of the documents a query can reach, derived from its path steps.
+ * Elements are kept if they are named by a step, if one of their
+ * descendants is kept (ancestors are needed for `..') or if they are inside
+ * a subtree consumed as a whole (constructed, compared or returned).
+ */
+struct Projection
+{
+    // Whole subtree kept
+    bool Covers(const xmlChar* name) const
+    {
+        return keep_all || subtrees.count(reinterpret_cast<const char*>(name));
+    }
+    // Decides if a built element is kept, once its children are projected
+    bool Retains(const xmlNode* element) const;
+    // Projects a built tree
+    void Prune(xmlNode* element) const;
+    // Projects while loading, `covered' counts the open elements covered
+    void Open(const xmlNode* element, size_t& covered) const
+    {
+        if (Covers(element->name))
+            ++covered;
+    }
+    void Close(xmlNode* element, size_t& covered) const;
+
+    bool                                              keep_all = true;
+    std::unordered_set<std::string>                   steps;
+    std::unordered_set<std::string>                   subtrees;
+    // Analysis only: variables consumed as a whole and their definitions
+    std::unordered_set<std::string>                   variables;
+    std::unordered_multimap<std::string, const Node*> definitions;
+};
+
+// Links `node' as the last child of `parent', unlike `xmlAddChild' adjacent
+// text nodes are not merged (they can surround projected out elements)
+inline void AppendChild(xmlNode* parent, xmlNode* node)
+{
+    node->parent = parent;
+    if (parent->last == nullptr)
+        parent->children = node;
+    else {
+        node->prev = parent->last;
+        parent->last->next = node;
+    }
+    parent->last = node;
+}
+
+// Canonical hash of the subtree of `node' (names, text contents and children
+// in order), deep-equal subtrees have the same hash. The hashes of the
+// elements of the loaded documents are cached in their `psvi' field.
+size_t StructuralHash(const xmlNode* node);
+
+// Element statistics of a document, an empty tag stands for any element
+struct DocumentStats
+{
+    void Collect(const xmlNode* root);
+
+    size_t Count(const std::string& tag) const;
+    // Average number of `child' elements of a `parent' element
+    double FanOut(const std::string& parent, const std::string& child = "") const;
+    // Average number of descendant elements of a `tag' element
+    double Descendants(const std::string& tag) const;
+
+    using TagCounts = std::unordered_map<std::string, size_t>;
+
+    std::string                                root;
+    size_t                                     elements = 0;
+    TagCounts                                  tags;
+    // Sum of the subtree sizes of the elements of a tag
+    TagCounts                                  descendants;
+    // Child elements per parent tag
+    std::unordered_map<std::string, TagCounts> children;
+};
+
+// Edits of a loaded document made by `LoadedDocument::Patch'
+struct DocumentChanges
+{
+    std::string                        filename;
+    // Subtrees removed, inserted or replaced
+    size_t                             subtrees = 0;
+    // Elements whose children were edited (the document node if the root
+    // element was replaced), still loaded
+    std::vector<const xmlNode*>        parents;
+    // Nodes of the subtrees removed, freed (only their addresses are left)
+    std::unordered_set<const xmlNode*> removed;
+    // Names of the elements removed or inserted
+    std::unordered_set<std::string>    tags;
+};
+
+// Nodes of a document, with the arena holding them if any
+struct ParsedDocument
+{
+    xmlDoc*                doc = nullptr;
+    std::unique_ptr<Arena> arena;
+};
+
+// Parsed document owned by the store, read-only during the evaluation
+class LoadedDocument : public NonCopyable, public NonMoveable
+{
+    public:
+        // Hashes the elements, encodes the texts with `texts', indexes the
+        // values of the elements named in `range_tags' and wraps every node
+        // (evaluations do not create wrappers)
+        LoadedDocument(ParsedDocument&& parsed, TextDictionary& texts,
+                       const std::unordered_set<std::string>& range_tags);
+        ~LoadedDocument();
+
+        // Edits the tree into `updated' (the root element of another version
+        // of the document), the subtrees whose serialization is the same
+        // stay in place and the others are replaced by copies, indexed as
+        // by the constructor. Must not run during an evaluation.
+        DocumentChanges Patch(const xmlNode* updated, TextDictionary& texts);
+
+        xml::Element* root() const;
+        const xmlDoc* doc() const
+        {
+            return doc_;
+        }
+        // Collected on the first call
+        const DocumentStats& stats() const;
+        const RangeIndex* range_index(const std::string& tag) const
+        {
+            auto it = ranges_.find(tag);
+            return it == std::end(ranges_) ? nullptr : &it->second;
+        }
+
+    private:
+        // Indexes the values of the elements named in `range_tags'
+        void IndexRanges(const std::unordered_set<std::string>& range_tags);
+
+        xmlDoc*                                     doc_;
+        std::unique_ptr<Arena>                      arena_;
+        mutable std::unique_ptr<DocumentStats>      stats_;
+        mutable std::mutex                          stats_mutex_;
+        std::unordered_map<std::string, RangeIndex> ranges_;
+};
+
+// Loads every `doc()' input once, from its binary form when it is up to date.
+// Evaluations may load documents concurrently, each file being parsed once
+// out of the lock (the others wait for it), but `Reload' must not run during
+// an evaluation (it edits documents).
+class DocumentStore : public NonCopyable, public NonMoveable
+{
+    public:
+        enum Loader
+        {
+            LIBXML2,
+            IN_SITU
+        };
+        // Allocation of the nodes of a document, the arenas need
+        // `TrackXmlAllocations'
+        enum Allocation
+        {
+            MALLOC,
+            ARENA,          // In an arena of its own, released at once
+            HUGE_PAGE_ARENA
+        };
+        // Options of libxml2's parser, the other loaders build the same trees
+        static constexpr int kParseOptions = 0;
+
+        DocumentStore();
+        ~DocumentStore() = default;
+
+        // Throws `std::runtime_error'
+        const LoadedDocument& Load(const std::string& filename);
+        // Loads the XML files of `directory' (listed on the first call), in
+        // the order of their names, the files are parsed in parallel
+        // Throws `std::runtime_error'
+        const std::vector<const LoadedDocument*>& LoadCollection(const std::string& directory);
+        // XML files of `directory', in the order of their names
+        // Throws `std::runtime_error'
+        static std::vector<std::string> List(const std::string& directory);
+        // Loaded documents whose file was modified since
+        std::vector<std::string> Modified() const;
+        // Patches the loaded version of a document into the new one (see
+        // `LoadedDocument::Patch'), returns the subtrees edited (none if no
+        // serialization changed)
+        // Throws `std::runtime_error'
+        DocumentChanges Reload(const std::string& filename);
+        // Changes whenever the loaded documents do
+        size_t generation() const
+        {
+            return generation_;
+        }
+
+        TextDictionary& texts()
+        {
+            return texts_;
+        }
+        // Range indexes of `tag' in the documents loaded so far, with their
+        // document
+        using DocumentIndex = std::pair<const xmlDoc*, const RangeIndex*>;
+        std::vector<DocumentIndex> RangeIndexes(const std::string& tag) const;
+        // Indexes the values of the `tag' elements of the documents loaded
+        // from now on
+        void add_range_index(const std::string& tag)
+        {
+            range_tags_.insert(tag);
+        }
+        bool range_indexed(const std::string& tag) const
+        {
+            return range_tags_.count(tag) > 0;
+        }
+
+        void set_loader(Loader loader)
+        {
+            loader_ = loader;
+        }
+        void set_allocation(Allocation allocation)
+        {
+            allocation_ = allocation;
+        }
+        // Threads parsing the documents of a collection, 0 for one per core
+        void set_threads(size_t threads)
+        {
+            threads_ = threads;
+        }
+        void set_projection(Projection&& projection)
+        {
+            projection_ = std::move(projection);
+        }
+
+    private:
+        // Document of a file, loaded once (`loading' while a thread parses it)
+        struct Slot
+        {
+            bool                            loading = false;
+            std::unique_ptr<LoadedDocument> document;
+        };
+        struct Collection
+        {
+            bool                               loading = false;
+            bool                               listed = false;
+            std::vector<const LoadedDocument*> documents;
+        };
+
+        // Slot of `filename', created if needed, with the lock held
+        Slot& Find(const std::string& filename);
+        // Loads the document of the slot unless it is loaded already, the
+        // concurrent calls wait for the one parsing it (a failed load is
+        // tried again by the next one). Throws `std::runtime_error'
+        const LoadedDocument& Load(Slot& slot, const std::string& filename);
+        // Loads the files concurrently, returns the documents in the same
+        // order
+        std::vector<const LoadedDocument*> LoadAll(const std::vector<std::string>& filenames); // Throws
+        // Parses the nodes in an arena of their own, unless allocated with
+        // `malloc'
+        ParsedDocument Parse(const std::string& filename) const; // Throws
+        xmlDoc* ParseNodes(const std::string& filename) const; // Throws
+
+        std::unordered_map<std::string, std::unique_ptr<Slot>>            documents_;
+        std::unordered_map<std::string, std::unique_ptr<Collection>>      collections_;
+        std::unordered_map<std::string, uint64_t>                         mtimes_;
+        std::atomic<size_t>                                               generation_{0};
+        Loader                                                            loader_ = LIBXML2;
+        Allocation                                                        allocation_ = MALLOC;
+        size_t                                                            threads_ = 0;
+        Projection                                                        projection_;
+        TextDictionary                                                    texts_;
+        std::unordered_set<std::string>                                   range_tags_;
+        mutable std::mutex                                                mutex_;
+        // Signaled whenever a load ends
+        std::condition_variable                                           loaded_;
+};
+
+}
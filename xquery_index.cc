@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <numeric>
+#include <cstdlib>
+#include <cctype>
+
+#include "xquery_index.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+void AppendText(const xmlNode* node, std::string& text)
+{
+    if (node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE) {
+        if (node->content)
+            text += reinterpret_cast<const char*>(node->content);
+    }
+    else if (node->type == XML_ELEMENT_NODE)
+        for (auto child = node->children; child; child = child->next)
+            AppendText(child, text);
+}
+
+// Bounds of the sorted `keys' comparing to `key' as `comp'
+template <typename Key>
+std::pair<size_t, size_t> Matching(const std::vector<Key>& keys, const Key& key, Comparator comp)
+{
+    size_t lower = std::lower_bound(std::begin(keys), std::end(keys), key) - std::begin(keys);
+    size_t upper = std::upper_bound(std::begin(keys), std::end(keys), key) - std::begin(keys);
+
+    switch (comp) {
+        case LESS:
+            return {0, lower};
+        case LESS_EQUAL:
+            return {0, upper};
+        case GREATER:
+            return {upper, keys.size()};
+        case GREATER_EQUAL:
+            return {lower, keys.size()};
+    }
+    return {0, 0};
+}
+
+}
+
+Comparator Converse(Comparator comp)
+{
+    switch (comp) {
+        case LESS:
+            return GREATER;
+        case LESS_EQUAL:
+            return GREATER_EQUAL;
+        case GREATER:
+            return LESS;
+        case GREATER_EQUAL:
+            return LESS_EQUAL;
+    }
+    return comp;
+}
+
+AtomicValue::AtomicValue(std::string value) : text{std::move(value)}
+{
+    auto begin = text.c_str();
+    char* end;
+
+    while (std::isspace(static_cast<unsigned char>(*begin)))
+        ++begin;
+    // No `inf' or `nan'
+    if ( !std::isdigit(static_cast<unsigned char>(*begin)) && *begin != '-' &&
+         *begin != '+' && *begin != '.')
+        return;
+    number = std::strtod(begin, &end);
+    while (std::isspace(static_cast<unsigned char>(*end)))
+        ++end;
+    numeric = end != begin && *end == '\0';
+}
+
+AtomicValue AtomicValue::Of(const xmlNode* node)
+{
+    std::string text;
+
+    AppendText(node, text);
+    return text;
+}
+
+bool Compare(const AtomicValue& a, Comparator comp, const AtomicValue& b)
+{
+    int order;
+
+    if (a.numeric && b.numeric)
+        order = (a.number > b.number) - (a.number < b.number);
+    else
+        order = a.text.compare(b.text);
+    switch (comp) {
+        case LESS:
+            return order < 0;
+        case LESS_EQUAL:
+            return order <= 0;
+        case GREATER:
+            return order > 0;
+        case GREATER_EQUAL:
+            return order >= 0;
+    }
+    return false;
+}
+
+RangeIndex::RangeIndex(const std::vector<const xmlNode*>& elements)
+{
+    std::vector<AtomicValue> values;
+    std::vector<size_t> order(elements.size());
+
+    for (auto element : elements)
+        values.push_back(AtomicValue::Of(element));
+
+    std::iota(std::begin(order), std::end(order), 0);
+    std::sort(std::begin(order), std::end(order),
+      [&values](size_t a, size_t b) { return values[a].text < values[b].text; });
+    for (auto i : order) {
+        texts_.push_back(values[i].text);
+        text_elements_.push_back(elements[i]);
+        text_numeric_.push_back(values[i].numeric);
+    }
+
+    std::sort(std::begin(order), std::end(order),
+      [&values](size_t a, size_t b) { return values[a].number < values[b].number; });
+    for (auto i : order)
+        if (values[i].numeric) {
+            numbers_.push_back(values[i].number);
+            number_elements_.push_back(elements[i]);
+        }
+}
+
+std::vector<const xmlNode*> RangeIndex::Scan(Comparator comp, const AtomicValue& bound) const
+{
+    std::vector<const xmlNode*> elements;
+
+    // Numbers compare as numbers to a numeric bound, as strings otherwise
+    auto range = Matching(texts_, bound.text, comp);
+    for (auto i = range.first; i < range.second; ++i)
+        if ( !bound.numeric || !text_numeric_[i])
+            elements.push_back(text_elements_[i]);
+    if (bound.numeric) {
+        range = Matching(numbers_, bound.number, comp);
+        elements.insert(std::end(elements), std::begin(number_elements_) + range.first,
+                        std::begin(number_elements_) + range.second);
+    }
+    return elements;
+}
+
+}
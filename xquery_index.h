@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "xquery_xml.h"
+
+namespace xquery
+{
+
+enum Comparator
+{
+    LESS,
+    LESS_EQUAL,
+    GREATER,
+    GREATER_EQUAL
+};
+
+// `a comp b' if and only if `b Converse(comp) a'
+Comparator Converse(Comparator comp);
+
+// Value of a node (the texts of its subtree) or of a constant, numeric if
+// the whole text is a number
+struct AtomicValue
+{
+    AtomicValue(std::string value);
+    static AtomicValue Of(const xmlNode* node);
+
+    std::string text;
+    double      number = 0;
+    bool        numeric = false;
+};
+
+// Numeric comparison if both values are numbers, string comparison otherwise
+bool Compare(const AtomicValue& a, Comparator comp, const AtomicValue& b);
+
+/*
+ * Elements sorted by their value, once as strings and once as numbers (for
+ * the numeric ones), so that the elements comparing to a bound are ranges
+ * of these orders.
+ */
+class RangeIndex
+{
+    public:
+        RangeIndex(const std::vector<const xmlNode*>& elements);
+        ~RangeIndex() = default;
+
+        // Elements `e' such that `e comp bound'
+        std::vector<const xmlNode*> Scan(Comparator comp, const AtomicValue& bound) const;
+
+    private:
+        std::vector<std::string>    texts_;
+        std::vector<const xmlNode*> text_elements_;
+        std::vector<bool>           text_numeric_;
+        std::vector<double>         numbers_;
+        std::vector<const xmlNode*> number_elements_;
+};
+
+}
@@ -0,0 +1,352 @@
+#include <vector>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xquery_insitu.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+using xml_str = const xmlChar*;
+
+inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+inline bool StartsWith(const char* pos, const char* end, const char* prefix)
+{
+    auto len = std::strlen(prefix);
+    return static_cast<size_t>(end - pos) >= len && std::memcmp(pos, prefix, len) == 0;
+}
+
+// Returns the next `<', flags the character data needing a decoding pass
+const char* ScanCharData(const char* pos, const char* end, bool& decode)
+{
+#ifdef __SSE2__
+    const auto kLt = _mm_set1_epi8('<');
+    const auto kAmp = _mm_set1_epi8('&');
+    const auto kCr = _mm_set1_epi8('\r');
+
+    for (; end - pos >= 16; pos += 16) {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        int lt_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, kLt));
+        int esc_mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, kAmp),
+                                                      _mm_cmpeq_epi8(chunk, kCr)));
+        if (lt_mask != 0) {
+            int idx = __builtin_ctz(lt_mask);
+            if ((esc_mask & ((1 << idx) - 1)) != 0)
+                decode = true;
+            return pos + idx;
+        }
+        if (esc_mask != 0)
+            decode = true;
+    }
+#endif
+    for (; pos < end && *pos != '<'; ++pos)
+        if (*pos == '&' || *pos == '\r')
+            decode = true;
+    return pos;
+}
+
+void AppendUtf8(std::string& out, unsigned long cp)
+{
+    if (cp < 0x80)
+        out += static_cast<char>(cp);
+    else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+}
+
+InSituParser::InSituParser(const std::string& filename) : filename_{filename}
+{
+    struct stat st;
+    int fd = open(filename_.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw std::runtime_error("Could not open " + filename_);
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Could not parse " + filename_);
+    }
+    size_ = st.st_size;
+    auto map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw std::runtime_error("Could not map " + filename_);
+    madvise(map, size_, MADV_SEQUENTIAL);
+    begin_ = static_cast<const char*>(map);
+    end_ = begin_ + size_;
+}
+
+InSituParser::~InSituParser()
+{
+    munmap(const_cast<char*>(begin_), size_);
+}
+
+void InSituParser::Fail(const std::string& what, const char* pos) const
+{
+    throw std::runtime_error(filename_ + ":" + std::to_string(pos - begin_) + ": " + what);
+}
+
+const char* InSituParser::Find(const char* pos, const char* pattern) const
+{
+    auto found = static_cast<const char*>(memmem(pos, end_ - pos, pattern, std::strlen(pattern)));
+
+    if (found == nullptr)
+        Fail(std::string{"missing `"} + pattern + "'", pos);
+    return found;
+}
+
+const char* InSituParser::SkipBlanks(const char* pos) const
+{
+    while (pos < end_ && IsBlank(*pos))
+        ++pos;
+    return pos;
+}
+
+const char* InSituParser::ScanName(const char* pos) const
+{
+    auto start = pos;
+
+    while (pos < end_ && !IsBlank(*pos) && *pos != '>' && *pos != '/' && *pos != '=' && *pos != '?')
+        ++pos;
+    if (pos == start)
+        Fail("expected a name", pos);
+    return pos;
+}
+
+void InSituParser::Decode(const char* begin, const char* end, bool attribute)
+{
+    decoded_.clear();
+    for (auto pos = begin; pos < end; ++pos) {
+        if (*pos == '&') {
+            auto semi = static_cast<const char*>(std::memchr(pos, ';', end - pos));
+            if (semi == nullptr)
+                Fail("unterminated reference", pos);
+            std::string ref{pos + 1, semi};
+
+            if (ref == "amp") decoded_ += '&';
+            else if (ref == "lt") decoded_ += '<';
+            else if (ref == "gt") decoded_ += '>';
+            else if (ref == "quot") decoded_ += '"';
+            else if (ref == "apos") decoded_ += '\'';
+            else if (ref.size() > 1 && ref[0] == '#') {
+                bool hex = ref[1] == 'x';
+                char* ref_end;
+                auto cp = std::strtoul(ref.c_str() + (hex ? 2 : 1), &ref_end, hex ? 16 : 10);
+                if (*ref_end != '\0' || cp == 0 || cp > 0x10FFFF)
+                    Fail("invalid character reference", pos);
+                AppendUtf8(decoded_, cp);
+            }
+            else
+                Fail("unsupported entity `" + ref + "'", pos);
+            pos = semi;
+        }
+        else if (*pos == '\r') {
+            decoded_ += attribute ? ' ' : '\n';
+            if (pos + 1 < end && pos[1] == '\n')
+                ++pos;
+        }
+        else if (attribute && IsBlank(*pos))
+            decoded_ += ' ';
+        else
+            decoded_ += *pos;
+    }
+}
+
+const char* InSituParser::ParseStartTag(const char* pos, xmlDoc* doc, xmlNode*& node)
+{
+    auto name_end = ScanName(pos);
+    // libxml2 splits the prefix of the names and binds their namespace
+    auto qualified = [this](const char* begin, const char* end) {
+        if (std::memchr(begin, ':', end - begin) != nullptr ||
+            (end - begin == 5 && std::memcmp(begin, "xmlns", 5) == 0))
+            Fail("namespaces are not supported", begin);
+    };
+    qualified(pos, name_end);
+    auto name = xmlDictLookup(doc->dict, reinterpret_cast<xml_str>(pos), name_end - pos);
+
+    node = xmlNewDocNodeEatName(doc, nullptr, const_cast<xmlChar*>(name), nullptr);
+    pos = SkipBlanks(name_end);
+    // Not linked yet, the node is not freed with the document
+    try {
+        while (pos < end_ && *pos != '>' && *pos != '/') {
+            name_end = ScanName(pos);
+            qualified(pos, name_end);
+            auto attr_name = xmlDictLookup(doc->dict, reinterpret_cast<xml_str>(pos), name_end - pos);
+            pos = SkipBlanks(name_end);
+            if (pos == end_ || *pos != '=')
+                Fail("expected `='", pos);
+            pos = SkipBlanks(pos + 1);
+            if (pos == end_ || (*pos != '"' && *pos != '\''))
+                Fail("expected a quoted value", pos);
+            auto quote = static_cast<const char*>(std::memchr(pos + 1, *pos, end_ - pos - 1));
+            if (quote == nullptr)
+                Fail("unterminated attribute value", pos);
+            Decode(pos + 1, quote, true);
+            xmlNewProp(node, attr_name, reinterpret_cast<xml_str>(decoded_.c_str()));
+            pos = SkipBlanks(quote + 1);
+        }
+        if (pos == end_)
+            Fail("unterminated start tag", pos);
+    }
+    catch (...) {
+        xmlFreeNode(node);
+        throw;
+    }
+    return pos;
+}
+
+xmlDoc* InSituParser::Parse(const Projection& projection)
+{
+    auto doc = xmlNewDoc(reinterpret_cast<xml_str>("1.0"));
+    std::vector<xmlNode*> open{reinterpret_cast<xmlNode*>(doc)};
+    size_t covered = 0;
+    auto pos = begin_;
+
+    doc->dict = xmlDictCreate();
+    try {
+        if (StartsWith(pos, end_, "\xEF\xBB\xBF"))
+            pos += 3;
+
+        while (pos < end_) {
+            bool decode = false;
+            auto lt = ScanCharData(pos, end_, decode);
+
+            if (lt > pos) {
+                if (open.size() > 1) {
+                    if (decode) {
+                        Decode(pos, lt, false);
+                        AppendChild(open.back(), xmlNewDocTextLen(doc,
+                          reinterpret_cast<xml_str>(decoded_.data()), decoded_.size()));
+                    }
+                    else
+                        AppendChild(open.back(), xmlNewDocTextLen(doc,
+                          reinterpret_cast<xml_str>(pos), lt - pos));
+                }
+                else if (SkipBlanks(pos) < lt)
+                    Fail("character data outside of the root element", pos);
+            }
+            if ((pos = lt) == end_)
+                break;
+
+            if (StartsWith(pos, end_, "<!--")) {
+                auto end = Find(pos + 4, "-->");
+                std::string content{pos + 4, end};
+                AppendChild(open.back(), xmlNewDocComment(doc, reinterpret_cast<xml_str>(content.c_str())));
+                pos = end + 3;
+            }
+            else if (StartsWith(pos, end_, "<![CDATA[")) {
+                auto end = Find(pos + 9, "]]>");
+                if (open.size() == 1)
+                    Fail("CDATA section outside of the root element", pos);
+                AppendChild(open.back(), xmlNewCDataBlock(doc, reinterpret_cast<xml_str>(pos + 9), end - pos - 9));
+                pos = end + 3;
+            }
+            else if (StartsWith(pos, end_, "<!")) { // Document type declaration, ignored
+                int depth = 0;
+                for (++pos; pos < end_ && (*pos != '>' || depth > 0); ++pos) {
+                    if (*pos == '[')
+                        ++depth;
+                    else if (*pos == ']')
+                        --depth;
+                    else if (*pos == '"' || *pos == '\'')
+                        pos = static_cast<const char*>(std::memchr(pos + 1, *pos, end_ - pos - 1));
+                    if (pos == nullptr)
+                        Fail("unterminated declaration", lt);
+                }
+                if (pos++ == end_)
+                    Fail("unterminated declaration", lt);
+            }
+            else if (StartsWith(pos, end_, "<?")) {
+                auto name_end = ScanName(pos + 2);
+                auto end = Find(name_end, "?>");
+                std::string name{pos + 2, name_end};
+                std::string content{SkipBlanks(name_end), end};
+
+                if (name == "xml") {
+                    auto enc = content.find("encoding");
+                    if (enc != std::string::npos) {
+                        auto value = content.substr(enc + 8, 16);
+                        for (auto& c : value)
+                            c = std::tolower(c);
+                        if (value.find("utf-8") == std::string::npos &&
+                            value.find("us-ascii") == std::string::npos)
+                            Fail("unsupported encoding", pos);
+                    }
+                }
+                else
+                    AppendChild(open.back(), xmlNewDocPI(doc, reinterpret_cast<xml_str>(name.c_str()),
+                                                         reinterpret_cast<xml_str>(content.c_str())));
+                pos = end + 2;
+            }
+            else if (StartsWith(pos, end_, "</")) {
+                auto name_end = ScanName(pos + 2);
+                auto current = open.back();
+                if (open.size() == 1 ||
+                    xmlStrncmp(current->name, reinterpret_cast<xml_str>(pos + 2), name_end - pos - 2) != 0 ||
+                    current->name[name_end - pos - 2] != '\0')
+                    Fail("mismatched end tag", pos);
+                pos = SkipBlanks(name_end);
+                if (pos == end_ || *pos != '>')
+                    Fail("expected `>'", pos);
+                open.pop_back();
+                projection.Close(current, covered);
+                ++pos;
+            }
+            else {
+                xmlNode* node;
+                if (open.size() == 1 && xmlDocGetRootElement(doc) != nullptr)
+                    Fail("extra content after the root element", pos);
+                pos = ParseStartTag(pos + 1, doc, node);
+                AppendChild(open.back(), node);
+                projection.Open(node, covered);
+                if (*pos == '/') {
+                    if (++pos == end_ || *pos != '>')
+                        Fail("expected `>'", pos);
+                    projection.Close(node, covered);
+                }
+                else
+                    open.push_back(node);
+                ++pos;
+            }
+        }
+        if (open.size() != 1)
+            Fail("unterminated element", pos);
+        if (xmlDocGetRootElement(doc) == nullptr)
+            Fail("no root element", pos);
+    }
+    catch (...) {
+        xmlFreeDoc(doc);
+        throw;
+    }
+    return doc;
+}
+
+}
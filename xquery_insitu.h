@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+#include "xquery_document.h"
+
+namespace xquery
+{
+
+/*
+ * Tokenizes a mapped XML file in place: markup is located with a vectorized
+ * scan, names and character data are views into the mapping, and only the
+ * segments holding references or carriage returns are decoded.
+ * The subset handled is UTF-8 documents without namespaces nor user defined
+ * entities, anything else throws so that the caller can fall back to libxml2.
+ */
+class InSituParser : public NonCopyable, public NonMoveable
+{
+    public:
+        // Throws `std::runtime_error'
+        InSituParser(const std::string& filename);
+        ~InSituParser();
+
+        // Throws `std::runtime_error'
+        xmlDoc* Parse(const Projection& projection);
+
+    private:
+        [[noreturn]] void Fail(const std::string& what, const char* pos) const;
+        const char* Find(const char* pos, const char* pattern) const; // Throws
+        const char* SkipBlanks(const char* pos) const;
+        const char* ScanName(const char* pos) const;
+        const char* ParseStartTag(const char* pos, xmlDoc* doc, xmlNode*& node);
+        void Decode(const char* begin, const char* end, bool attribute);
+
+        std::string filename_;
+        const char* begin_ = nullptr;
+        const char* end_ = nullptr;
+        size_t      size_ = 0;
+        std::string decoded_;
+};
+
+}
@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "xquery_lowering.h"
+#include "xquery_nodes.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+namespace xql = lang;
+
+const xmlChar* Name(const std::string& name)
+{
+    return reinterpret_cast<const xmlChar*>(name.c_str());
+}
+
+// Wrapper of `node' (see `xml::Node::create_wrapper'), null for null
+xml::Node* Wrap(xmlNode* node)
+{
+    if (node == nullptr)
+        return nullptr;
+    xml::Node::create_wrapper(node);
+    return static_cast<xml::Node*>(node->_private);
+}
+
+// `get_children(name)' of every node
+void Children(xmlNode* node, const xmlChar* name, std::vector<xmlNode*>& out)
+{
+    for (auto child = node->children; child; child = child->next)
+        if (child->name && xmlStrEqual(child->name, name))
+            out.push_back(child);
+}
+
+// `find(".//*")' preceded by the node itself
+void DescendantsOrSelf(xmlNode* node, std::vector<xmlNode*>& out)
+{
+    out.push_back(node);
+    for (auto child = node->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE)
+            DescendantsOrSelf(child, out);
+}
+
+// `Children' of the node and of its descendants, in document order
+void DescendantChildren(xmlNode* node, const xmlChar* name, std::vector<xmlNode*>& out)
+{
+    Children(node, name, out);
+    for (auto child = node->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE)
+            DescendantChildren(child, name, out);
+}
+
+}
+
+std::unique_ptr<const LoweredPath> LoweredPath::Lower(const Node* node)
+{
+    std::unique_ptr<LoweredPath> path{new LoweredPath};
+
+    if ( !dynamic_cast<const xql::PathSeparator*>(node) && !dynamic_cast<const xql::Filter*>(node))
+        return nullptr;
+    if ( !path->Append(node))
+        return nullptr;
+    return path;
+}
+
+bool LoweredPath::Append(const Node* node)
+{
+    // Documents, collections and variables start the path, they ignore the
+    // context nodes
+    auto start = ops_.empty();
+
+    if (auto doc = dynamic_cast<const xql::Document*>(node))
+        Push(DOCUMENT, doc->name());
+    else if (auto collection = dynamic_cast<const xql::Collection*>(node))
+        Push(COLLECTION, collection->directory(), collection);
+    else if (auto var = dynamic_cast<const xql::Variable*>(node))
+        Push(VARIABLE, var->varname());
+    else if (auto tag = dynamic_cast<const xql::TagName*>(node)) {
+        Push(CHILDREN, tag->tagname());
+        return true;
+    }
+    else if (auto glob = dynamic_cast<const xql::PathGlobbing*>(node)) {
+        if (glob->wildcard())
+            Push(ALL_CHILDREN);
+        else if (glob->parent())
+            Push(PARENT);
+        return true;
+    }
+    else if (dynamic_cast<const xql::Text*>(node)) {
+        Push(TEXT);
+        return true;
+    }
+    else if (auto sep = dynamic_cast<const xql::PathSeparator*>(node)) {
+        auto right = *(std::begin(*sep) + 1);
+        // A `//' step on a tag name is fused with the search of the subtrees
+        auto right_tag = sep->descendants() ? dynamic_cast<const xql::TagName*>(right) : nullptr;
+
+        if ( !Append(*std::begin(*sep)))
+            return false;
+        if (right_tag)
+            Push(DESCENDANT_CHILDREN, right_tag->tagname());
+        else {
+            if (sep->descendants())
+                Push(DESCENDANTS);
+            if ( !Append(right))
+                return false;
+        }
+        Push(UNIQUE);
+        return true;
+    }
+    else if (auto filter = dynamic_cast<const xql::Filter*>(node)) {
+        auto predicate = *(std::begin(*filter) + 1);
+        auto predicate_tag = dynamic_cast<const xql::TagName*>(predicate);
+
+        if ( !Append(*std::begin(*filter)))
+            return false;
+        if (predicate_tag)
+            Push(HAS_CHILD, predicate_tag->tagname());
+        else
+            Push(FILTER, "", predicate);
+        return true;
+    }
+    else
+        return false;
+    return start;
+}
+
+xml::NodeList LoweredPath::Evaluate(Ast& ast, const xml::NodeList* context) const
+{
+    std::vector<xmlNode*> in, out;
+    xml::NodeList         ret_nodes;
+    // Context of the predicates, one node at a time
+    Node::EvalResult      predicate_context{xml::NodeList{nullptr}};
+
+    if (context)
+        for (auto node : *context)
+            in.push_back(node ? node->cobj() : nullptr);
+
+    for (const auto& op : ops_) {
+        out.clear();
+        switch (op.type) {
+            case DOCUMENT: {
+                auto root = ast.documents().Load(op.name).root();
+                out.push_back(root ? root->cobj() : nullptr);
+                break;
+            }
+            case COLLECTION:
+                // The collection node restricts it to a document in a part of
+                // a distributed evaluation
+                for (auto root : op.node->Eval({}).nodes)
+                    out.push_back(root ? root->cobj() : nullptr);
+                break;
+            case VARIABLE:
+                for (auto node : ast.context().CtxFindVarDef(op.name))
+                    out.push_back(node ? node->cobj() : nullptr);
+                break;
+            case CHILDREN:
+                for (auto node : in)
+                    Children(node, Name(op.name), out);
+                break;
+            case ALL_CHILDREN:
+                for (auto node : in)
+                    for (auto child = node->children; child; child = child->next)
+                        out.push_back(child);
+                break;
+            case PARENT:
+                for (auto node : in)
+                    out.push_back(node->parent && node->parent->type == XML_ELEMENT_NODE ?
+                                  node->parent : nullptr);
+                break;
+            case TEXT:
+                for (auto node : in) {
+                    if (node->type != XML_ELEMENT_NODE) {
+                        auto name = node->name ? reinterpret_cast<const char*>(node->name) : "";
+                        throw std::runtime_error(std::string{name} + " is not a valid text node");
+                    }
+                    for (auto child = node->children; child; child = child->next)
+                        if (child->type == XML_TEXT_NODE) {
+                            out.push_back(child);
+                            break;
+                        }
+                }
+                break;
+            case DESCENDANTS:
+                for (auto node : in)
+                    DescendantsOrSelf(node, out);
+                break;
+            case DESCENDANT_CHILDREN:
+                for (auto node : in)
+                    DescendantChildren(node, Name(op.name), out);
+                break;
+            case UNIQUE:
+                // The tail is kept, as by the interpreter
+                std::unique(std::begin(in), std::end(in));
+                continue;
+            case HAS_CHILD:
+                for (auto node : in)
+                    for (auto child = node->children; child; child = child->next)
+                        if (xmlStrEqual(child->name, Name(op.name))) {
+                            out.push_back(node);
+                            break;
+                        }
+                break;
+            case FILTER:
+                for (auto node : in) {
+                    predicate_context.nodes.front() = Wrap(node);
+                    if (op.node->Exists(predicate_context))
+                        out.push_back(node);
+                }
+                break;
+        }
+        in.swap(out);
+    }
+
+    for (auto node : in)
+        ret_nodes.push_back(Wrap(node));
+    return ret_nodes;
+}
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+
+namespace xquery
+{
+
+class Ast;
+class Node;
+
+/*
+ * Path lowered to a flat sequence of operations on the libxml2 nodes of the
+ * whole sequence, each one specialized on the step it evaluates. A path
+ * evaluated by its operations builds no intermediate result and makes no
+ * virtual call per step, the sequences are the ones of the interpreter.
+ */
+class LoweredPath : public NonCopyable, public NonMoveable
+{
+    public:
+        // Null unless `node' is a path (steps, wildcards, `text()' and
+        // filters from a document, a collection, a variable or the context
+        // nodes), single steps are left to the interpreter
+        static std::unique_ptr<const LoweredPath> Lower(const Node* node);
+
+        // Sequence of the path evaluated on `context' (null if there is no
+        // context node)
+        // Throws `std::runtime_error' or `xml::validity_error'
+        xml::NodeList Evaluate(Ast& ast, const xml::NodeList* context) const;
+
+    private:
+        enum OpType
+        {
+            DOCUMENT,            // Root of the document `name'
+            COLLECTION,          // Roots of the documents of the collection `node'
+            VARIABLE,            // Nodes bound to `name'
+            CHILDREN,            // Children named `name'
+            ALL_CHILDREN,
+            PARENT,              // Parent element or null
+            TEXT,                // First text child
+            DESCENDANTS,         // Node then its descendant elements
+            DESCENDANT_CHILDREN, // `DESCENDANTS' then `CHILDREN', fused
+            UNIQUE,              // `std::unique' without erasing the tail
+            HAS_CHILD,           // Nodes with a child named `name'
+            FILTER               // Nodes satisfying the predicate `node'
+        };
+
+        struct Op
+        {
+            OpType      type;
+            std::string name;
+            const Node* node;
+        };
+
+        LoweredPath() = default;
+
+        // Appends the operations of `node', returns false if one of its
+        // steps can't be lowered
+        bool Append(const Node* node);
+        void Push(OpType type, const std::string& name = "", const Node* node = nullptr)
+        {
+            ops_.push_back(Op{type, name, node});
+        }
+
+        std::vector<Op> ops_;
+};
+
+}
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <new>
+
+#include "xquery_memo.h"
+#include "xquery_ast.h"
+#include "xquery_nodes.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+// Wraps the nodes of a subtree, as the ones of the loaded documents are
+void WrapSubtree(xmlNode* node)
+{
+    xml::Node::create_wrapper(node);
+    for (auto child = node->children; child; child = child->next)
+        WrapSubtree(child);
+}
+
+// Finds the documents read by `node' and if it reads texts
+void Inputs(const Node* node, std::unordered_set<std::string>& documents, bool& texts)
+{
+    if (node == nullptr)
+        return;
+    if (auto doc = dynamic_cast<const lang::Document*>(node))
+        documents.insert(doc->name());
+    else if (dynamic_cast<const lang::Text*>(node))
+        texts = true;
+    for (auto edge : *node)
+        Inputs(edge, documents, texts);
+}
+
+template <typename Names>
+bool Intersects(const Names& names, const std::unordered_set<std::string>& tags)
+{
+    for (const auto& name : names)
+        if (tags.count(name))
+            return true;
+    return false;
+}
+
+}
+
+const xml::NodeList* ResultMemo::FindPath(const Node* node)
+{
+    auto it = paths_.find(node);
+    if (it == std::end(paths_))
+        return nullptr;
+    ++reused_;
+    return &it->second.nodes;
+}
+
+void ResultMemo::KeepPath(const Node* node, const xml::NodeList& nodes)
+{
+    PathEntry entry;
+
+    entry.nodes = nodes;
+    entry.projection.keep_all = false;
+    node->Project(entry.projection, true);
+    Inputs(node, entry.documents, entry.texts);
+    paths_[node] = std::move(entry);
+    ++evaluated_;
+}
+
+size_t ResultMemo::TupleHash::operator()(const Tuple& tuple) const
+{
+    size_t hash = 0;
+
+    for (auto node : tuple)
+        hash = hash * 31 + std::hash<const xmlNode*>{}(node);
+    return hash;
+}
+
+const xml::NodeList* ResultMemo::FindTuple(const Node* flwr, const Tuple& tuple)
+{
+    auto entries = tuples_.find(flwr);
+    if (entries == std::end(tuples_))
+        return nullptr;
+    auto it = entries->second.find(tuple);
+    if (it == std::end(entries->second))
+        return nullptr;
+    ++reused_;
+    return &it->second.nodes;
+}
+
+void ResultMemo::KeepTuple(const Node* flwr, const Tuple& tuple, const xml::NodeList& nodes,
+                           const ExecutionContext& context)
+{
+    MemoryScope scope{MemoryCategory::CONSTRUCTED};
+    auto& entry = tuples_[flwr][tuple];
+
+    Free(entry);
+    // The nodes constructed are freed with the context, the ones of the
+    // other results kept may be dropped first
+    for (auto node : nodes)
+        if (node && (node->cobj()->doc == context.collector() ||
+                     node->cobj()->doc == copies_.get_root_node()->cobj()->doc))
+            entry.nodes.push_back(Copy(node, entry));
+        else
+            entry.nodes.push_back(node);
+    ++evaluated_;
+}
+
+bool ResultMemo::Documents(const Tuple& tuple, const ExecutionContext& context) const
+{
+    for (auto node : tuple)
+        if (node->doc == context.collector() || node->doc == copies_.get_root_node()->cobj()->doc)
+            return false;
+    return true;
+}
+
+void ResultMemo::Invalidate(const DocumentChanges& changes)
+{
+    // Elements holding an edit, with their names
+    std::unordered_set<const xmlNode*> edited;
+    std::unordered_set<std::string>    edited_tags;
+
+    if (changes.subtrees == 0)
+        return;
+    for (auto parent : changes.parents)
+        for (auto node = parent; node->type == XML_ELEMENT_NODE; node = node->parent) {
+            if ( !edited.insert(node).second)
+                break;
+            edited_tags.insert(reinterpret_cast<const char*>(node->name));
+        }
+
+    // A path gives other nodes if an element one of its steps names was
+    // removed or inserted, or if a subtree it consumes as a whole (a
+    // predicate compares it) or a text it reads was edited
+    for (auto it = std::begin(paths_); it != std::end(paths_); ) {
+        const auto& entry = it->second;
+        const auto& proj = entry.projection;
+        if (entry.documents.count(changes.filename) &&
+            (proj.keep_all || Intersects(proj.steps, changes.tags) ||
+             Intersects(proj.subtrees, edited_tags) || (entry.texts && Intersects(proj.steps, edited_tags))))
+            it = paths_.erase(it);
+        else
+            ++it;
+    }
+
+    // A tuple reads the subtrees of its nodes alone
+    for (auto& flwr : tuples_)
+        for (auto it = std::begin(flwr.second); it != std::end(flwr.second); ) {
+            auto affected = std::any_of(std::begin(it->first), std::end(it->first),
+              [&](const xmlNode* node) { return changes.removed.count(node) || edited.count(node); });
+            if (affected) {
+                Free(it->second);
+                it = flwr.second.erase(it);
+            }
+            else
+                ++it;
+        }
+}
+
+void ResultMemo::Clear()
+{
+    paths_.clear();
+    for (auto& flwr : tuples_)
+        for (auto& entry : flwr.second)
+            Free(entry.second);
+    tuples_.clear();
+}
+
+xml::Node* ResultMemo::Copy(const xml::Node* node, TupleEntry& entry)
+{
+    std::vector<size_t> positions;
+    auto root = xmlDocGetRootElement(node->cobj()->doc);
+    auto top = const_cast<xmlNode*>(node->cobj());
+
+    // Constructed text nodes are held by an element of their own
+    for (; top->parent != root; top = top->parent) {
+        size_t position = 0;
+        for (auto sibling = top->parent->children; sibling != top; sibling = sibling->next)
+            ++position;
+        positions.push_back(position);
+    }
+
+    auto copies = copies_.get_root_node()->cobj();
+    auto copy = xmlDocCopyNode(top, copies->doc, 1);
+    if (copy == nullptr)
+        throw std::bad_alloc{};
+    AppendChild(copies, copy);
+    WrapSubtree(copy);
+    entry.copies.push_back(copy);
+
+    for (auto it = positions.rbegin(); it != positions.rend(); ++it) {
+        copy = copy->children;
+        for (size_t i = 0; i < *it; ++i)
+            copy = copy->next;
+    }
+    return static_cast<xml::Node*>(copy->_private);
+}
+
+void ResultMemo::Free(TupleEntry& entry)
+{
+    for (auto copy : entry.copies) {
+        xml::Node::free_wrappers(copy);
+        xmlUnlinkNode(copy);
+        xmlFreeNode(copy);
+    }
+    entry.copies.clear();
+    entry.nodes.clear();
+}
+
+}
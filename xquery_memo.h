@@ -0,0 +1,108 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+#include "xquery_document.h"
+
+namespace xquery
+{
+
+class Node;
+class ExecutionContext;
+
+/*
+ * Results kept from one evaluation of a query to the next while its
+ * documents change (see `Processor::Watch'): the results of the paths from
+ * `doc()' inputs, and the results of the return clause of the FLWR tuples,
+ * per tuple of nodes bound to the `for' variables. Each one is dropped once a
+ * change of a document may affect it, the others are reused as they are.
+ */
+class ResultMemo : public NonCopyable, public NonMoveable
+{
+    public:
+        // Nodes bound to the `for' variables of a FLWR expression
+        using Tuple = std::vector<const xmlNode*>;
+
+        ResultMemo()
+        {
+            copies_.create_root_node("memo");
+        }
+        ~ResultMemo() = default;
+
+        // Result kept for the path `node', null if there is none
+        const xml::NodeList* FindPath(const Node* node);
+        // Keeps the complete result of `node', a path reading nothing but
+        // documents
+        void KeepPath(const Node* node, const xml::NodeList& nodes);
+        // Result of the return clause of `flwr' kept for `tuple', null if
+        // there is none
+        const xml::NodeList* FindTuple(const Node* flwr, const Tuple& tuple);
+        // Keeps the complete result of the return clause of `flwr' for
+        // `tuple', it must read nothing but the subtrees of the nodes of the
+        // tuple. The nodes constructed in `context' are copied.
+        void KeepTuple(const Node* flwr, const Tuple& tuple, const xml::NodeList& nodes,
+                       const ExecutionContext& context);
+        // Tells if the nodes of `tuple' are in documents, the results of the
+        // tuples of constructed nodes are not kept
+        bool Documents(const Tuple& tuple, const ExecutionContext& context) const;
+        // Drops the results `changes' may affect
+        void Invalidate(const DocumentChanges& changes);
+        // Drops every result
+        void Clear();
+
+        // Results reused and evaluated since the last `ResetCounts'
+        size_t reused() const
+        {
+            return reused_;
+        }
+        size_t evaluated() const
+        {
+            return evaluated_;
+        }
+        void ResetCounts()
+        {
+            reused_ = evaluated_ = 0;
+        }
+
+    private:
+        struct PathEntry
+        {
+            xml::NodeList                   nodes;
+            // Documents read and the parts of them reached (see `Projection')
+            std::unordered_set<std::string> documents;
+            Projection                      projection;
+            // Tells if the texts of the elements of the steps are read
+            bool                            texts = false;
+        };
+        struct TupleHash
+        {
+            size_t operator()(const Tuple& tuple) const;
+        };
+        struct TupleEntry
+        {
+            xml::NodeList         nodes;
+            // Copies of the nodes constructed, children of the root of
+            // `copies_'
+            std::vector<xmlNode*> copies;
+        };
+        using TupleEntries = std::unordered_map<Tuple, TupleEntry, TupleHash>;
+
+        // Copies `node' (constructed in `context') with its ancestors up to
+        // the root of the nodes constructed, returns the copy of `node'
+        xml::Node* Copy(const xml::Node* node, TupleEntry& entry);
+        void Free(TupleEntry& entry);
+
+        std::unordered_map<const Node*, PathEntry>    paths_;
+        std::unordered_map<const Node*, TupleEntries> tuples_;
+        // Owns the copies of the constructed nodes kept
+        xml::Document                                 copies_;
+        size_t                                        reused_ = 0;
+        size_t                                        evaluated_ = 0;
+};
+
+}
@@ -0,0 +1,401 @@
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <functional>
+#include <dlfcn.h>
+
+#include "xquery_native.h"
+#include "xquery_nodes.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+namespace xql = lang;
+
+// Helpers of the translated queries, with the semantics of the libxml++
+// calls made by the interpreter
+const char* kPrologue = R"(#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <libxml/tree.h>
+
+namespace
+{
+
+using Nodes = std::vector<xmlNode*>;
+using Load = xmlNode* (*)(void* data, const char* name);
+using Emit = void (*)(void* data, xmlNode* node);
+using Subtree = void (*)(void* data, Load load, xmlNode* const* in, size_t count, Emit emit);
+
+struct Host
+{
+    void* data;
+    Load  load;
+};
+
+const xmlChar* Name(const char* name)
+{
+    return reinterpret_cast<const xmlChar*>(name);
+}
+
+// `get_children(name)'
+void Children(xmlNode* node, const xmlChar* name, Nodes& out)
+{
+    for (auto child = node->children; child; child = child->next)
+        if (child->name && xmlStrEqual(child->name, name))
+            out.push_back(child);
+}
+
+bool HasChild(xmlNode* node, const xmlChar* name)
+{
+    for (auto child = node->children; child; child = child->next)
+        if (child->name && xmlStrEqual(child->name, name))
+            return true;
+    return false;
+}
+
+// `find(".//*")' preceded by the node itself
+void DescendantsOrSelf(xmlNode* node, Nodes& out)
+{
+    out.push_back(node);
+    for (auto child = node->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE)
+            DescendantsOrSelf(child, out);
+}
+
+// `Children' of the node and of its descendants, in document order
+void DescendantChildren(xmlNode* node, const xmlChar* name, Nodes& out)
+{
+    Children(node, name, out);
+    for (auto child = node->children; child; child = child->next)
+        if (child->type == XML_ELEMENT_NODE)
+            DescendantChildren(child, name, out);
+}
+
+)";
+
+// C++ string literal of `str'
+std::string Quote(const std::string& str)
+{
+    std::ostringstream quoted;
+
+    quoted << '"';
+    for (auto c : str) {
+        auto byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\')
+            quoted << '\\' << c;
+        else if (byte < 0x20 || byte >= 0x7f)
+            quoted << '\\' << std::oct << std::setw(3) << std::setfill('0')
+                   << static_cast<int>(byte) << std::dec;
+        else
+            quoted << c;
+    }
+    quoted << '"';
+    return quoted.str();
+}
+
+/*
+ * Translates every node to a function evaluating it on a sequence, the
+ * functions of the children being written first. The steps on a tag name
+ * compare the names directly and the `//' steps on a tag name search the
+ * subtrees without building the sequence of their nodes.
+ */
+class Translator
+{
+    public:
+        Translator(std::ostream& out) : out_(out) {}
+
+        // Paths: steps, wildcards, `text()', filters on paths and
+        // concatenations of paths
+        static bool Translatable(const Node* node);
+        // Returns the name of the function evaluating `node', which must
+        // be translatable
+        std::string Translate(const Node* node);
+
+    private:
+        std::string Function(const Node* node, bool uses_host, bool uses_in)
+        {
+            auto name = "n" + std::to_string(node_count_++);
+
+            out_ << "// " << node->label() << std::endl
+                 << "Nodes " << name << "(const Host&" << (uses_host ? " host" : "")
+                 << ", const Nodes&" << (uses_in ? " in" : "") << ")" << std::endl;
+            return name;
+        }
+
+        std::ostream& out_;
+        size_t        node_count_ = 0;
+};
+
+bool Translator::Translatable(const Node* node)
+{
+    if ( !dynamic_cast<const xql::Document*>(node) && !dynamic_cast<const xql::TagName*>(node) &&
+         !dynamic_cast<const xql::PathGlobbing*>(node) && !dynamic_cast<const xql::Text*>(node) &&
+         !dynamic_cast<const xql::PathSeparator*>(node) && !dynamic_cast<const xql::Filter*>(node) &&
+         !dynamic_cast<const xql::Concatenation*>(node))
+        return false;
+    return std::all_of(std::begin(*node), std::end(*node), Translatable);
+}
+
+std::string Translator::Translate(const Node* node)
+{
+    std::string name;
+
+    if (auto doc = dynamic_cast<const xql::Document*>(node)) {
+        name = Function(node, true, false);
+        out_ << "{" << std::endl
+             << "    return Nodes{host.load(host.data, " << Quote(doc->name()) << ")};" << std::endl
+             << "}" << std::endl;
+    }
+    else if (auto tag = dynamic_cast<const xql::TagName*>(node)) {
+        name = Function(node, false, true);
+        out_ << "{" << std::endl
+             << "    Nodes out;" << std::endl
+             << std::endl
+             << "    for (auto node : in)" << std::endl
+             << "        Children(node, Name(" << Quote(tag->tagname()) << "), out);" << std::endl
+             << "    return out;" << std::endl
+             << "}" << std::endl;
+    }
+    else if (auto glob = dynamic_cast<const xql::PathGlobbing*>(node)) {
+        name = Function(node, false, true);
+        out_ << "{" << std::endl;
+        if (glob->self())
+            out_ << "    return in;" << std::endl;
+        else {
+            out_ << "    Nodes out;" << std::endl
+                 << std::endl
+                 << "    for (auto node : in)" << std::endl;
+            if (glob->wildcard())
+                out_ << "        for (auto child = node->children; child; child = child->next)" << std::endl
+                     << "            out.push_back(child);" << std::endl;
+            else
+                out_ << "        out.push_back(node->parent && node->parent->type == XML_ELEMENT_NODE ?" << std::endl
+                     << "                      node->parent : nullptr);" << std::endl;
+            out_ << "    return out;" << std::endl;
+        }
+        out_ << "}" << std::endl;
+    }
+    else if (dynamic_cast<const xql::Text*>(node)) {
+        name = Function(node, false, true);
+        out_ << "{" << std::endl
+             << "    Nodes out;" << std::endl
+             << std::endl
+             << "    for (auto node : in) {" << std::endl
+             << "        if (node->type != XML_ELEMENT_NODE)" << std::endl
+             << "            throw std::runtime_error(std::string{reinterpret_cast<const char*>(node->name)} +" << std::endl
+             << "              \" is not a valid text node\");" << std::endl
+             << "        for (auto child = node->children; child; child = child->next)" << std::endl
+             << "            if (child->type == XML_TEXT_NODE) {" << std::endl
+             << "                out.push_back(child);" << std::endl
+             << "                break;" << std::endl
+             << "            }" << std::endl
+             << "    }" << std::endl
+             << "    return out;" << std::endl
+             << "}" << std::endl;
+    }
+    else if (auto sep = dynamic_cast<const xql::PathSeparator*>(node)) {
+        auto right_node = *(std::begin(*sep) + 1);
+        // A `//' step on a tag name is fused with the search of the subtrees
+        auto right_tag = sep->descendants() ? dynamic_cast<const xql::TagName*>(right_node) : nullptr;
+        auto left = Translate(*std::begin(*sep));
+        auto right = right_tag ? "" : Translate(right_node);
+
+        name = Function(node, true, true);
+        out_ << "{" << std::endl;
+        if ( !sep->descendants())
+            out_ << "    auto out = " << right << "(host, " << left << "(host, in));" << std::endl;
+        else if (right_tag)
+            out_ << "    Nodes out;" << std::endl
+                 << std::endl
+                 << "    for (auto node : " << left << "(host, in))" << std::endl
+                 << "        DescendantChildren(node, Name(" << Quote(right_tag->tagname()) << "), out);"
+                 << std::endl;
+        else
+            out_ << "    Nodes desc_nodes;" << std::endl
+                 << std::endl
+                 << "    for (auto node : " << left << "(host, in))" << std::endl
+                 << "        DescendantsOrSelf(node, desc_nodes);" << std::endl
+                 << "    auto out = " << right << "(host, desc_nodes);" << std::endl;
+        out_ << "    std::unique(std::begin(out), std::end(out));" << std::endl
+             << "    return out;" << std::endl
+             << "}" << std::endl;
+    }
+    else if (auto filter = dynamic_cast<const xql::Filter*>(node)) {
+        auto cond_node = *(std::begin(*filter) + 1);
+        auto cond_tag = dynamic_cast<const xql::TagName*>(cond_node);
+        auto left = Translate(*std::begin(*filter));
+        auto cond = cond_tag ? "" : Translate(cond_node);
+
+        name = Function(node, true, true);
+        out_ << "{" << std::endl
+             << "    Nodes out;" << std::endl
+             << std::endl
+             << "    for (auto node : " << left << "(host, in))" << std::endl;
+        if (cond_tag)
+            out_ << "        if (HasChild(node, Name(" << Quote(cond_tag->tagname()) << ")))" << std::endl;
+        else
+            out_ << "        if ( !" << cond << "(host, Nodes{node}).empty())" << std::endl;
+        out_ << "            out.push_back(node);" << std::endl
+             << "    return out;" << std::endl
+             << "}" << std::endl;
+    }
+    else if (auto concat = dynamic_cast<const xql::Concatenation*>(node)) {
+        auto left = Translate(*std::begin(*concat));
+        auto right = Translate(*(std::begin(*concat) + 1));
+
+        name = Function(node, true, true);
+        out_ << "{" << std::endl
+             << "    auto out = " << left << "(host, in);" << std::endl
+             << "    auto right_out = " << right << "(host, in);" << std::endl
+             << std::endl
+             << "    out.insert(std::end(out), std::begin(right_out), std::end(right_out));" << std::endl
+             << "    return out;" << std::endl
+             << "}" << std::endl;
+    }
+    else
+        assert(false);
+
+    out_ << std::endl;
+    return name;
+}
+
+struct Host
+{
+    DocumentStore& documents;
+    xml::NodeList  nodes;
+};
+
+size_t Count(const Node* node)
+{
+    size_t count = 1;
+
+    for (auto child : *node)
+        if (child)
+            count += Count(child);
+    return count;
+}
+
+xmlNode* LoadRoot(void* data, const char* name)
+{
+    auto root = static_cast<Host*>(data)->documents.Load(name).root();
+
+    return root ? root->cobj() : nullptr;
+}
+
+void EmitNode(void* data, xmlNode* node)
+{
+    if (node)
+        xml::Node::create_wrapper(node);
+    static_cast<Host*>(data)->nodes.push_back(node ? static_cast<xml::Node*>(node->_private) : nullptr);
+}
+
+}
+
+void EmitCpp(const Ast& ast, const std::string& source, std::ostream& out)
+{
+    std::ostringstream functions, subtrees;
+    std::vector<size_t> indices;
+    std::vector<std::string> names;
+    Translator translator{functions};
+    size_t index = 0;
+
+    // Nodes numbered in prefix order, as in `Ast::Fingerprint'
+    std::function<void (const Node*)> translate =
+        [&](const Node* node) {
+            // Single steps are left to the interpreter
+            if (node->begin() != node->end() && Translator::Translatable(node)) {
+                auto name = "s" + std::to_string(names.size());
+                subtrees << "void " << name
+                         << "(void* data, Load load, xmlNode* const* in, size_t count, Emit emit)"
+                         << std::endl
+                         << "{" << std::endl
+                         << "    Host host{data, load};" << std::endl
+                         << std::endl
+                         << "    for (auto node : " << translator.Translate(node)
+                         << "(host, Nodes(in, in + count)))" << std::endl
+                         << "        emit(data, node);" << std::endl
+                         << "}" << std::endl
+                         << std::endl;
+                indices.push_back(index);
+                names.push_back(name);
+                index += Count(node);
+                return;
+            }
+            ++index;
+            for (auto child : *node)
+                if (child)
+                    translate(child);
+        };
+
+    assert(ast.root() != nullptr);
+    translate(ast.root());
+    if (names.empty())
+        throw std::runtime_error("No path of the query can be translated");
+
+    out << "// Translated by `xquery --emit-cpp' from " << source << ", built with" << std::endl
+        << "// g++ -std=c++11 -O2 -shared -fPIC $(pkg-config --cflags libxml-2.0)" << std::endl
+        << std::endl
+        << kPrologue
+        << functions.str()
+        << subtrees.str()
+        << "}" << std::endl
+        << std::endl
+        << "extern \"C\" const char xquery_plan[] = " << Quote(ast.Fingerprint()) << ";" << std::endl
+        << "extern \"C\" const size_t xquery_subtree_count = " << names.size() << ";" << std::endl
+        << "extern \"C\" const size_t xquery_subtree_nodes[] = {";
+    for (size_t i = 0; i < indices.size(); ++i)
+        out << (i ? ", " : "") << indices[i];
+    out << "};" << std::endl
+        << "extern \"C\" const Subtree xquery_subtrees[] = {";
+    for (size_t i = 0; i < names.size(); ++i)
+        out << (i ? ", " : "") << names[i];
+    out << "};" << std::endl;
+}
+
+NativeQuery::NativeQuery(const std::string& filename)
+{
+    // Not searched in the library paths
+    auto path = filename.find('/') == std::string::npos ? "./" + filename : filename;
+
+    handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle_ == nullptr)
+        throw std::runtime_error(dlerror());
+
+    auto plan = static_cast<const char*>(dlsym(handle_, "xquery_plan"));
+    auto count = static_cast<const size_t*>(dlsym(handle_, "xquery_subtree_count"));
+    auto nodes = static_cast<const size_t*>(dlsym(handle_, "xquery_subtree_nodes"));
+    auto subtrees = static_cast<const Subtree*>(dlsym(handle_, "xquery_subtrees"));
+    if (plan == nullptr || count == nullptr || nodes == nullptr || subtrees == nullptr) {
+        dlclose(handle_);
+        throw std::runtime_error(filename + " is not a translated query");
+    }
+    plan_ = plan;
+    nodes_.assign(nodes, nodes + *count);
+    subtrees_.assign(subtrees, subtrees + *count);
+}
+
+NativeQuery::~NativeQuery()
+{
+    dlclose(handle_);
+}
+
+xml::NodeList NativeQuery::Evaluate(size_t subtree, DocumentStore& documents,
+                                    const xml::NodeList& nodes) const
+{
+    Host host{documents, {}};
+    std::vector<xmlNode*> in;
+
+    assert(subtree < subtrees_.size());
+    in.reserve(nodes.size());
+    for (auto node : nodes)
+        in.push_back(node ? node->cobj() : nullptr);
+    subtrees_[subtree](&host, LoadRoot, in.data(), in.size(), EmitNode);
+    return host.nodes;
+}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+#include "xquery_document.h"
+
+namespace xquery
+{
+
+class Ast;
+
+// Writes a C++ translation unit evaluating the paths of the query of `ast'
+// (steps, wildcards, `text()', filters on paths and their concatenations),
+// to be built as a shared object loaded by `NativeQuery'
+// Throws `std::runtime_error' if the query has no such path
+void EmitCpp(const Ast& ast, const std::string& source, std::ostream& out);
+
+/*
+ * Paths of a query translated by `EmitCpp' and built as a shared object.
+ * The object carries the plan it was translated from, the interpreter
+ * evaluates the query alone if it is not the plan of the query evaluated.
+ */
+class NativeQuery : public NonCopyable, public NonMoveable
+{
+    public:
+        // Throws `std::runtime_error' if `filename' is not such an object
+        NativeQuery(const std::string& filename);
+        ~NativeQuery();
+
+        // Evaluates the translated path `subtree' on `nodes'
+        // Throws `std::runtime_error' or `xml::validity_error'
+        xml::NodeList Evaluate(size_t subtree, DocumentStore& documents,
+                               const xml::NodeList& nodes) const;
+        // Normalized form of the query translated (see `Ast::Fingerprint')
+        const std::string& plan() const
+        {
+            return plan_;
+        }
+        // Roots of the translated paths, numbered in the prefix order of
+        // the plan
+        const std::vector<size_t>& nodes() const
+        {
+            return nodes_;
+        }
+
+    private:
+        using Load = xmlNode* (*)(void* data, const char* name);
+        using Emit = void (*)(void* data, xmlNode* node);
+        using Subtree = void (*)(void* data, Load load, xmlNode* const* in, size_t count, Emit emit);
+
+        void*                handle_;
+        std::string          plan_;
+        std::vector<size_t>  nodes_;
+        std::vector<Subtree> subtrees_;
+};
+
+}
@@ -1,5 +1,13 @@
+#include <unordered_set>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+
 #include "xquery_nodes.h"
 #include "xquery_xml.h"
+#include "xquery_trace.h"
+#include "xquery_memo.h"
 
 #define FIRST 0
 #define LEFT  0
@@ -11,36 +19,211 @@
 #define WHERE 2
 #define RET   3
 
-#define HAS_NODES(x) (x.type == EvalResult::NODES)
-#define HAS_COND(x) (x.type == EvalResult::COND)
-#define HAS_CTX_IT(x) (x.type == EvalResult::CTX_IT)
-
 namespace xquery { namespace lang
 {
 
-Node::EvalResult NonTerminalNode::Eval(const EvalResult& res) const
+namespace
+{
+
+// Skips the nodes evaluating to their single edge
+const Node* Unwrap(const Node* node)
+{
+    while (dynamic_cast<const NonTerminalNode*>(node) || dynamic_cast<const Precedence*>(node))
+        node = *std::begin(*node);
+    return node;
+}
+
+std::string FormatNumber(double number)
+{
+    std::ostringstream text;
+
+    text << std::setprecision(15) << number;
+    return text.str();
+}
+
+// Appends the names of a path made of child steps
+bool ChildSteps(const Node* node, std::vector<std::string>& steps)
+{
+    node = Unwrap(node);
+    if (auto tag = dynamic_cast<const TagName*>(node)) {
+        steps.push_back(tag->tagname());
+        return true;
+    }
+    auto sep = dynamic_cast<const PathSeparator*>(node);
+    return sep && !sep->descendants() &&
+           ChildSteps(*std::begin(*sep), steps) && ChildSteps(*(std::begin(*sep) + 1), steps);
+}
+
+// Tells if the steps of `node' evaluated on a sequence give the results of
+// each node of the sequence one after the other
+bool Distributes(const Node* node)
+{
+    node = Unwrap(node);
+    if (dynamic_cast<const Filter*>(node))
+        return Distributes(*std::begin(*node));
+    if (dynamic_cast<const PathSeparator*>(node))
+        return Distributes(*std::begin(*node)) && Distributes(*(std::begin(*node) + 1));
+    return dynamic_cast<const TagName*>(node) || dynamic_cast<const PathGlobbing*>(node) ||
+           dynamic_cast<const Text*>(node);
+}
+
+// Tells if the steps of `node' give each node once at most from distinct
+// context nodes, `disjoint' if the subtrees of the context nodes are disjoint
+// (set to whether the ones of the nodes given are)
+bool DistinctSteps(const Node* node, bool& disjoint)
+{
+    node = Unwrap(node);
+    if (dynamic_cast<const Filter*>(node))
+        return DistinctSteps(*std::begin(*node), disjoint);
+    if (auto sep = dynamic_cast<const PathSeparator*>(node)) {
+        if ( !DistinctSteps(*std::begin(*sep), disjoint))
+            return false;
+        // The subtrees of nested nodes are searched more than once
+        if (sep->descendants() && !disjoint)
+            return false;
+        disjoint = disjoint && !sep->descendants();
+        return DistinctSteps(*(std::begin(*sep) + 1), disjoint);
+    }
+    if (auto glob = dynamic_cast<const PathGlobbing*>(node))
+        return !glob->parent();
+    return dynamic_cast<const TagName*>(node) || dynamic_cast<const Text*>(node);
+}
+
+// Collection of which `node' gives the nodes of each document one document
+// after the other, each node once at most, null if there is none
+const Node* Shards(const Node* node)
+{
+    node = Unwrap(node);
+    if (dynamic_cast<const Collection*>(node))
+        return node;
+    if (dynamic_cast<const Filter*>(node))
+        return Shards(*std::begin(*node));
+    auto sep = dynamic_cast<const PathSeparator*>(node);
+    if (sep == nullptr)
+        return nullptr;
+    // The roots of the documents are disjoint, the nodes of a path from them
+    // may be nested
+    auto left = Unwrap(*std::begin(*sep));
+    auto collection = Shards(left);
+    bool disjoint = dynamic_cast<const Collection*>(left) != nullptr;
+    if (collection == nullptr || (sep->descendants() && !disjoint))
+        return nullptr;
+    disjoint = disjoint && !sep->descendants();
+    return DistinctSteps(*(std::begin(*sep) + 1), disjoint) ? collection : nullptr;
+}
+
+// Tells if the subtree of `node' has no variable and no collection
+bool Closed(const Node* node)
+{
+    if (node == nullptr)
+        return true;
+    if (dynamic_cast<const Variable*>(node) || dynamic_cast<const Collection*>(node))
+        return false;
+    return std::all_of(std::begin(*node), std::end(*node), Closed);
+}
+
+// Tells if `node' is a path from a `doc()' input reading nothing but
+// documents
+bool FromDocuments(const Node* node)
+{
+    auto start = Unwrap(node);
+    while (dynamic_cast<const PathSeparator*>(start) || dynamic_cast<const Filter*>(start))
+        start = Unwrap(*std::begin(*start));
+    return dynamic_cast<const Document*>(start) && Closed(node);
+}
+
+// Variables defined in the subtree of `node'
+void Definitions(const Node* node, std::unordered_set<const Node*>& definitions)
+{
+    if (node == nullptr)
+        return;
+    if (dynamic_cast<const VariableDef*>(node))
+        definitions.insert(node);
+    for (auto edge : *node)
+        Definitions(edge, definitions);
+}
+
+// Tells if `node' reads nothing but the subtrees of the nodes bound to
+// `definitions' (no document, no collection and no `..' step)
+bool ReadsBound(const Node* node, const std::unordered_set<const Node*>& definitions)
+{
+    if (node == nullptr)
+        return true;
+    if (auto var = dynamic_cast<const Variable*>(node))
+        return definitions.count(var->definition()) > 0;
+    if (auto glob = dynamic_cast<const PathGlobbing*>(node))
+        return !glob->parent();
+    if (dynamic_cast<const Document*>(node) || dynamic_cast<const Collection*>(node))
+        return false;
+    return std::all_of(std::begin(*node), std::end(*node),
+      [&definitions](const Node* edge) { return ReadsBound(edge, definitions); });
+}
+
+}
+
+Node::EvalResult NonTerminalNode::DoEval(const EvalResult& res) const
 {
     return edges_[FIRST]->Eval(res);
 }
 
-Node::EvalResult TagName::Eval(const EvalResult& res) const
+Node::EvalResult NonTerminalNode::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    return edges_[FIRST]->EvalFirst(res, limit);
+}
+
+bool NonTerminalNode::DoExists(const EvalResult& res) const
+{
+    return edges_[FIRST]->Exists(res);
+}
+
+Node::EvalResult TagName::DoEval(const EvalResult& res) const
+{
+    xml::NodeList children, ret_nodes;
+
+    for (auto node : res.nodes) {
+        children = node->get_children(tagname_);
+        ret_nodes.splice(std::end(ret_nodes), children);
+    }
+    return ret_nodes;
+}
+
+Node::EvalResult TagName::DoEvalFirst(const EvalResult& res, size_t limit) const
 {
     xml::NodeList children, ret_nodes;
 
-    assert(HAS_NODES(res));
     for (auto node : res.nodes) {
+        if (ret_nodes.size() >= limit)
+            break;
         children = node->get_children(tagname_);
         ret_nodes.splice(std::end(ret_nodes), children);
     }
+    if (ret_nodes.size() > limit)
+        ret_nodes.resize(limit);
     return ret_nodes;
 }
 
-Node::EvalResult Text::Eval(const EvalResult& res) const
+bool TagName::DoExists(const EvalResult& res) const
+{
+    // Same match as `get_children', without building the lists
+    for (auto node : res.nodes)
+        for (auto child = node->cobj()->children; child; child = child->next)
+            if (xmlStrEqual(child->name, reinterpret_cast<const xmlChar*>(tagname_.c_str())))
+                return true;
+    return false;
+}
+
+void TagName::Project(Projection& proj, bool whole) const
+{
+    proj.steps.insert(tagname_);
+    if (whole)
+        proj.subtrees.insert(tagname_);
+}
+
+Node::EvalResult Text::DoEval(const EvalResult& res) const
 {
     xml::NodeList ret_nodes;
     xml::Element* elem;
 
-    assert(HAS_NODES(res));
     for (auto node : res.nodes) {
         elem = dynamic_cast<xml::Element*>(node);
         if (elem == nullptr)
@@ -54,23 +237,57 @@ Node::EvalResult Text::Eval(const EvalResult& res) const
     return ret_nodes;
 }
 
-Node::EvalResult Document::Eval(const EvalResult&) const
+Node::EvalResult Document::DoEval(const EvalResult&) const
 {
-    //parser_.set_validate();
-    parser_.parse_file(name_);
-    assert(parser_);
+    const auto& doc = ast_->documents().Load(name_);
 
-    return xml::NodeList{parser_.get_document()->get_root_node()};
+    return xml::NodeList{doc.root()};
 }
 
-Node::EvalResult PathSeparator::Eval(const EvalResult& res) const
+void Document::Project(Projection& proj, bool whole) const
+{
+    if (whole)
+        proj.keep_all = true;
+}
+
+Node::EvalResult Collection::DoEval(const EvalResult&) const
+{
+    xml::NodeList ret_nodes;
+
+    // Part of a distributed evaluation (see `Ast::Distribute')
+    if (ast_->context().shard() == this)
+        return xml::NodeList{ast_->context().shard_root()};
+    for (auto doc : ast_->documents().LoadCollection(directory_))
+        ret_nodes.push_back(doc->root());
+    return ret_nodes;
+}
+
+void Collection::Project(Projection& proj, bool whole) const
+{
+    if (whole)
+        proj.keep_all = true;
+}
+
+Node::EvalResult PathSeparator::DoEval(const EvalResult& res) const
+{
+    if (documents_ && ast_->context().memo())
+        return Memoized(res, std::numeric_limits<size_t>::max());
+    if (collection_)
+        return ast_->Distribute(collection_, [this, &res]() { return Steps(res).nodes; });
+    return Steps(res);
+}
+
+Node::EvalResult PathSeparator::Steps(const EvalResult& res) const
 {
     xml::NodeList desc_nodes;
     xml::NodeSet  children;
     EvalResult    ret_res;
 
+    // Analyzed and traced evaluations go through every node
+    if (lowered_ && !ast_->instrumented())
+        return lowered_->Evaluate(*ast_, res.type == EvalResult::NODES ? &res.nodes : nullptr);
+
     auto left_res = edges_[LEFT]->Eval(res);
-    assert(HAS_NODES(left_res));
 
     if (sep_ == DESC_OR_SELF) {
         for (auto node : left_res.nodes) {
@@ -84,16 +301,102 @@ Node::EvalResult PathSeparator::Eval(const EvalResult& res) const
     else if (sep_ == DESC)
         ret_res = edges_[RIGHT]->Eval(left_res);
 
-    assert(HAS_NODES(ret_res));
     std::unique(std::begin(ret_res.nodes), std::end(ret_res.nodes));
     return ret_res;
 }
 
-Node::EvalResult PathGlobbing::Eval(const EvalResult& res) const
+Node::EvalResult PathSeparator::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    if (documents_ && ast_->context().memo())
+        return Memoized(res, limit);
+    if (collection_)
+        return ast_->Distribute(collection_, [this, &res, limit]() { return FirstSteps(res, limit).nodes; },
+                                limit);
+    return FirstSteps(res, limit);
+}
+
+Node::EvalResult PathSeparator::FirstSteps(const EvalResult& res, size_t limit) const
+{
+    xml::NodeList ret_nodes;
+    xml::NodeSet  children;
+
+    if (sep_ == DESC || !Distributes(edges_[RIGHT]))
+        return Node::DoEvalFirst(res, limit);
+
+    auto left_res = edges_[LEFT]->Eval(res);
+
+    // The subtrees are searched one at a time, until enough nodes are found
+    for (auto node : left_res.nodes) {
+        xml::NodeList desc_nodes{node};
+        children = node->find(".//*");
+        desc_nodes.insert(std::end(desc_nodes), std::begin(children), std::end(children));
+
+        auto right_res = edges_[RIGHT]->EvalFirst(desc_nodes, limit - ret_nodes.size());
+        ret_nodes.splice(std::end(ret_nodes), right_res.nodes);
+        if (ret_nodes.size() >= limit)
+            break;
+    }
+    std::unique(std::begin(ret_nodes), std::end(ret_nodes));
+    return ret_nodes;
+}
+
+Node::EvalResult PathSeparator::Memoized(const EvalResult& res, size_t limit) const
+{
+    auto memo = ast_->context().memo();
+
+    if (auto nodes = memo->FindPath(this)) {
+        xml::NodeList ret_nodes{*nodes};
+        if (ret_nodes.size() > limit)
+            ret_nodes.resize(limit);
+        return ret_nodes;
+    }
+    auto ret_res = limit == std::numeric_limits<size_t>::max() ? Steps(res) : FirstSteps(res, limit);
+    // A sequence of `limit' nodes may be cut
+    if (ret_res.nodes.size() < limit)
+        memo->KeepPath(this, ret_res.nodes);
+    return ret_res;
+}
+
+bool PathSeparator::DoExists(const EvalResult& res) const
+{
+    xml::NodeSet children;
+
+    auto left_res = edges_[LEFT]->Eval(res);
+
+    if (sep_ == DESC)
+        return edges_[RIGHT]->Exists(left_res);
+    // Steps apply to every node on its own, the subtrees are searched one at
+    // a time
+    for (auto node : left_res.nodes) {
+        xml::NodeList desc_nodes{node};
+        children = node->find(".//*");
+        desc_nodes.insert(std::end(desc_nodes), std::begin(children), std::end(children));
+        if (edges_[RIGHT]->Exists(desc_nodes))
+            return true;
+    }
+    return false;
+}
+
+void PathSeparator::Prepare() const
+{
+    // The documents of a collection are evaluated in parallel when no step
+    // gives a node twice, the tail kept by `std::unique' would depend on the
+    // whole sequence otherwise. The translated paths don't evaluate the
+    // collection node.
+    collection_ = Shards(this);
+    documents_ = FromDocuments(this);
+}
+
+void PathSeparator::Project(Projection& proj, bool whole) const
+{
+    edges_[LEFT]->Project(proj, false);
+    edges_[RIGHT]->Project(proj, whole);
+}
+
+Node::EvalResult PathGlobbing::DoEval(const EvalResult& res) const
 {
     xml::NodeList children, ret_nodes;
 
-    assert(HAS_NODES(res));
     if (glob_ == SELF)
         return res;
     else if (glob_ == WILDCARD)
@@ -107,46 +410,111 @@ Node::EvalResult PathGlobbing::Eval(const EvalResult& res) const
     return ret_nodes;
 }
 
-Node::EvalResult Precedence::Eval(const EvalResult& res) const
+void PathGlobbing::Project(Projection& proj, bool whole) const
+{
+    // Wildcards reach elements no step names
+    if (glob_ == WILDCARD || whole)
+        proj.keep_all = true;
+}
+
+Node::EvalResult Precedence::DoEval(const EvalResult& res) const
 {
     return edges_[FIRST]->Eval(res);
 }
 
-Node::EvalResult Concatenation::Eval(const EvalResult& res) const
+Node::EvalResult Precedence::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    return edges_[FIRST]->EvalFirst(res, limit);
+}
+
+bool Precedence::DoExists(const EvalResult& res) const
+{
+    return edges_[FIRST]->Exists(res);
+}
+
+Node::EvalResult Concatenation::DoEval(const EvalResult& res) const
 {
     xml::NodeList ret_nodes;
 
     auto left_res = edges_[LEFT]->Eval(res);
     auto right_res = edges_[RIGHT]->Eval(res);
-    assert(HAS_NODES(left_res));
-    assert(HAS_NODES(right_res));
 
     ret_nodes.splice(std::end(ret_nodes), left_res.nodes);
     ret_nodes.splice(std::end(ret_nodes), right_res.nodes);
     return ret_nodes;
 }
 
-Node::EvalResult Filter::Eval(const EvalResult& res) const
+Node::EvalResult Concatenation::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    auto left_res = edges_[LEFT]->EvalFirst(res, limit);
+
+    // The right sequence is only evaluated if the left one is too short
+    if (left_res.nodes.size() < limit) {
+        auto right_res = edges_[RIGHT]->EvalFirst(res, limit - left_res.nodes.size());
+        left_res.nodes.splice(std::end(left_res.nodes), right_res.nodes);
+    }
+    return left_res;
+}
+
+bool Concatenation::DoExists(const EvalResult& res) const
+{
+    return edges_[LEFT]->Exists(res) || edges_[RIGHT]->Exists(res);
+}
+
+Node::EvalResult Filter::DoEval(const EvalResult& res) const
 {
     xml::NodeList ret_nodes;
+    // Context of the filter, one node at a time
+    EvalResult    context{xml::NodeList{nullptr}};
+
+    if (lowered_ && !ast_->instrumented())
+        return lowered_->Evaluate(*ast_, res.type == EvalResult::NODES ? &res.nodes : nullptr);
 
     auto left_res = edges_[LEFT]->Eval(res);
-    assert(HAS_NODES(left_res));
 
+    // Filter is either a predicate or a RP (which must not be empty)
     for (auto node : left_res.nodes) {
-        auto right_res = edges_[RIGHT]->Eval(xml::NodeList{node});
-
-        // Filter is a predicate
-        if (HAS_COND(right_res) && right_res.condition == true)
+        context.nodes.front() = node;
+        if (edges_[RIGHT]->Exists(context))
             ret_nodes.push_back(node);
-        // Filter is a RP
-        else if (HAS_NODES(right_res))
-            if ( !right_res.nodes.empty())
-                ret_nodes.push_back(node);
     }
     return ret_nodes;
 }
 
+Node::EvalResult Filter::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    xml::NodeList ret_nodes;
+    EvalResult    context{xml::NodeList{nullptr}};
+
+    auto left_res = edges_[LEFT]->Eval(res);
+
+    for (auto it = std::begin(left_res.nodes); it != std::end(left_res.nodes) && ret_nodes.size() < limit; ++it) {
+        context.nodes.front() = *it;
+        if (edges_[RIGHT]->Exists(context))
+            ret_nodes.push_back(*it);
+    }
+    return ret_nodes;
+}
+
+bool Filter::DoExists(const EvalResult& res) const
+{
+    EvalResult context{xml::NodeList{nullptr}};
+
+    auto left_res = edges_[LEFT]->Eval(res);
+
+    return std::any_of(std::begin(left_res.nodes), std::end(left_res.nodes),
+      [this, &context](xml::Node* node) {
+          context.nodes.front() = node;
+          return edges_[RIGHT]->Exists(context);
+      });
+}
+
+void Filter::Project(Projection& proj, bool whole) const
+{
+    edges_[LEFT]->Project(proj, whole);
+    edges_[RIGHT]->Project(proj, false);
+}
+
 bool Equality::HasValueEquality(const xml::Node* n1, const xml::Node* n2) const
 {
     // Same name
@@ -167,74 +535,194 @@ bool Equality::HasValueEquality(const xml::Node* n1, const xml::Node* n2) const
                 return std::all_of(std::begin(n1_children), std::end(n1_children),
                   [this, &it](const xml::Node* node){ return HasValueEquality(node, *it++); });
         }
-        // Both are text nodes
-        else if (n1_text && n2_text)
+        // Both are text nodes, encoded ones have the same id
+        else if (n1_text && n2_text) {
+            auto id1 = TextId(n1->cobj());
+            auto id2 = TextId(n2->cobj());
+            if (id1 && id2)
+                return id1 == id2;
             return n1_text->get_content() == n2_text->get_content();
+        }
         else if (!n1_elem && !n2_elem && !n1_text && !n2_text)
             return true;
     }
     return false;
 }
 
-Node::EvalResult Equality::Eval(const EvalResult& res) const
+Node::EvalResult Equality::DoEval(const EvalResult& res) const
 {
     auto left_res = edges_[LEFT]->Eval(res);
     auto right_res = edges_[RIGHT]->Eval(res);
     auto it = std::begin(right_res.nodes);
 
-    assert(HAS_NODES(left_res));
-    assert(HAS_NODES(right_res));
     if (left_res.nodes.empty() || right_res.nodes.empty() ||
         (left_res.nodes.size() != right_res.nodes.size()))
         return false;
 
+    // Deep-equal elements have the same hash, their subtrees are only walked
+    // on a match
     if (eq_ == VALUE)
         return std::all_of(std::begin(left_res.nodes), std::end(left_res.nodes),
-          [this, &it](const xml::Node* node){ return HasValueEquality(node, *it++); });
+          [this, &it](const xml::Node* node) {
+              auto other = *it++;
+              if (node->cobj()->type == XML_ELEMENT_NODE &&
+                  StructuralHash(node->cobj()) != StructuralHash(other->cobj()))
+                  return false;
+              return HasValueEquality(node, other);
+          });
     else // REF
         return std::all_of(std::begin(left_res.nodes), std::end(left_res.nodes),
           [&it](const xml::Node* node){ return node == *it++; });
 }
 
-Node::EvalResult LogicOperator::Eval(const EvalResult& res) const
+void Equality::Project(Projection& proj, bool) const
 {
-    xml::NodeList logic_set;
+    edges_[LEFT]->Project(proj, eq_ == VALUE);
+    edges_[RIGHT]->Project(proj, eq_ == VALUE);
+}
 
-    if (op_ == AND || op_ == OR) {
-        auto left_res = edges_[LEFT]->Eval(res);
-        auto right_res = edges_[RIGHT]->Eval(res);
+Comparison::Comparison(const std::string& token, Edges&& edges) : Node{std::move(edges)}
+{
+    comp_ = kMap_.at(token);
+    set_label("Comparison `" + token + "'");
+    assert(edges_.size() == 2);
+
+    // The path can be on either side
+    for (auto i : {LEFT, RIGHT}) {
+        auto sep = dynamic_cast<const PathSeparator*>(Unwrap(edges_[i]));
+        auto constant = dynamic_cast<const ConstantString*>(Unwrap(edges_[1 - i]));
+        std::vector<std::string> steps;
 
-        if (HAS_COND(left_res) && HAS_COND(right_res)) // Both predicate
-            return (op_ == AND) ? (left_res.condition && right_res.condition)
-                                : (left_res.condition || right_res.condition);
-        else if (HAS_NODES(left_res) && HAS_NODES(right_res)) { // Both RP
-            auto it = std::begin(logic_set);
-            logic_set.resize(left_res.nodes.size() + right_res.nodes.size());
-
-            if (op_ == AND)
-                it = std::set_intersection(std::begin(left_res.nodes), std::end(left_res.nodes),
-                                           std::begin(right_res.nodes), std::end(right_res.nodes),
-                                           std::begin(logic_set));
-            else if (op_ == OR)
-                it = std::set_union(std::begin(left_res.nodes), std::end(left_res.nodes),
-                                    std::begin(right_res.nodes), std::end(right_res.nodes),
-                                    std::begin(logic_set));
-
-            logic_set.resize(std::distance(it, std::begin(logic_set)));
-            return !logic_set.empty();
+        if (sep && constant && !sep->descendants() && ChildSteps(*(std::begin(*sep) + 1), steps)) {
+            start_ = *std::begin(*sep);
+            steps_ = std::move(steps);
+            bound_.reset(new AtomicValue{constant->cstring()});
+            scan_comp_ = (i == LEFT) ? comp_ : Converse(comp_);
+            break;
         }
-        else if (HAS_COND(left_res) && HAS_NODES(right_res)) // Predicate and RP
-            return (op_ == AND) ? (left_res.condition && !right_res.nodes.empty())
-                                : (left_res.condition || !right_res.nodes.empty());
-        else if (HAS_NODES(left_res) && HAS_COND(right_res)) // RP and predicate
-            return (op_ == AND) ? (!left_res.nodes.empty() && right_res.condition)
-                                : (!left_res.nodes.empty() || right_res.condition);
     }
-    else { // NOT
-        auto first_res = edges_[FIRST]->Eval(res);
-        return HAS_NODES(first_res) ? first_res.nodes.empty() : !first_res.condition;
+}
+
+Node::EvalResult Comparison::DoEval(const EvalResult& res) const
+{
+    std::vector<AtomicValue> left_values, right_values;
+
+    if (start_ && ast_->documents().range_indexed(steps_.back())) {
+        bool unindexed;
+        if (IndexScan(res, unindexed))
+            return true;
+        // Otherwise the whole path is compared by value
+        if ( !unindexed)
+            return false;
+    }
+
+    auto left_res = edges_[LEFT]->Eval(res);
+    auto right_res = edges_[RIGHT]->Eval(res);
+
+    for (auto node : left_res.nodes)
+        left_values.push_back(AtomicValue::Of(node->cobj()));
+    for (auto node : right_res.nodes)
+        right_values.push_back(AtomicValue::Of(node->cobj()));
+    if (left_values.empty() || right_values.empty())
+        return false;
+
+    // Between numbers, only the extreme values matter
+    auto numeric = [](const AtomicValue& value) { return value.numeric; };
+    if (std::all_of(std::begin(left_values), std::end(left_values), numeric) &&
+        std::all_of(std::begin(right_values), std::end(right_values), numeric)) {
+        auto by_number = [](const AtomicValue& a, const AtomicValue& b) { return a.number < b.number; };
+        auto less = (comp_ == LESS || comp_ == LESS_EQUAL);
+        auto left = less ? std::min_element(std::begin(left_values), std::end(left_values), by_number)
+                         : std::max_element(std::begin(left_values), std::end(left_values), by_number);
+        auto right = less ? std::max_element(std::begin(right_values), std::end(right_values), by_number)
+                          : std::min_element(std::begin(right_values), std::end(right_values), by_number);
+        return Compare(*left, comp_, *right);
+    }
+    return std::any_of(std::begin(left_values), std::end(left_values),
+      [this, &right_values](const AtomicValue& a) {
+          return std::any_of(std::begin(right_values), std::end(right_values),
+            [this, &a](const AtomicValue& b) { return Compare(a, comp_, b); });
+      });
+}
+
+bool Comparison::IndexScan(const EvalResult& res, bool& unindexed) const
+{
+    auto start_res = start_->Eval(res);
+
+    std::shared_ptr<const Scan> scan;
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        const auto& documents = ast_->documents();
+        auto generation = documents.generation();
+
+        if ( !scan_ || scanned_generation_ != generation) {
+            std::unique_ptr<Scan> scanned{new Scan};
+            for (const auto& index : documents.RangeIndexes(steps_.back())) {
+                scanned->documents.insert(index.first);
+                for (auto element : index.second->Scan(scan_comp_, *bound_)) {
+                    // Goes up the steps to the start node
+                    auto node = element;
+                    for (auto step = steps_.rbegin(); node && step != steps_.rend(); ++step)
+                        node = xmlStrEqual(node->name, reinterpret_cast<const xmlChar*>(step->c_str()))
+                             ? node->parent : nullptr;
+                    if (node)
+                        scanned->starts.insert(node);
+                }
+            }
+            scan_ = std::move(scanned);
+            scanned_generation_ = generation;
+        }
+        scan = scan_;
+    }
+
+    // Constructed nodes and nodes of the documents loaded without the
+    // index are compared by value
+    unindexed = false;
+    for (auto node : start_res.nodes) {
+        if ( !scan->documents.count(node->cobj()->doc))
+            unindexed = true;
+        else if (scan->starts.count(node->cobj()))
+            return true;
+    }
+    return false;
+}
+
+void Comparison::Project(Projection& proj, bool) const
+{
+    edges_[LEFT]->Project(proj, true);
+    edges_[RIGHT]->Project(proj, true);
+}
+
+Node::EvalResult LogicOperator::DoEval(const EvalResult& res) const
+{
+    if (op_ == NOT)
+        return !edges_[FIRST]->Exists(res);
+
+    // The operands are paths or conditions (see `Ast::Compile')
+    auto left_nodes = edges_[LEFT]->kind() == ResultKind::NODES;
+    auto left_res = edges_[LEFT]->Eval(res);
+    auto left_cond = left_nodes ? !left_res.nodes.empty() : left_res.condition;
+
+    // The left operand decides
+    if (left_cond != (op_ == AND))
+        return left_cond;
+    // Both RP, they must intersect
+    if (op_ == AND && left_nodes) {
+        auto right_res = edges_[RIGHT]->Eval(res);
+        if (edges_[RIGHT]->kind() == ResultKind::CONDITION)
+            return right_res.condition;
+
+        std::unordered_set<const xml::Node*> right_set{std::begin(right_res.nodes),
+                                                       std::end(right_res.nodes)};
+        return std::any_of(std::begin(left_res.nodes), std::end(left_res.nodes),
+          [&right_set](const xml::Node* node) { return right_set.count(node) > 0; });
     }
-    return {}; // Should not return here
+    return edges_[RIGHT]->Exists(res);
+}
+
+void LogicOperator::Project(Projection& proj, bool) const
+{
+    Node::Project(proj, false);
 }
 
 /*
@@ -242,127 +730,408 @@ Node::EvalResult LogicOperator::Eval(const EvalResult& res) const
  * std::optional C++14 ?
  */
 
-Node::EvalResult Variable::Eval(const EvalResult&) const
+Node::EvalResult Variable::DoEval(const EvalResult&) const
+{
+    return ast_->context().CtxFindVarDef(varname_);
+}
+
+void Variable::Project(Projection& proj, bool whole) const
 {
-    return ast_->CtxFindVarDef(varname_);
+    if (whole)
+        proj.variables.insert(varname_);
 }
 
-Node::EvalResult ConstantString::Eval(const EvalResult&) const
+Node::EvalResult ConstantString::DoEval(const EvalResult&) const
 {
-    xml::TextNode* cstring = ast_->CollectTextNode(cstring_);
+    xml::TextNode* cstring = ast_->context().CollectTextNode(cstring_);
 
+    // Concurrent evaluations intern the same id
+    if (text_id_ == 0)
+        text_id_ = ast_->documents().texts().Intern(cstring_);
+    SetTextId(cstring->cobj(), text_id_);
     return xml::NodeList{cstring};
 }
 
-Node::EvalResult Tag::Eval(const EvalResult& res) const
+Node::EvalResult Tag::DoEval(const EvalResult& res) const
 {
-    xml::Node* tag = ast_->CollectElement(tagname_);
+    return Construct(res, std::numeric_limits<size_t>::max());
+}
 
-    auto first_res = edges_[FIRST]->Eval(res);
-    assert(HAS_NODES(first_res));
+Node::EvalResult Tag::Construct(const EvalResult& res, size_t limit) const
+{
+    xml::Node* tag = ast_->context().CollectElement(tagname_);
+
+    auto first_res = edges_[FIRST]->EvalFirst(res, limit);
+    MemoryScope scope{MemoryCategory::CONSTRUCTED};
     for (auto node : first_res.nodes)
         tag->import_node(node);
     return xml::NodeList{tag};
 }
 
-Node::EvalResult LetClause::Eval(const EvalResult& res) const
+void Tag::Project(Projection& proj, bool) const
+{
+    edges_[FIRST]->Project(proj, true);
+}
+
+Aggregate::Aggregate(const std::string& function, Edges&& edges) : Node{std::move(edges)}
+{
+    agg_ = kMap_.at(function);
+    set_label("Aggregate `" + function + "'");
+    assert(edges_.size() == 1);
+
+    auto sep = dynamic_cast<const PathSeparator*>(Unwrap(edges_[FIRST]));
+    if (agg_ == COUNT && sep && sep->descendants()) {
+        auto doc = dynamic_cast<const Document*>(Unwrap(*std::begin(*sep)));
+        auto tag = dynamic_cast<const TagName*>(Unwrap(*(std::begin(*sep) + 1)));
+        // Text and comment nodes are named too
+        if (doc && tag && tag->tagname() != "text" && tag->tagname() != "comment") {
+            count_doc_ = doc;
+            count_tag_ = tag->tagname();
+        }
+    }
+}
+
+Node::EvalResult Aggregate::DoEval(const EvalResult& res) const
+{
+    std::vector<AtomicValue> values;
+    double sum = 0;
+
+    if (count_doc_) {
+        const auto& stats = ast_->documents().Load(count_doc_->name()).stats();
+        // The root is not the child of an element
+        auto count = stats.Count(count_tag_) - (stats.root == count_tag_);
+        return xml::NodeList{ast_->context().CollectTextNode(std::to_string(count))};
+    }
+
+    auto first_res = edges_[FIRST]->Eval(res);
+    if (agg_ == COUNT)
+        return xml::NodeList{ast_->context().CollectTextNode(std::to_string(first_res.nodes.size()))};
+    if (first_res.nodes.empty())
+        return (agg_ == SUM) ? xml::NodeList{ast_->context().CollectTextNode("0")} : xml::NodeList{};
+
+    for (auto node : first_res.nodes)
+        values.push_back(AtomicValue::Of(node->cobj()));
+    if (agg_ == SUM || agg_ == AVG) {
+        for (const auto& value : values) {
+            if ( !value.numeric)
+                throw std::runtime_error(value.text + " is not a number");
+            sum += value.number;
+        }
+        if (agg_ == AVG)
+            sum /= values.size();
+        return xml::NodeList{ast_->context().CollectTextNode(FormatNumber(sum))};
+    }
+
+    auto best = std::begin(values);
+    for (auto it = std::begin(values); it != std::end(values); ++it)
+        if (Compare(*it, (agg_ == MIN) ? LESS : GREATER, *best))
+            best = it;
+    return xml::NodeList{ast_->context().CollectTextNode(best->numeric ? FormatNumber(best->number)
+                                                             : best->text)};
+}
+
+void Aggregate::Project(Projection& proj, bool) const
+{
+    // Only counting does not need the values
+    edges_[FIRST]->Project(proj, agg_ != COUNT);
+}
+
+Node::EvalResult LetClause::DoEval(const EvalResult& res) const
 {
     for (auto edge : edges_)
         edge->Eval(res);
     return {};
 }
 
-Node::EvalResult WhereClause::Eval(const EvalResult& res) const
+Node::EvalResult WhereClause::DoEval(const EvalResult& res) const
 {
     return edges_[FIRST]->Eval(res);
 }
 
-Node::EvalResult ForClause::Eval(const EvalResult&) const
+bool WhereClause::DoExists(const EvalResult& res) const
+{
+    return edges_[FIRST]->Exists(res);
+}
+
+Node::EvalResult ForClause::DoEval(const EvalResult&) const
 {
     return ctx_begin();
 }
 
-Node::EvalResult ReturnClause::Eval(const EvalResult& res) const
+Node::EvalResult ReturnClause::DoEval(const EvalResult& res) const
 {
     return edges_[FIRST]->Eval(res);
 }
 
-Node::EvalResult FLWRExpression::Eval(const EvalResult& res) const
+Node::EvalResult ReturnClause::DoEvalFirst(const EvalResult& res, size_t limit) const
 {
-    xml::NodeList ret_nodes;
-    EvalResult    ret_res;
+    return edges_[FIRST]->EvalFirst(res, limit);
+}
+
+FLWRExpression::FLWRExpression(Edges&& edges) : Node{std::move(edges)}
+{
+    set_label("FLWRExpression");
+    assert(edges_.size() == 4);
+
+    // The conjuncts of the where clause are checked while binding, the ones
+    // on let variables are left to `Satisfies'
+    static_cast<const ForClause*>(edges_[FOR])->set_condition(edges_[WHERE], edges_[LET]);
+}
+
+void FLWRExpression::Prepare() const
+{
+    std::unordered_set<const Node*> definitions;
+
+    // The tuples are sorted back in the order of the first variable, the ones
+    // of each document of its collection are evaluated in parallel
+    collection_ = Shards(*std::begin(**std::begin(*edges_[FOR])));
+
+    // The result of a tuple is kept if it only depends on the nodes bound
+    // to the `for' variables, the variables of the `let' clause are bound
+    // again from them
+    variables_.clear();
+    Definitions(this, definitions);
+    if ( !ReadsBound(edges_[LET], definitions) || !ReadsBound(edges_[RET], definitions))
+        return;
+    for (auto edge : *edges_[FOR])
+        if (auto def = dynamic_cast<const VariableDef*>(edge))
+            variables_.push_back(def->varname());
+        else {
+            variables_.clear();
+            return;
+        }
+}
+
+Node::EvalResult FLWRExpression::DoEval(const EvalResult& res) const
+{
+    return DoEvalFirst(res, std::numeric_limits<size_t>::max());
+}
 
-    ast_->CtxNew();
+Node::EvalResult FLWRExpression::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    if (collection_)
+        return ast_->Distribute(collection_, [this, &res, limit]() { return Tuples(res, limit).nodes; },
+                                limit);
+    return Tuples(res, limit);
+}
+
+Node::EvalResult FLWRExpression::Tuples(const EvalResult& res, size_t limit) const
+{
+    using Positions = std::vector<size_t>;
+    using Tuple = std::pair<Positions, xml::NodeList>;
+
+    xml::NodeList      ret_nodes;
+    EvalResult         ret_res;
+    // Results of reordered bindings, sorted back in the order of the clause
+    std::vector<Tuple> tuples;
+
+    ast_->context().CtxNew();
 
     auto for_clause = static_cast<const ForClause*>(edges_[FOR]);
     auto for_res = for_clause->Eval(res);
-    assert(HAS_CTX_IT(for_res));
 
-    for (;for_res.iterator != for_clause->ctx_end(); ++for_res.iterator) {
+    // Without reordering, the iterations stop once enough nodes are returned
+    for (;for_res.iterator != for_clause->ctx_end() && ret_nodes.size() < limit; ++for_res.iterator) {
+        TraceSpan iteration{"iteration", label_, id_};
+
         if (edges_[LET] != nullptr)
             edges_[LET]->Eval(res);
-        if (edges_[WHERE] != nullptr) {
-            auto where_res = edges_[WHERE]->Eval(res);
-            assert(HAS_COND(where_res));
-            if (where_res.condition == false)
-                continue;
+        if ( !for_res.iterator.Satisfies())
+            continue;
+        if (for_res.iterator.reordered()) {
+            ret_res = Return(res, limit);
+            tuples.emplace_back(for_res.iterator.SourcePositions(), std::move(ret_res.nodes));
+        }
+        else {
+            ret_res = Return(res, limit - ret_nodes.size());
+            ret_nodes.splice(std::end(ret_nodes), ret_res.nodes);
         }
-        ret_res = edges_[RET]->Eval(res);
-        assert(HAS_NODES(ret_res));
-        ret_nodes.splice(std::end(ret_nodes), ret_res.nodes);
     }
 
-    ast_->CtxDestroy();
+    // Only the tuples needed for the first nodes are sorted, the others
+    // once they turn out to be needed too
+    auto by_position = [](const Tuple& t1, const Tuple& t2) { return t1.first < t2.first; };
+    auto sorted = std::min(limit, tuples.size());
+    std::partial_sort(std::begin(tuples), std::begin(tuples) + sorted, std::end(tuples), by_position);
+    for (size_t i = 0; i < tuples.size() && ret_nodes.size() < limit; ++i) {
+        if (i == sorted)
+            std::sort(std::begin(tuples) + sorted, std::end(tuples), by_position);
+        ret_nodes.splice(std::end(ret_nodes), tuples[i].second);
+    }
+    if (ret_nodes.size() > limit)
+        ret_nodes.resize(limit);
+
+    ast_->context().CtxDestroy();
     return ret_nodes;
 }
 
-Node::EvalResult LetExpression::Eval(const EvalResult& res) const
+Node::EvalResult FLWRExpression::Return(const EvalResult& res, size_t limit) const
 {
-    ast_->CtxNew();
+    auto& context = ast_->context();
+    auto memo = context.memo();
+    ResultMemo::Tuple tuple;
+
+    // The return clause may read the context nodes
+    if (memo == nullptr || variables_.empty() || res.type == EvalResult::NODES)
+        return edges_[RET]->EvalFirst(res, limit);
+    for (const auto& var : variables_) {
+        const auto& nodes = context.CtxFindVarDef(var);
+        if (nodes.size() != 1 || nodes.front() == nullptr)
+            return edges_[RET]->EvalFirst(res, limit);
+        tuple.push_back(nodes.front()->cobj());
+    }
+    if ( !memo->Documents(tuple, context))
+        return edges_[RET]->EvalFirst(res, limit);
+
+    if (auto nodes = memo->FindTuple(this, tuple)) {
+        xml::NodeList ret_nodes{*nodes};
+        if (ret_nodes.size() > limit)
+            ret_nodes.resize(limit);
+        return ret_nodes;
+    }
+    auto ret_res = edges_[RET]->EvalFirst(res, limit);
+    if (ret_res.nodes.size() < limit)
+        memo->KeepTuple(this, tuple, ret_res.nodes, context);
+    return ret_res;
+}
+
+void FLWRExpression::Project(Projection& proj, bool whole) const
+{
+    for (auto edge : {edges_[FOR], edges_[LET], edges_[WHERE]})
+        if (edge)
+            edge->Project(proj, false);
+    edges_[RET]->Project(proj, whole);
+}
+
+Node::EvalResult LetExpression::DoEval(const EvalResult& res) const
+{
+    ast_->context().CtxNew();
     edges_[LEFT]->Eval(res);
     auto ret_res = edges_[RIGHT]->Eval(res);
-    ast_->CtxDestroy();
+    ast_->context().CtxDestroy();
     return ret_res;
 }
 
-Node::EvalResult VariableDef::Eval(const EvalResult& res) const
+Node::EvalResult LetExpression::DoEvalFirst(const EvalResult& res, size_t limit) const
+{
+    ast_->context().CtxNew();
+    edges_[LEFT]->Eval(res);
+    auto ret_res = edges_[RIGHT]->EvalFirst(res, limit);
+    ast_->context().CtxDestroy();
+    return ret_res;
+}
+
+void LetExpression::Project(Projection& proj, bool whole) const
+{
+    edges_[LEFT]->Project(proj, false);
+    edges_[RIGHT]->Project(proj, whole);
+}
+
+Node::EvalResult VariableDef::DoEval(const EvalResult& res) const
 {
     auto first_res = edges_[FIRST]->Eval(res);
-    assert(HAS_NODES(first_res));
-    ast_->CtxPushVarDef(varname_, std::move(first_res.nodes));
+    ast_->context().CtxPushVarDef(varname_, std::move(first_res.nodes));
     return {};
 }
 
-Node::EvalResult SomeExpression::Eval(const EvalResult& res) const
+void VariableDef::Project(Projection& proj, bool) const
+{
+    proj.definitions.insert({varname_, edges_[FIRST]});
+    edges_[FIRST]->Project(proj, false);
+}
+
+SomeExpression::SomeExpression(Edges&& edges) : Node{std::move(edges)}
 {
-    ast_->CtxNew();
+    set_label("SomeExpression");
+    assert(edges_.size() == 2);
+
+    // The conjuncts of the condition are checked while binding
+    static_cast<const SomeClause*>(edges_[LEFT])->set_condition(edges_[RIGHT], nullptr);
+}
+
+Node::EvalResult SomeExpression::DoEval(const EvalResult& res) const
+{
+    ast_->context().CtxNew();
 
     auto some_clause = static_cast<const SomeClause*>(edges_[LEFT]);
     auto some_res = some_clause->Eval(res);
-    assert(HAS_CTX_IT(some_res));
 
-    for (;some_res.iterator != some_clause->ctx_end(); ++some_res.iterator) {
-        auto sat_res = edges_[RIGHT]->Eval(res);
-        assert(HAS_COND(sat_res));
-        if (sat_res.condition == true) {
-            ast_->CtxDestroy();
+    for (;some_res.iterator != some_clause->ctx_end(); ++some_res.iterator)
+        if (some_res.iterator.Satisfies()) {
+            ast_->context().CtxDestroy();
             return true;
         }
-    }
-    ast_->CtxDestroy();
+    ast_->context().CtxDestroy();
     return false;
 }
 
-Node::EvalResult SomeClause::Eval(const EvalResult&) const
+void SomeExpression::Project(Projection& proj, bool) const
+{
+    Node::Project(proj, false);
+}
+
+Node::EvalResult SomeClause::DoEval(const EvalResult&) const
 {
     return ctx_begin();
 }
 
-Node::EvalResult Empty::Eval(const EvalResult& res) const
+Node::EvalResult Empty::DoEval(const EvalResult& res) const
+{
+    return !edges_[FIRST]->Exists(res);
+}
+
+Node::EvalResult Contains::DoEval(const EvalResult& res) const
 {
     auto first_res = edges_[FIRST]->Eval(res);
-    assert(HAS_NODES(first_res));
-    return first_res.nodes.empty();
+
+    // Documents may have been loaded by the evaluation
+    std::shared_ptr<const TextDictionary::Matches> matches;
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        const auto& texts = ast_->documents().texts();
+
+        if ( !matches_ || matches_->size() != texts.size() + 1)
+            matches_ = std::make_shared<const TextDictionary::Matches>(texts.Search(needle_));
+        matches = matches_;
+    }
+    return std::any_of(std::begin(first_res.nodes), std::end(first_res.nodes),
+      [this, &matches](const xml::Node* node) { return Matches(*matches, node->cobj()); });
+}
+
+bool Contains::Matches(const TextDictionary::Matches& matches, const xmlNode* node) const
+{
+    // CDATA sections are part of the value like the texts (see
+    // `AtomicValue'), but only the texts are interned
+    if (node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE) {
+        // Texts interned after the search are searched on their own
+        if (node->type == XML_TEXT_NODE && TextId(node) != 0 && TextId(node) < matches.size())
+            return matches[TextId(node)];
+        return node->content &&
+               std::strstr(reinterpret_cast<const char*>(node->content), needle_.c_str());
+    }
+    if (node->type == XML_ELEMENT_NODE)
+        for (auto child = node->children; child; child = child->next)
+            if (Matches(matches, child))
+                return true;
+    return false;
+}
+
+void Contains::Project(Projection& proj, bool) const
+{
+    edges_[FIRST]->Project(proj, true);
+}
+
+void Empty::Project(Projection& proj, bool) const
+{
+    edges_[FIRST]->Project(proj, false);
+}
+
+Node::EvalResult Native::DoEval(const EvalResult& res) const
+{
+    // Paths from a document are evaluated without context
+    if (res.type != EvalResult::NODES)
+        return query_.Evaluate(subtree_, ast_->documents(), {});
+    return query_.Evaluate(subtree_, ast_->documents(), res.nodes);
 }
 
 }}
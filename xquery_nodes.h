@@ -1,11 +1,17 @@
 #pragma once
 
 #include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <cassert>
 #include <algorithm>
 
 #include "xquery_ast.h"
 #include "xquery_ast_utils.h"
+#include "xquery_native.h"
+#include "xquery_lowering.h"
 
 namespace xquery { namespace lang
 {
@@ -19,6 +25,8 @@ enum NTLabel // Non terminal labels
     COND  // Condition
 };
 
+class VariableDef;
+
 class NonTerminalNode : public Node
 {
     public:
@@ -31,7 +39,9 @@ class NonTerminalNode : public Node
         }
         ~NonTerminalNode() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        bool DoExists(const EvalResult& res) const override;
 
     private:
         const std::unordered_map<NTLabel, std::string, std::hash<int>> kMap_= {
@@ -53,7 +63,18 @@ class TagName : public Node
         }
         ~TagName() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        bool DoExists(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        bool ReadsContext() const override
+        {
+            return true;
+        }
+        const std::string& tagname() const
+        {
+            return tagname_;
+        }
 
     private:
         std::string tagname_;
@@ -68,7 +89,11 @@ class Text : public Node
         }
         ~Text() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        bool ReadsContext() const override
+        {
+            return true;
+        }
 };
 
 class Document : public Node
@@ -80,11 +105,36 @@ class Document : public Node
         }
         ~Document() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        const std::string& name() const
+        {
+            return name_;
+        }
 
     private:
-        mutable xml::DomParser parser_;
-        std::string            name_;
+        std::string name_;
+};
+
+// Documents of a directory, in the order of their names
+class Collection : public Node
+{
+    public:
+        Collection(const std::string& directory) : directory_{directory}
+        {
+            set_label("Collection `" + directory_ + "'");
+        }
+        ~Collection() = default;
+
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        const std::string& directory() const
+        {
+            return directory_;
+        }
+
+    private:
+        std::string directory_;
 };
 
 class PathSeparator : public Node
@@ -105,14 +155,47 @@ class PathSeparator : public Node
         }
         ~PathSeparator() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        bool DoExists(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        // The steps apply to the nodes of the left path
+        bool EdgeContext(size_t idx, bool context) const override
+        {
+            return idx == 1 || context;
+        }
+        // `//' step
+        bool descendants() const
+        {
+            return sep_ == DESC_OR_SELF;
+        }
+        // Evaluates the path with `lowered' unless it is instrumented (set
+        // by `Ast::Compile')
+        void set_lowered(std::unique_ptr<const LoweredPath> lowered) const
+        {
+            lowered_ = std::move(lowered);
+        }
+        // Finds the collection the path is evaluated on one document at a
+        // time, if any, and if its result can be kept from an evaluation to
+        // the next (called by `Ast::Compile' and `Ast::Bind')
+        void Prepare() const;
 
     private:
+        EvalResult Steps(const EvalResult& res) const;
+        EvalResult FirstSteps(const EvalResult& res, size_t limit) const;
+        // Result kept by the memo of the context, evaluated and kept if
+        // there is none
+        EvalResult Memoized(const EvalResult& res, size_t limit) const;
+
         const std::unordered_map<std::string, SepType> kMap_= {
             {"/", DESC},
             {"//", DESC_OR_SELF}
         };
-        SepType sep_;
+        SepType                                    sep_;
+        mutable std::unique_ptr<const LoweredPath> lowered_;
+        mutable const Node*                        collection_ = nullptr;
+        // Reads nothing but documents
+        mutable bool                               documents_ = false;
 };
 
 class PathGlobbing : public Node
@@ -132,7 +215,24 @@ class PathGlobbing : public Node
         }
         ~PathGlobbing() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        bool ReadsContext() const override
+        {
+            return true;
+        }
+        bool wildcard() const
+        {
+            return glob_ == WILDCARD;
+        }
+        bool self() const
+        {
+            return glob_ == SELF;
+        }
+        bool parent() const
+        {
+            return glob_ == PARENT;
+        }
 
     private:
         const std::unordered_map<std::string, GlobType> kMap_= {
@@ -153,7 +253,9 @@ class Precedence : public Node
         }
         ~Precedence() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        bool DoExists(const EvalResult& res) const override;
 };
 
 class Concatenation : public Node
@@ -166,7 +268,9 @@ class Concatenation : public Node
         }
         ~Concatenation() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        bool DoExists(const EvalResult& res) const override;
 };
 
 class Filter : public Node
@@ -179,7 +283,27 @@ class Filter : public Node
         }
         ~Filter() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        bool DoExists(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        // The predicate is a path or a condition on each node
+        bool Accepts(size_t idx, ResultKind kind) const override
+        {
+            return kind == ResultKind::NODES || (idx == 1 && kind == ResultKind::CONDITION);
+        }
+        bool EdgeContext(size_t idx, bool context) const override
+        {
+            return idx == 1 || context;
+        }
+        // See `PathSeparator::set_lowered'
+        void set_lowered(std::unique_ptr<const LoweredPath> lowered) const
+        {
+            lowered_ = std::move(lowered);
+        }
+
+    private:
+        mutable std::unique_ptr<const LoweredPath> lowered_;
 };
 
 class Equality : public Node
@@ -199,7 +323,17 @@ class Equality : public Node
         }
         ~Equality() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::CONDITION;
+        }
+        // `=' or `eq', deep-equal sequences have the same `SequenceHash'
+        bool value() const
+        {
+            return eq_ == VALUE;
+        }
 
     private:
         bool HasValueEquality(const xml::Node* n1, const xml::Node* n2) const;
@@ -213,6 +347,57 @@ class Equality : public Node
         EqType eq_;
 };
 
+class Comparison : public Node
+{
+    public:
+        Comparison(const std::string& token, Edges&& edges);
+        ~Comparison() = default;
+
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::CONDITION;
+        }
+
+    private:
+        // Start nodes leading to a matching element in the range indexed
+        // documents
+        struct Scan
+        {
+            std::unordered_set<const xmlNode*> starts;
+            std::unordered_set<const xmlDoc*>  documents;
+        };
+
+        // `start/TAG/.../TAG' compared to a constant, with the last tag range
+        // indexed, is answered by an index scan for the start nodes of the
+        // indexed documents. Returns false if `unindexed', when other start
+        // nodes are left to compare by value.
+        bool IndexScan(const EvalResult& res, bool& unindexed) const;
+
+        const std::unordered_map<std::string, Comparator> kMap_= {
+            {"<", LESS},
+            {"lt", LESS},
+            {"<=", LESS_EQUAL},
+            {"le", LESS_EQUAL},
+            {">", GREATER},
+            {"gt", GREATER},
+            {">=", GREATER_EQUAL},
+            {"ge", GREATER_EQUAL}
+        };
+        Comparator comp_;
+
+        const Node*                  start_ = nullptr;
+        std::vector<std::string>     steps_;
+        std::unique_ptr<AtomicValue> bound_;
+        Comparator                   scan_comp_; // Of the elements to the bound
+        // Rebuilt once the loaded documents change (evaluations keep the
+        // scan they started with)
+        mutable std::shared_ptr<const Scan> scan_;
+        mutable size_t                      scanned_generation_ = 0;
+        mutable std::mutex                  mutex_;
+};
+
 class LogicOperator : public Node
 {
     enum OpType
@@ -231,7 +416,20 @@ class LogicOperator : public Node
         }
         ~LogicOperator() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::CONDITION;
+        }
+        bool Accepts(size_t, ResultKind kind) const override
+        {
+            return kind == ResultKind::NODES || kind == ResultKind::CONDITION;
+        }
+        bool conjunction() const
+        {
+            return op_ == AND;
+        }
 
     private:
         const std::unordered_map<std::string, OpType> kMap_= {
@@ -251,10 +449,26 @@ class Variable : public Node
         }
         ~Variable() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        const std::string& varname() const
+        {
+            return varname_;
+        }
+        // Binding the variable refers to, null if it is undefined (resolved
+        // by `Ast::Compile')
+        const VariableDef* definition() const
+        {
+            return definition_;
+        }
+        void set_definition(const VariableDef* definition) const
+        {
+            definition_ = definition;
+        }
 
     private:
-        std::string varname_;
+        std::string                varname_;
+        mutable const VariableDef* definition_ = nullptr;
 };
 
 class ConstantString : public Node
@@ -266,10 +480,15 @@ class ConstantString : public Node
         }
         ~ConstantString() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        const std::string& cstring() const
+        {
+            return cstring_;
+        }
 
     private:
-        std::string cstring_;
+        std::string                 cstring_;
+        mutable std::atomic<size_t> text_id_{0}; // Interned on the first evaluation
 };
 
 class Tag : public Node
@@ -284,12 +503,49 @@ class Tag : public Node
         }
         ~Tag() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+
+        // Element holding the first `limit' items of the content
+        // Throws `std::runtime_error' or `xml::validity_error'
+        EvalResult Construct(const EvalResult& res, size_t limit) const;
 
     private:
         std::string tagname_;
 };
 
+class Aggregate : public Node
+{
+    enum AggType
+    {
+        COUNT,
+        SUM,
+        MIN,
+        MAX,
+        AVG
+    };
+
+    public:
+        Aggregate(const std::string& function, Edges&& edges);
+        ~Aggregate() = default;
+
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+
+    private:
+        const std::unordered_map<std::string, AggType> kMap_= {
+            {"count", COUNT},
+            {"sum", SUM},
+            {"min", MIN},
+            {"max", MAX},
+            {"avg", AVG}
+        };
+        AggType agg_;
+        // `count(doc(x)//TAG)' is read from the statistics of the document
+        const Document* count_doc_ = nullptr;
+        std::string     count_tag_;
+};
+
 class LetClause : public Node
 {
     public:
@@ -300,7 +556,15 @@ class LetClause : public Node
         }
         ~LetClause() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::NONE;
+        }
+        bool Accepts(size_t, ResultKind kind) const override
+        {
+            return kind == ResultKind::NONE;
+        }
 };
 
 class WhereClause : public Node
@@ -313,7 +577,16 @@ class WhereClause : public Node
         }
         ~WhereClause() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        bool DoExists(const EvalResult& res) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::CONDITION;
+        }
+        bool Accepts(size_t, ResultKind kind) const override
+        {
+            return kind == ResultKind::CONDITION;
+        }
 };
 
 class ForClause : public Node, public ContextIterator
@@ -334,7 +607,15 @@ class ForClause : public Node, public ContextIterator
         {
             return ContextIterator::end();
         }
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::BINDINGS;
+        }
+        bool Accepts(size_t, ResultKind kind) const override
+        {
+            return kind == ResultKind::NONE;
+        }
 };
 
 class ReturnClause : public Node
@@ -347,20 +628,42 @@ class ReturnClause : public Node
         }
         ~ReturnClause() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
 };
 
 class FLWRExpression : public Node
 {
     public:
-        FLWRExpression(Edges&& edges) : Node{std::move(edges)}
+        FLWRExpression(Edges&& edges);
+        ~FLWRExpression() = default;
+
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        void Project(Projection& proj, bool whole) const override;
+        // The clauses `for', `let', `where' and `return'
+        bool Accepts(size_t idx, ResultKind kind) const override
         {
-            set_label("FLWRExpression");
-            assert(edges_.size() >= 2);
+            static const ResultKind kinds[] = {ResultKind::BINDINGS, ResultKind::NONE,
+                                               ResultKind::CONDITION, ResultKind::NODES};
+            return kind == kinds[idx];
         }
-        ~FLWRExpression() = default;
+        // Finds the collection of the first `for' variable the expression is
+        // evaluated on one document at a time, if any, and if the results of
+        // its tuples can be kept from an evaluation to the next (called by
+        // `Ast::Compile' and `Ast::Bind')
+        void Prepare() const;
 
-        EvalResult Eval(const EvalResult& res) const override;
+    private:
+        EvalResult Tuples(const EvalResult& res, size_t limit) const;
+        // Result of the return clause for the nodes bound, kept by the memo
+        // of the context
+        EvalResult Return(const EvalResult& res, size_t limit) const;
+
+        mutable const Node*              collection_ = nullptr;
+        // `for' variables, empty unless the return and `let' clauses read
+        // nothing but the subtrees of the nodes bound to them
+        mutable std::vector<std::string> variables_;
 };
 
 class LetExpression : public Node
@@ -373,7 +676,13 @@ class LetExpression : public Node
         }
         ~LetExpression() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        EvalResult DoEvalFirst(const EvalResult& res, size_t limit) const override;
+        void Project(Projection& proj, bool whole) const override;
+        bool Accepts(size_t idx, ResultKind kind) const override
+        {
+            return kind == (idx == 0 ? ResultKind::NONE : ResultKind::NODES);
+        }
 };
 
 class VariableDef : public Node
@@ -383,12 +692,21 @@ class VariableDef : public Node
           : Node{std::move(edges)},
             varname_{varname}
         {
-            set_label("VariableDef");
+            set_label("VariableDef `" + varname_ + "'");
             assert(edges_.size() == 1);
         }
         ~VariableDef() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::NONE;
+        }
+        const std::string& varname() const
+        {
+            return varname_;
+        }
 
     private:
         std::string varname_;
@@ -397,14 +715,19 @@ class VariableDef : public Node
 class SomeExpression : public Node
 {
     public:
-        SomeExpression(Edges&& edges) : Node{std::move(edges)}
-        {
-            set_label("SomeExpression");
-            assert(edges_.size() == 2);
-        }
+        SomeExpression(Edges&& edges);
         ~SomeExpression() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::CONDITION;
+        }
+        bool Accepts(size_t idx, ResultKind kind) const override
+        {
+            return kind == (idx == 0 ? ResultKind::BINDINGS : ResultKind::CONDITION);
+        }
 };
 
 class SomeClause : public Node, public ContextIterator
@@ -417,7 +740,15 @@ class SomeClause : public Node, public ContextIterator
         }
         ~SomeClause() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::BINDINGS;
+        }
+        bool Accepts(size_t, ResultKind kind) const override
+        {
+            return kind == ResultKind::NONE;
+        }
 
         ctx_iterator ctx_begin() const
         {
@@ -429,6 +760,36 @@ class SomeClause : public Node, public ContextIterator
         }
 };
 
+class Contains : public Node
+{
+    public:
+        Contains(const std::string& needle, Edges&& edges)
+          : Node{std::move(edges)},
+            needle_{needle}
+        {
+            set_label("Contains `" + needle_ + "'");
+            assert(edges_.size() == 1);
+        }
+        ~Contains() = default;
+
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::CONDITION;
+        }
+
+    private:
+        // Searches the texts of the subtree of `node'
+        bool Matches(const TextDictionary::Matches& matches, const xmlNode* node) const;
+
+        std::string                                            needle_;
+        // Searched again once new texts are interned (evaluations keep the
+        // matches they searched)
+        mutable std::shared_ptr<const TextDictionary::Matches> matches_;
+        mutable std::mutex                                     mutex_;
+};
+
 class Empty : public Node
 {
     public:
@@ -439,7 +800,33 @@ class Empty : public Node
         }
         ~Empty() = default;
 
-        EvalResult Eval(const EvalResult& res) const override;
+        EvalResult DoEval(const EvalResult& res) const override;
+        void Project(Projection& proj, bool whole) const override;
+        ResultKind kind() const override
+        {
+            return ResultKind::CONDITION;
+        }
+};
+
+// Path evaluated by its translation, the path itself is kept as the edge
+class Native : public Node
+{
+    public:
+        Native(const NativeQuery& query, size_t subtree, Edges&& edges)
+          : Node{std::move(edges)},
+            query_(query),
+            subtree_{subtree}
+        {
+            set_label("Native `s" + std::to_string(subtree_) + "'");
+            assert(edges_.size() == 1);
+        }
+        ~Native() = default;
+
+        EvalResult DoEval(const EvalResult& res) const override;
+
+    private:
+        const NativeQuery& query_;
+        size_t             subtree_;
 };
 
 }}
@@ -43,10 +43,10 @@
                      xquery::Lexer &lexer,
                      xquery::Processor &process);
 
-    #define NEW_NODE(...) process.ast_.AddNode(new __VA_ARGS__)
-    #define SET_ROOT(x) process.ast_.set_root(x)
-    #define BUFFERIZE(x) process.ast_.BufferizeEdge(x)
-    #define UNBUFFERIZE() process.ast_.UnbufferizeEdges()
+    #define NEW_NODE(...) process.ast_->AddNode(new __VA_ARGS__)
+    #define SET_ROOT(x) process.ast_->set_root(x)
+    #define BUFFERIZE(x) process.ast_->BufferizeEdge(x)
+    #define UNBUFFERIZE() process.ast_->UnbufferizeEdges()
 
     namespace xql = xquery::lang;
 }
@@ -59,16 +59,19 @@
 
 %token        END       0   "EOF"
 %token <sval> DOC           "doc()"
+%token <sval> COLLECTION    "collection()"
 %token <sval> TAGNAME       "tagname"
 %token <sval> PSEP          "path separator"
 %token <sval> PGLOB         "path globbing"
 %token <sval> EQUAL         "equality operator"
+%token <sval> COMP          "comparison operator"
 %token <sval> LJUNC         "logic junction"
 %token <sval> LNEG          "not"
 %token <sval> VAR           "$var"
 %token <sval> CSTR          "constant string"
 %token <sval> OTAG          "<tag>"
 %token <sval> CTAG          "</tag>"
+%token <sval> AGGREGATE     "aggregate function"
 %token        TEXT          "text()"
 %token        FOR           "for"
 %token        IN            "in"
@@ -77,10 +80,11 @@
 %token        WHERE         "where"
 %token        RET           "return"
 %token        EMPTY         "empty()"
+%token        CONTAINS      "contains()"
 %token        SOME          "some"
 %token        SATISFY       "satisfies"
 
-%destructor { delete $$; } DOC TAGNAME PSEP PGLOB EQUAL LJUNC LNEG OTAG CTAG VAR CSTR
+%destructor { delete $$; } DOC COLLECTION TAGNAME PSEP PGLOB EQUAL COMP LJUNC LNEG OTAG CTAG VAR CSTR AGGREGATE
 
 %type <node> query
 %type <node> rp
@@ -147,6 +151,11 @@ xq      : VAR               {
                                 $$ = NEW_NODE(xql::PathSeparator{*$2, {xq, rp}});
                                 delete $2;
                             }
+        | AGGREGATE '(' xq ')' {
+                                auto xq = NEW_NODE(xql::NonTerminalNode{xql::XQ, {$3}});
+                                $$ = NEW_NODE(xql::Aggregate{*$1, {xq}});
+                                delete $1;
+                            }
         | OTAG xq CTAG      {
                                 auto xq = NEW_NODE(xql::NonTerminalNode{xql::XQ, {$2}});
                                 $$ = NEW_NODE(xql::Tag{*$1, *$3, {xq}});
@@ -205,6 +214,12 @@ cond    : xq EQUAL xq       {
                                 $$ = NEW_NODE(xql::Equality{*$2, {xq1, xq2}});
                                 delete $2;
                             }
+        | xq COMP xq        {
+                                auto xq1 = NEW_NODE(xql::NonTerminalNode{xql::XQ, {$1}});
+                                auto xq2 = NEW_NODE(xql::NonTerminalNode{xql::XQ, {$3}});
+                                $$ = NEW_NODE(xql::Comparison{*$2, {xq1, xq2}});
+                                delete $2;
+                            }
         | '(' cond ')'      {
                                 auto cond = NEW_NODE(xql::NonTerminalNode{xql::COND, {$2}});
                                 $$ = NEW_NODE(xql::Precedence{{cond}});
@@ -222,6 +237,11 @@ cond    : xq EQUAL xq       {
                                 delete $1;
                             }
         | EMPTY '(' xq ')'  {   $$ = NEW_NODE(xql::Empty{{$3}});   }
+        | CONTAINS '(' xq ',' CSTR ')' {
+                                auto xq = NEW_NODE(xql::NonTerminalNode{xql::XQ, {$3}});
+                                $$ = NEW_NODE(xql::Contains{*$5, {xq}});
+                                delete $5;
+                            }
         | some SATISFY cond {
                                 auto cond = NEW_NODE(xql::NonTerminalNode{xql::COND, {$3}});
                                 $$ = NEW_NODE(xql::SomeExpression{{$1, cond}});
@@ -235,6 +255,13 @@ ap      : DOC PSEP rp       {
                                 delete $1;
                                 delete $2;
                             }
+        | COLLECTION PSEP rp {
+                                auto collection = NEW_NODE(xql::Collection{*$1});
+                                auto rp = NEW_NODE(xql::NonTerminalNode{xql::RP, {$3}});
+                                $$ = NEW_NODE(xql::PathSeparator{*$2, {collection, rp}});
+                                delete $1;
+                                delete $2;
+                            }
 ;
 
 rp      : TAGNAME           {
@@ -275,6 +302,12 @@ f       : rp %prec RP       {   $$ = NEW_NODE(xql::NonTerminalNode{xql::RP, {$1}
                                 $$ = NEW_NODE(xql::Equality{*$2, {rp1, rp2}});
                                 delete $2;
                             }
+        | rp COMP rp        {
+                                auto rp1 = NEW_NODE(xql::NonTerminalNode{xql::RP, {$1}});
+                                auto rp2 = NEW_NODE(xql::NonTerminalNode{xql::RP, {$3}});
+                                $$ = NEW_NODE(xql::Comparison{*$2, {rp1, rp2}});
+                                delete $2;
+                            }
         | '(' f ')'         {
                                 auto f = NEW_NODE(xql::NonTerminalNode{xql::F, {$2}});
                                 $$ = NEW_NODE(xql::Precedence{{f}});
@@ -290,6 +323,11 @@ f       : rp %prec RP       {   $$ = NEW_NODE(xql::NonTerminalNode{xql::RP, {$1}
                                 $$ = NEW_NODE(xql::LogicOperator{*$1, {f}});
                                 delete $1;
                             }
+        | CONTAINS '(' rp ',' CSTR ')' {
+                                auto rp = NEW_NODE(xql::NonTerminalNode{xql::RP, {$3}});
+                                $$ = NEW_NODE(xql::Contains{*$5, {rp}});
+                                delete $5;
+                            }
 ;
 
 %%
@@ -0,0 +1,104 @@
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "xquery_perf.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+// In the order of `PerfValues', the cycles lead the group
+const uint64_t kConfigs[] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+int OpenEvent(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group == -1;
+    // Allowed unprivileged with `perf_event_paranoid' <= 2
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+}
+
+PerfCounters::PerfCounters()
+{
+    for (size_t i = 0; i < kEvents; ++i)
+        fds_[i] = -1;
+
+    fds_[0] = OpenEvent(kConfigs[0], -1);
+    if (fds_[0] == -1) {
+        auto error = errno;
+        error_ = std::strerror(error);
+        if (error == EACCES || error == EPERM)
+            error_ += " (see kernel.perf_event_paranoid)";
+        else if (error == ENOENT || error == EOPNOTSUPP)
+            error_ += " (no hardware events, as in most VMs)";
+        return;
+    }
+    slots_[0] = opened_++;
+    // The events the CPU does not count are left out of the group
+    for (size_t i = 1; i < kEvents; ++i) {
+        fds_[i] = OpenEvent(kConfigs[i], fds_[0]);
+        if (fds_[i] != -1)
+            slots_[i] = opened_++;
+    }
+    ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (size_t i = 0; i < kEvents; ++i)
+        if (fds_[i] != -1)
+            close(fds_[i]);
+}
+
+PerfValues PerfCounters::Read() const
+{
+    // Number of events, times enabled and running, then the values
+    uint64_t data[3 + kEvents];
+    uint64_t counts[kEvents] = {};
+    PerfValues values;
+
+    if ( !available())
+        return values;
+    auto size = static_cast<ssize_t>((3 + opened_) * sizeof(uint64_t));
+    if (read(fds_[0], data, size) != size)
+        return values;
+
+    auto enabled = data[1];
+    auto running = data[2];
+    for (size_t i = 0; i < kEvents; ++i) {
+        if (fds_[i] == -1)
+            continue;
+        counts[i] = data[3 + slots_[i]];
+        if (running != 0 && running < enabled)
+            counts[i] = static_cast<uint64_t>(static_cast<double>(counts[i]) * enabled / running);
+    }
+    values.cycles = counts[0];
+    values.instructions = counts[1];
+    values.cache_misses = counts[2];
+    values.branch_misses = counts[3];
+    return values;
+}
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <algorithm>
+#include <cstdint>
+
+#include "xquery_misc.h"
+
+namespace xquery
+{
+
+// Hardware events counted in user space
+struct PerfValues
+{
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cache_misses = 0; // Last level cache
+    uint64_t branch_misses = 0;
+
+    // Saturates at 0, scaled counts of a span may exceed the ones of the
+    // span containing it
+    PerfValues operator-(const PerfValues& values) const
+    {
+        PerfValues diff;
+
+        diff.cycles = cycles - std::min(cycles, values.cycles);
+        diff.instructions = instructions - std::min(instructions, values.instructions);
+        diff.cache_misses = cache_misses - std::min(cache_misses, values.cache_misses);
+        diff.branch_misses = branch_misses - std::min(branch_misses, values.branch_misses);
+        return diff;
+    }
+    PerfValues& operator+=(const PerfValues& values)
+    {
+        cycles += values.cycles;
+        instructions += values.instructions;
+        cache_misses += values.cache_misses;
+        branch_misses += values.branch_misses;
+        return *this;
+    }
+};
+
+/*
+ * Counters of the calling thread through `perf_event_open', counting as a
+ * group from construction. Unprivileged processes may count their own user
+ * space events if `kernel.perf_event_paranoid' is at most 2, the counters
+ * are not available otherwise (nor without a PMU, as in most VMs), and the
+ * events the CPU does not have stay at 0.
+ */
+class PerfCounters : public NonCopyable, public NonMoveable
+{
+    public:
+        PerfCounters();
+        ~PerfCounters();
+
+        bool available() const
+        {
+            return fds_[0] != -1;
+        }
+        // Reason the counters are not available
+        const std::string& error() const
+        {
+            return error_;
+        }
+        // Totals since construction, scaled if the kernel multiplexed the
+        // counters, 0 if not available
+        PerfValues Read() const;
+
+    private:
+        static constexpr size_t kEvents = 4;
+
+        int         fds_[kEvents];
+        // Position of the events in the group read, the group leader first
+        size_t      slots_[kEvents];
+        size_t      opened_ = 0;
+        std::string error_;
+};
+
+}
@@ -0,0 +1,399 @@
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <numeric>
+#include <unordered_set>
+#include <iterator>
+
+#include "xquery_planner.h"
+#include "xquery_nodes.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+namespace xql = lang;
+
+// Clause orders are searched exhaustively up to this number of bindings
+const size_t kMaxReorderedBindings = 7;
+// Fraction of the nodes expected to pass a filter
+const double kFilterSelectivity = 0.5;
+
+const Node* Edge(const Node* node, size_t idx)
+{
+    return *(std::begin(*node) + idx);
+}
+
+void Collect(const Node* node, std::vector<const xql::Variable*>& variables,
+             std::unordered_set<const Node*>& definitions, bool& constructs)
+{
+    if (auto var = dynamic_cast<const xql::Variable*>(node))
+        variables.push_back(var);
+    else if (dynamic_cast<const xql::VariableDef*>(node))
+        definitions.insert(node);
+    else if (dynamic_cast<const xql::Tag*>(node) || dynamic_cast<const xql::ConstantString*>(node) ||
+             dynamic_cast<const xql::Aggregate*>(node))
+        constructs = true;
+    for (auto edge : *node)
+        if (edge)
+            Collect(edge, variables, definitions, constructs);
+}
+
+// Collects the variables an expression reads from its scope (the ones it
+// does not define itself), `constructs' tells if it creates new nodes (which
+// must not be shared between iterations)
+void Inspect(const Node* node, std::vector<const xql::Variable*>& variables, bool& constructs)
+{
+    std::vector<const xql::Variable*> all;
+    std::unordered_set<const Node*>   definitions;
+
+    Collect(node, all, definitions, constructs);
+    std::copy_if(std::begin(all), std::end(all), std::back_inserter(variables),
+      [&definitions](const xql::Variable* var) { return !definitions.count(var->definition()); });
+}
+
+bool References(const std::vector<const xql::Variable*>& variables, const Node* definition)
+{
+    return std::any_of(std::begin(variables), std::end(variables),
+      [definition](const xql::Variable* var) { return var->definition() == definition; });
+}
+
+// Evaluates to the result of its single edge
+bool IsPassThrough(const Node* node)
+{
+    return dynamic_cast<const xql::NonTerminalNode*>(node) ||
+           dynamic_cast<const xql::Precedence*>(node) ||
+           dynamic_cast<const xql::WhereClause*>(node);
+}
+
+void SplitConjuncts(const Node* condition, std::vector<const Node*>& conjuncts)
+{
+    auto op = dynamic_cast<const xql::LogicOperator*>(condition);
+
+    if (IsPassThrough(condition))
+        SplitConjuncts(Edge(condition, 0), conjuncts);
+    else if (op && op->conjunction()) {
+        SplitConjuncts(Edge(condition, 0), conjuncts);
+        SplitConjuncts(Edge(condition, 1), conjuncts);
+    }
+    else
+        conjuncts.push_back(condition);
+}
+
+}
+
+std::string BindingPlan::Describe() const
+{
+    std::ostringstream desc;
+
+    desc << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < order.size(); ++i) {
+        desc << (i ? ", $" : "$") << variables[i] << " ~" << cardinalities[i];
+        if (invariant[i] && order.size() > 1)
+            desc << " (invariant)";
+        if (joins[i].build)
+            desc << " hash join";
+        if ( !conditions[i].empty())
+            desc << " where#" << conditions[i].size();
+    }
+    if ( !residual.empty())
+        desc << ", then where#" << residual.size();
+    if (reordered)
+        desc << ", reordered";
+    return desc.str();
+}
+
+BindingPlan Planner::PlanBindings(const Node* clause, const Node* condition,
+                                  const Node* late_bindings)
+{
+    std::vector<const xql::VariableDef*> bindings;
+    std::vector<const Node*>             conjuncts;
+    std::unordered_set<const Node*>      late_definitions;
+    std::unordered_set<std::string>      documents;
+    Statistics                           stats;
+    BindingPlan                          plan;
+
+    for (auto edge : *clause)
+        bindings.push_back(static_cast<const xql::VariableDef*>(edge));
+
+    // Loading a document may parse it, which is not done with the planner
+    // locked
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        for (auto binding : bindings)
+            CollectDocuments(Edge(binding, 0), documents);
+    }
+    for (const auto& document : documents)
+        stats[document] = &documents_.Load(document).stats(); // Throws
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (condition)
+        SplitConjuncts(condition, conjuncts);
+    if (late_bindings)
+        for (auto edge : *late_bindings)
+            late_definitions.insert(edge);
+
+    const auto kCount = bindings.size();
+    std::vector<Estimate>          estimates(kCount);
+    // Bindings which must be bound before each binding
+    std::vector<std::vector<bool>> after(kCount, std::vector<bool>(kCount, false));
+    std::vector<bool>              invariant(kCount, true);
+
+    // Variables are looked up by name in the bindings done so far: a binding
+    // follows the ones it depends on, precedes the ones rebinding a name it
+    // reads, and the bindings of a same name keep their order
+    for (size_t i = 0; i < kCount; ++i) {
+        std::vector<const xql::Variable*> references;
+        bool constructs = false;
+
+        Inspect(Edge(bindings[i], 0), references, constructs);
+        for (size_t j = 0; j < kCount; ++j) {
+            if (References(references, bindings[j])) {
+                after[i][j] = true;
+                invariant[i] = false;
+            }
+            else if (j > i && std::any_of(std::begin(references), std::end(references),
+                       [&](const xql::Variable* var) { return var->varname() == bindings[j]->varname(); }))
+                after[j][i] = true;
+            if (j < i && bindings[j]->varname() == bindings[i]->varname())
+                after[i][j] = true;
+        }
+        invariant[i] = invariant[i] && !constructs;
+
+        estimates[i] = EstimateExpr(Edge(bindings[i], 0), stats);
+        // A bound variable holds a single node of the sequence
+        auto bound = estimates[i];
+        bound.cardinality = bound.cost = 1;
+        variables_[bindings[i]] = bound;
+    }
+
+    // Bindings a conjunct waits for, the ones referencing a late variable are
+    // left for the end
+    std::vector<std::vector<bool>> waits;
+    std::vector<const Node*>       pushed;
+    for (auto conjunct : conjuncts) {
+        std::vector<const xql::Variable*> references;
+        std::vector<bool> binding_refs(kCount, false);
+        bool constructs = false;
+
+        Inspect(conjunct, references, constructs);
+        if (std::any_of(std::begin(references), std::end(references),
+              [&late_definitions](const xql::Variable* var) { return late_definitions.count(var->definition()); })) {
+            plan.residual.push_back(conjunct);
+            continue;
+        }
+        for (size_t j = 0; j < kCount; ++j)
+            binding_refs[j] = References(references, bindings[j]);
+        waits.push_back(std::move(binding_refs));
+        pushed.push_back(conjunct);
+    }
+
+    // Equalities between an invariant binding and the outer ones, which can
+    // be hashed
+    struct Join
+    {
+        size_t                conjunct;
+        size_t                binding;
+        BindingPlan::HashJoin sides;
+    };
+    std::vector<Join> hashable;
+    for (size_t c = 0; c < pushed.size(); ++c) {
+        auto eq = dynamic_cast<const xql::Equality*>(pushed[c]);
+        if ( !eq || !eq->value())
+            continue;
+        for (size_t side = 0; side < 2; ++side) {
+            std::vector<const xql::Variable*> build_refs, probe_refs;
+            BindingPlan::HashJoin sides;
+            bool constructs = false;
+
+            sides.build = Edge(eq, side);
+            sides.probe = Edge(eq, 1 - side);
+            Inspect(sides.build, build_refs, constructs);
+            Inspect(sides.probe, probe_refs, constructs);
+            for (size_t j = 0; j < kCount; ++j)
+                if (invariant[j] && !References(probe_refs, bindings[j]) &&
+                    std::all_of(std::begin(build_refs), std::end(build_refs),
+                      [&](const xql::Variable* var) { return var->definition() == bindings[j]; }) &&
+                    References(build_refs, bindings[j]))
+                    hashable.push_back({c, j, sides});
+        }
+    }
+    // Level at which each pushed conjunct is checked for an order
+    auto levels = [&](const std::vector<size_t>& order) {
+        std::vector<size_t> conjunct_levels(pushed.size(), 0);
+        for (size_t k = 0; k < order.size(); ++k)
+            for (size_t c = 0; c < pushed.size(); ++c)
+                if (waits[c][order[k]])
+                    conjunct_levels[c] = k;
+        return conjunct_levels;
+    };
+
+    // Nested loops: a binding is evaluated once per iteration of the outer
+    // ones, unless it is invariant, and the conjuncts filter the iterations
+    // of their level. A hash join hashes the nodes of its binding once and
+    // probes them once per iteration, finding a single node, it is chosen
+    // over the nested loop when cheaper.
+    auto plan_levels = [&](const std::vector<size_t>& order, std::vector<const Join*>& joins) {
+        auto conjunct_levels = levels(order);
+        double loops = 1, total = 0;
+        joins.assign(order.size(), nullptr);
+        for (size_t k = 0; k < order.size(); ++k) {
+            auto b = order[k];
+            auto cardinality = estimates[b].cardinality;
+            total += invariant[b] ? estimates[b].cost : loops * estimates[b].cost;
+            for (const auto& join : hashable)
+                if (join.binding == b && conjunct_levels[join.conjunct] == k &&
+                    cardinality + loops < loops * cardinality)
+                    joins[k] = &join;
+            if (joins[k]) {
+                total += cardinality + loops;
+                loops = std::min(loops, loops * cardinality);
+            }
+            else
+                loops *= cardinality;
+            for (size_t c = 0; c < pushed.size(); ++c)
+                if (conjunct_levels[c] == k) {
+                    total += loops;
+                    if ( !joins[k] || joins[k]->conjunct != c)
+                        loops *= kFilterSelectivity;
+                }
+        }
+        return total + loops;
+    };
+    auto cost = [&](const std::vector<size_t>& order) {
+        std::vector<const Join*> joins;
+        return plan_levels(order, joins);
+    };
+    auto valid = [&](const std::vector<size_t>& order) {
+        std::vector<bool> bound(kCount, false);
+        for (auto b : order) {
+            for (size_t j = 0; j < kCount; ++j)
+                if (after[b][j] && !bound[j])
+                    return false;
+            bound[b] = true;
+        }
+        return true;
+    };
+
+    std::vector<size_t> order(kCount);
+    std::iota(std::begin(order), std::end(order), 0);
+    plan.order = order;
+    if (kCount > 1 && kCount <= kMaxReorderedBindings) {
+        auto best = cost(order);
+        while (std::next_permutation(std::begin(order), std::end(order)))
+            if (valid(order) && cost(order) < best) {
+                best = cost(order);
+                plan.order = order;
+            }
+    }
+
+    plan.conditions.resize(kCount);
+    auto conjunct_levels = levels(plan.order);
+    for (size_t c = 0; c < pushed.size(); ++c)
+        plan.conditions[conjunct_levels[c]].push_back(pushed[c]);
+    std::vector<const Join*> joins;
+    plan_levels(plan.order, joins);
+    for (size_t i = 0; i < kCount; ++i) {
+        auto b = plan.order[i];
+        plan.joins.push_back(joins[i] ? joins[i]->sides : BindingPlan::HashJoin{});
+        plan.invariant.push_back(invariant[b]);
+        plan.variables.push_back(bindings[b]->varname());
+        plan.cardinalities.push_back(estimates[b].cardinality);
+        plan.reordered = plan.reordered || b != i;
+    }
+    return plan;
+}
+
+void Planner::CollectDocuments(const Node* node, std::unordered_set<std::string>& documents) const
+{
+    if (auto doc = dynamic_cast<const xql::Document*>(node))
+        documents.insert(doc->name());
+    else if (auto var = dynamic_cast<const xql::Variable*>(node)) {
+        auto it = variables_.find(var->definition());
+        if (it != std::end(variables_) && !it->second.document.empty())
+            documents.insert(it->second.document);
+    }
+    for (auto edge : *node)
+        if (edge)
+            CollectDocuments(edge, documents);
+}
+
+Estimate Planner::EstimateExpr(const Node* node, const Statistics& stats)
+{
+    if (auto doc = dynamic_cast<const xql::Document*>(node)) {
+        Estimate est;
+        est.document = doc->name();
+        est.tag = stats.at(doc->name())->root;
+        return est;
+    }
+    else if (auto var = dynamic_cast<const xql::Variable*>(node)) {
+        auto it = variables_.find(var->definition());
+        return it == std::end(variables_) ? Estimate{} : it->second;
+    }
+    else if (auto sep = dynamic_cast<const xql::PathSeparator*>(node))
+        return EstimateStep(Edge(node, 1), EstimateExpr(Edge(node, 0), stats), sep->descendants(), stats);
+    else if (dynamic_cast<const xql::Concatenation*>(node)) {
+        auto left = EstimateExpr(Edge(node, 0), stats);
+        auto right = EstimateExpr(Edge(node, 1), stats);
+        left.cardinality += right.cardinality;
+        left.cost += right.cost;
+        left.tag.clear();
+        if (left.document != right.document)
+            left.document.clear();
+        return left;
+    }
+    else if (IsPassThrough(node))
+        return EstimateExpr(Edge(node, 0), stats);
+    return {};
+}
+
+Estimate Planner::EstimateStep(const Node* node, const Estimate& context, bool descendants,
+                               const Statistics& stats)
+{
+    auto est = context;
+    auto it = stats.find(context.document);
+    auto doc_stats = (it != std::end(stats)) ? it->second : nullptr;
+    auto fan_out = [doc_stats](const std::string& parent, const std::string& child) {
+        return doc_stats ? doc_stats->FanOut(parent, child) : 1;
+    };
+
+    // The step applies to the context nodes and all their descendants, once
+    // scanned
+    if (descendants) {
+        auto scanned = context.cardinality * (doc_stats ? doc_stats->Descendants(context.tag) : 1);
+        est.cost += scanned;
+        est.cardinality += scanned;
+        est.tag.clear();
+    }
+
+    if (auto tag = dynamic_cast<const xql::TagName*>(node)) {
+        est.cost += est.cardinality * fan_out(est.tag, "");
+        est.cardinality *= fan_out(est.tag, tag->tagname());
+        est.tag = tag->tagname();
+    }
+    else if (auto glob = dynamic_cast<const xql::PathGlobbing*>(node)) {
+        est.cost += est.cardinality;
+        if (glob->wildcard())
+            est.cardinality *= fan_out(est.tag, "");
+        est.tag.clear();
+    }
+    else if (auto sep = dynamic_cast<const xql::PathSeparator*>(node))
+        est = EstimateStep(Edge(node, 1), EstimateStep(Edge(node, 0), est, false, stats),
+                           sep->descendants(), stats);
+    else if (dynamic_cast<const xql::Filter*>(node)) {
+        est = EstimateStep(Edge(node, 0), est, false, stats);
+        est.cost += est.cardinality;
+        est.cardinality *= kFilterSelectivity;
+    }
+    else if (IsPassThrough(node))
+        est = EstimateStep(Edge(node, 0), est, false, stats);
+    else {
+        est.cost += est.cardinality;
+        est.tag.clear();
+    }
+    return est;
+}
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+
+#include "xquery_misc.h"
+#include "xquery_document.h"
+
+namespace xquery
+{
+
+class Node;
+
+// Estimated result of an expression, from the statistics of its document
+struct Estimate
+{
+    double      cardinality = 1;
+    double      cost = 1;        // Nodes visited to evaluate it
+    std::string tag;             // Common name of the result, if known
+    std::string document;        // File of the result, if known
+};
+
+/*
+ * Evaluation order of the bindings of a `for' or `some' clause.
+ * The nested loops follow `order' (indexes of the clause edges), bindings
+ * depending on none of the others are evaluated once and reused.
+ */
+struct BindingPlan
+{
+    std::string Describe() const;
+
+    using Conditions = std::vector<const Node*>;
+
+    // The nodes of an invariant binding are hashed by the value of `build'
+    // (reading the binding alone) once, each iteration of the outer levels
+    // then only binds the nodes whose hash is the one of `probe'. The
+    // equality of the two is still checked with the conditions of the level.
+    struct HashJoin
+    {
+        const Node* build = nullptr;
+        const Node* probe = nullptr;
+    };
+
+    std::vector<size_t>      order;
+    std::vector<bool>        invariant;   // Per loop level
+    std::vector<std::string> variables;   // Per loop level
+    std::vector<double>      cardinalities;
+    // Checked once the binding of the level is done
+    std::vector<Conditions>  conditions;
+    // Per loop level, no `build' for a nested loop
+    std::vector<HashJoin>    joins;
+    // Checked once every binding is done
+    Conditions               residual;
+    bool                     reordered = false;
+};
+
+// Cost based ordering of the clause bindings, estimates use document
+// statistics
+class Planner : public NonCopyable, public NonMoveable
+{
+    public:
+        Planner(DocumentStore& documents) : documents_(documents) {}
+        ~Planner() = default;
+
+        // Clauses are planned one at a time, once their documents are loaded
+        // Throws `std::runtime_error' if a document can not be loaded
+        BindingPlan PlanBindings(const Node* clause, const Node* condition,
+                                 const Node* late_bindings);
+
+    private:
+        // Statistics of the documents of a planning, by file. A document may
+        // be reloaded between two plannings, along with its statistics.
+        using Statistics = std::unordered_map<std::string, const DocumentStats*>;
+
+        // Documents read by `node', with the lock held
+        void CollectDocuments(const Node* node, std::unordered_set<std::string>& documents) const;
+        Estimate EstimateExpr(const Node* node, const Statistics& stats);
+        Estimate EstimateStep(const Node* node, const Estimate& context, bool descendants,
+                              const Statistics& stats);
+
+        DocumentStore&                            documents_;
+        // Estimates of the nodes bound to the variables planned so far, by
+        // definition, which only name their documents
+        std::unordered_map<const Node*, Estimate> variables_;
+        std::mutex                                mutex_;
+};
+
+}
@@ -1,31 +1,50 @@
 #include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
 #include <cassert>
 
 #include "xquery_misc.h"
 #include "xquery_processor.h"
+#include "xquery_binary.h"
+#include "xquery_batch.h"
+#include "xquery_cache.h"
+#include "xquery_alloc.h"
+#include "xquery_memo.h"
 
-int xquery::Processor::Run(const char* filename)
+bool xquery::Processor::Parse(const std::string& filename)
 {
-    assert(filename != nullptr);
+    MemoryScope scope{MemoryCategory::QUERY};
     set_filename(filename);
 
     std::ifstream fs{filename_};
 
-    try {
-        if ( !fs.good())
-            throw std::ios_base::failure{"Could not open " + filename_};
+    if ( !fs.good())
+        throw std::ios_base::failure{"Could not open " + filename_};
 
-        // std::make_unique C++14
-        lexer_ = std::unique_ptr<Lexer>{new Lexer{*this, fs}};
-        parser_ = std::unique_ptr<Parser>{new Parser{*lexer_, *this}};
+    ast_ = std::unique_ptr<Ast>{new Ast{documents_}};
+    ast_->set_limit(limit_);
+    ast_->set_threads(threads_);
+    ast_->set_analyze(analyze_);
+    ast_->set_perf(perf_);
+    ast_->set_trace( !trace_filename_.empty());
+    // std::make_unique C++14
+    lexer_ = std::unique_ptr<Lexer>{new Lexer{*this, fs}};
+    parser_ = std::unique_ptr<Parser>{new Parser{*lexer_, *this}};
 
-        if ( parser_->parse()) {
-            Error("Parsing failed"_red);
-            return 1;
-        }
+    if ( parser_->parse()) {
+        Error("Parsing failed"_red);
+        return false;
+    }
+    ast_->Compile();
+    return true;
+}
 
-        ast_.PlotGraph(); // Throws
-        ast_.Evaluate();  // Throws
+int xquery::Processor::Report(const std::function<int ()>& run) const
+{
+    try {
+        return run();
     }
     catch (const std::ios_base::failure& e) {
         Error(e.what());
@@ -41,7 +60,320 @@ int xquery::Processor::Run(const char* filename)
         Error("Evaluation failed"_red);
         return 1;
     }
+}
+
+int xquery::Processor::WriteTrace(Tracer& tracer) const
+{
+    tracer.Stop();
+    if (trace_filename_.empty())
+        return 0;
+    return Report([this, &tracer]() {
+        tracer.Write(trace_filename_); // Throws
+        return 0;
+    });
+}
+
+int xquery::Processor::Run(const char* filename)
+{
+    assert(filename != nullptr);
+
+    Tracer tracer;
+    if ( !trace_filename_.empty())
+        tracer.Start();
+    auto status = Report([this, filename]() {
+        if ( !Parse(filename))
+            return 1;
+
+        if (projection_)
+            ast_->ProjectDocuments();
+        if (explain_) {
+            ast_->Explain(std::cout); // Throws
+            return 0;
+        }
+
+        // Cached results are returned before any document is loaded
+        std::unique_ptr<ResultCache> cache;
+        std::string key, result;
+        if ( !cache_directory_.empty() && !ast_->instrumented()) {
+            cache = std::unique_ptr<ResultCache>{new ResultCache{cache_directory_, cache_capacity_}};
+            key = ResultCache::Key(ast_->Fingerprint() + " limit=" + std::to_string(limit_) +
+                                   (projection_ ? "" : " unprojected"),
+                                   ast_->Inputs()); // Throws
+            if (cache->Lookup(key, result)) {
+                std::cerr << "Request result (cached) :"_green << std::endl;
+                std::cout << result;
+                return 0;
+            }
+        }
+
+        // The interpreter evaluates the whole query if the translated paths
+        // are not its own
+        if ( !native_filename_.empty()) {
+            try {
+                native_ = std::unique_ptr<NativeQuery>{new NativeQuery{native_filename_}};
+                if (native_->plan() != ast_->Fingerprint())
+                    throw std::runtime_error(native_filename_ + " is the translation of another query");
+                ast_->Bind(*native_);
+            }
+            catch (const std::runtime_error& e) {
+                Error(e.what());
+                Error("Interpreting the query"_red);
+            }
+        }
+
+        // The graph carries the statistics once analyzed
+        ExecutionContext context;
+        if ( !ast_->analyzing())
+            ast_->PlotGraph();     // Throws
+        ast_->Evaluate(context);   // Throws
+        if (cache) {
+            std::ostringstream out;
+            context.Output(out);
+            cache->Store(key, out.str()); // Throws
+            std::cout << out.str();
+        }
+        else
+            context.Output(std::cout);
+        if (ast_->analyzing()) {
+            ast_->PlotGraph(&context);
+            ast_->Explain(std::cerr, &context);
+        }
+        return 0;
+    });
+    status = std::max(status, WriteTrace(tracer));
+
+    if (status == 0 && !explain_)
+        std::cerr << "Evaluation done"_green << std::endl;
+    return status;
+}
+
+int xquery::Processor::RunBatch(const std::vector<std::string>& filenames)
+{
+    struct Query
+    {
+        std::string          filename;
+        std::unique_ptr<Ast> ast;
+        std::string          document;
+        size_t               path;
+        bool                 shared;
+    };
+
+    std::vector<Query>                                              queries;
+    std::unordered_map<std::string, std::unique_ptr<PathAutomaton>> automata;
+    Projection                                                      proj;
+    int                                                             status = 0;
+    Tracer                                                          tracer;
+
+    if ( !trace_filename_.empty())
+        tracer.Start();
+    proj.keep_all = false;
+    for (const auto& filename : filenames) {
+        auto parsed = Report([this, &filename]() { return Parse(filename) ? 0 : 1; });
+        if (parsed != 0) {
+            status = 1;
+            continue;
+        }
+
+        Query query{filename, std::move(ast_), "", 0, false};
+        PathSteps steps;
+        // The paths of tag steps from a document share its traversal
+        if ( !explain_ && !query.ast->analyzing() &&
+             SimplePath(query.ast->root(), query.document, steps)) {
+            auto& automaton = automata[query.document];
+            if ( !automaton)
+                automaton = std::unique_ptr<PathAutomaton>{new PathAutomaton};
+            query.path = automaton->Add(steps);
+            query.shared = true;
+        }
+        if (projection_)
+            query.ast->Project(proj);
+        queries.push_back(std::move(query));
+    }
+    // The documents are loaded once, with the parts any of the queries reaches
+    if (projection_)
+        documents_.set_projection(std::move(proj));
+
+    std::unordered_map<std::string, PathAutomaton::Matches> matches;
+    for (const auto& automaton : automata) {
+        auto& document = automaton.first;
+        auto loaded = Report([this, &automaton, &document, &matches]() {
+            matches[document] = automaton.second->Run(documents_.Load(document).root());
+            return 0;
+        });
+        status = std::max(status, loaded);
+    }
+
+    // The other queries are evaluated concurrently, each one with its own
+    // context, the documents of their collections on the thread of the query
+    if (queries.size() > 1)
+        for (auto& query : queries)
+            query.ast->set_threads(1);
+    std::vector<int>         statuses(queries.size(), 0);
+    std::vector<std::thread> workers;
+    std::atomic<size_t>      next{0};
+    auto work = [&]() {
+        for (size_t i; (i = next++) < queries.size(); ) {
+            const auto& query = queries[i];
+            statuses[i] = Report([this, &query, &matches]() {
+                auto out_filename = query.filename + ".out";
+                std::ofstream out{out_filename};
+                ExecutionContext context;
+
+                if ( !out.good())
+                    throw std::ios_base::failure{"Could not open " + out_filename};
+                auto it = matches.find(query.document);
+                if (query.shared && it == std::end(matches))
+                    return 1; // Reported while loading the document
+                // The paths listing nodes more than once are evaluated on
+                // their own
+                if (explain_)
+                    query.ast->Explain(out);
+                else if (query.shared && !it->second.repeated[query.path]) {
+                    auto nodes = it->second.nodes[query.path];
+                    if (limit_ != 0 && nodes.size() > limit_)
+                        nodes.resize(limit_);
+                    context.SetResult(nodes);
+                    context.Output(out);
+                }
+                else {
+                    query.ast->Evaluate(context);
+                    context.Output(out);
+                    if (query.ast->analyzing())
+                        query.ast->Explain(out, &context);
+                }
+                return 0;
+            });
+        }
+    };
+
+    auto threads = threads_ ? threads_ : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, queries.size());
+    for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+    for (auto evaluated : statuses)
+        status = std::max(status, evaluated);
+    status = std::max(status, WriteTrace(tracer));
+
+    if (status == 0 && !explain_)
+        std::cerr << "Evaluation done"_green << std::endl;
+    return status;
+}
+
+int xquery::Processor::Watch(const char* filename)
+{
+    assert(filename != nullptr);
+
+    std::vector<std::string> previous;
+    ResultMemo memo;
+    auto status = Report([this, filename, &previous, &memo]() {
+        ExecutionContext context;
+
+        if ( !Parse(filename))
+            return 1;
+
+        if (projection_)
+            ast_->ProjectDocuments();
+        context.set_memo(&memo);
+        ast_->Evaluate(context); // Throws
+        context.Output(std::cout);
+        std::cout.flush();
+        previous = context.ResultItems();
+        return 0;
+    });
+
+    // The plans, the documents and the results of the paths and tuples are
+    // kept. The changed subtrees are patched into the loaded documents, the
+    // results reading them are dropped and the others are reused by the next
+    // evaluation.
+    while (status == 0) {
+        std::this_thread::sleep_for(watch_interval_);
+        Report([this, &previous, &memo]() {
+            ExecutionContext context;
+            size_t changed = 0;
+
+            for (const auto& document : documents_.Modified()) {
+                DocumentChanges changes;
+                try {
+                    changes = documents_.Reload(document); // Throws
+                }
+                catch (...) {
+                    // The document may be patched in part
+                    memo.Clear();
+                    throw;
+                }
+                memo.Invalidate(changes);
+                if (changes.subtrees)
+                    std::cerr << document << ": " << changes.subtrees << " subtree(s) changed" << std::endl;
+                changed += changes.subtrees;
+            }
+            if (changed == 0)
+                return 0;
+
+            memo.ResetCounts();
+            context.set_memo(&memo);
+            ast_->Evaluate(context); // Throws
+            auto current = context.ResultItems();
+            std::unordered_map<std::string, int> counts;
+            for (const auto& item : previous)
+                ++counts[item];
+            for (const auto& item : current)
+                --counts[item];
+            // Items in the order of their result, as often as they differ
+            for (const auto& item : previous)
+                if (counts[item] > 0) {
+                    std::cout << "- " << item << std::endl;
+                    --counts[item];
+                }
+            for (const auto& item : current)
+                if (counts[item] < 0) {
+                    std::cout << "+ " << item << std::endl;
+                    ++counts[item];
+                }
+            std::cout.flush();
+            std::cerr << memo.reused() << " path and tuple result(s) reused, "
+                      << memo.evaluated() << " evaluated again" << std::endl;
+            previous = std::move(current);
+            return 0;
+        });
+    }
+    return status;
+}
+
+int xquery::Processor::EmitNative(const char* filename)
+{
+    assert(filename != nullptr);
+
+    try {
+        if ( !Parse(filename))
+            return 1;
+        EmitCpp(*ast_, filename_, std::cout);
+    }
+    catch (const std::runtime_error& e) {
+        Error(e.what());
+        Error("Translation failed"_red);
+        return 1;
+    }
+
+    std::cerr << "Translation done"_green << std::endl;
+    return 0;
+}
+
+int xquery::Processor::CompileDocument(const char* filename)
+{
+    assert(filename != nullptr);
+
+    try {
+        BinaryDocument::Convert(filename);
+    }
+    catch (const std::runtime_error& e) {
+        Error(e.what());
+        Error("Conversion failed"_red);
+        return 1;
+    }
 
-    std::cerr << "Evaluation done"_green << std::endl;
+    std::cerr << "Conversion done"_green << std::endl;
     return 0;
 }
@@ -1,13 +1,18 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <memory>
+#include <functional>
+#include <chrono>
 #include <iostream>
 
 #include "xquery_misc.h"
 #include "xquery_lexer.h"
 #include "xquery_parser.tab.hh"
 #include "xquery_ast.h"
+#include "xquery_native.h"
+#include "xquery_trace.h"
 
 namespace xquery
 {
@@ -22,6 +27,90 @@ class Processor : public NonCopyable, public NonMoveable
         virtual ~Processor() = default;
 
         int Run(const char* filename);
+        // Evaluates every query of `filenames' on documents loaded once,
+        // concurrently, the results of a query go to `<filename>.out'
+        int RunBatch(const std::vector<std::string>& filenames);
+        // Evaluates the query again whenever the content of one of its
+        // documents changes, reusing the results of the paths and tuples
+        // not reading the changed subtrees (see `ResultMemo'), and prints
+        // the items removed from and added to the result
+        int Watch(const char* filename);
+        // Prints the query translated to C++ (see `EmitCpp')
+        int EmitNative(const char* filename);
+        int CompileDocument(const char* filename);
+        void set_loader(DocumentStore::Loader loader)
+        {
+            documents_.set_loader(loader);
+        }
+        void set_allocation(DocumentStore::Allocation allocation)
+        {
+            documents_.set_allocation(allocation);
+        }
+        // Threads parsing and evaluating the documents of a collection and
+        // evaluating the queries of a batch, 0 for one per core
+        void set_threads(size_t threads)
+        {
+            threads_ = threads;
+            documents_.set_threads(threads);
+        }
+        void set_projection(bool enabled)
+        {
+            projection_ = enabled;
+        }
+        // Builds an inverted index of the words of the texts
+        void set_text_index(bool enabled)
+        {
+            documents_.texts().set_indexed(enabled);
+        }
+        // Indexes the values of the `tag' elements
+        void add_range_index(const std::string& tag)
+        {
+            documents_.add_range_index(tag);
+        }
+        // Outputs the first `limit' items of the result only, 0 for all
+        void set_limit(size_t limit)
+        {
+            limit_ = limit;
+        }
+        // Reports per node statistics of the evaluation
+        void set_analyze(bool enabled)
+        {
+            analyze_ = enabled;
+        }
+        // Adds the hardware counters of the nodes to the statistics
+        void set_perf(bool enabled)
+        {
+            perf_ = enabled;
+        }
+        // Stores the results in `directory', up to `capacity' bytes, and
+        // returns the ones of the queries evaluated before on the same files
+        void set_cache(const std::string& directory, uint64_t capacity)
+        {
+            cache_directory_ = directory;
+            cache_capacity_ = capacity;
+        }
+        // Evaluates the paths of the query with the shared object `filename'
+        // built from their translation to C++
+        void set_native(const std::string& filename)
+        {
+            native_filename_ = filename;
+        }
+        // Delay between two checks of the documents in `Watch'
+        void set_watch_interval(std::chrono::milliseconds interval)
+        {
+            watch_interval_ = interval;
+        }
+        // Writes the timeline of the evaluation to `filename', in the Chrome
+        // trace event format
+        void set_trace(const std::string& filename)
+        {
+            trace_filename_ = filename;
+        }
+        // Prints the query plan instead of evaluating the query
+        void set_explain(bool enabled)
+        {
+            explain_ = enabled;
+        }
         void Error(const std::string& msg) const
         {
             std::cerr << msg << std::endl;
@@ -32,6 +121,14 @@ class Processor : public NonCopyable, public NonMoveable
         }
 
     private:
+        // Parses the query of `filename' in a new AST, false if it fails
+        // Throws `std::ios_base::failure'
+        bool Parse(const std::string& filename);
+        // Runs `run', reporting the errors it throws
+        int Report(const std::function<int ()>& run) const;
+        // Stops `tracer' and writes its timeline if tracing
+        int WriteTrace(Tracer& tracer) const;
+
         // XXX: Non const to allow location access from the Bison parser
         std::string& filename()
         {
@@ -42,10 +139,24 @@ class Processor : public NonCopyable, public NonMoveable
             filename_ = filename;
         }
 
-        Ast                     ast_;
-        std::string             filename_ = "";
-        std::unique_ptr<Parser> parser_;
-        std::unique_ptr<Lexer>  lexer_;
+        DocumentStore                documents_;
+        // Outlives the AST it is bound to
+        std::unique_ptr<NativeQuery> native_;
+        std::unique_ptr<Ast>         ast_;
+        std::string                  filename_ = "";
+        size_t                       limit_ = 0;
+        size_t                       threads_ = 0;
+        std::chrono::milliseconds    watch_interval_{1000};
+        std::string                  cache_directory_ = "";
+        uint64_t                     cache_capacity_ = 0;
+        std::string                  native_filename_ = "";
+        std::string                  trace_filename_ = "";
+        bool                         projection_ = true;
+        bool                         explain_ = false;
+        bool                         analyze_ = false;
+        bool                         perf_ = false;
+        std::unique_ptr<Parser>      parser_;
+        std::unique_ptr<Lexer>       lexer_;
 };
 
 }
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cstddef>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xquery_text.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+// Bytes of UTF-8 sequences are part of the words
+inline bool IsWordChar(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || static_cast<unsigned char>(c) >= 0x80;
+}
+
+// Returns the first occurrence of `needle' in [pos, end), the candidates
+// are located by their first and last characters
+const char* Find(const char* pos, const char* end, const std::string& needle)
+{
+    const auto kLen = static_cast<ptrdiff_t>(needle.size());
+
+    if (kLen == 0)
+        return pos;
+#ifdef __SSE2__
+    const auto kFirst = _mm_set1_epi8(needle.front());
+    const auto kLast = _mm_set1_epi8(needle.back());
+
+    for (; end - pos >= kLen + 15; pos += 16) {
+        auto first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        auto last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos + kLen - 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, kFirst),
+                                                   _mm_cmpeq_epi8(last, kLast)));
+        for (; mask != 0; mask &= mask - 1) {
+            int idx = __builtin_ctz(mask);
+            if (std::memcmp(pos + idx, needle.data(), kLen) == 0)
+                return pos + idx;
+        }
+    }
+#endif
+    for (; end - pos >= kLen; ++pos)
+        if (*pos == needle.front() && std::memcmp(pos, needle.data(), kLen) == 0)
+            return pos;
+    return nullptr;
+}
+
+// Longest n-grams indexed
+const size_t kGram = 3;
+
+// Key of the n-gram of `length' bytes at `pos'
+uint32_t GramKey(const char* pos, size_t length)
+{
+    uint32_t key = static_cast<uint32_t>(length) << 24;
+
+    for (size_t i = 0; i < length; ++i)
+        key |= static_cast<uint32_t>(static_cast<unsigned char>(pos[i])) << (8 * (kGram - 1 - i));
+    return key;
+}
+
+std::string LongestWord(const std::string& str)
+{
+    std::string longest;
+
+    for (auto it = std::begin(str); it != std::end(str); ) {
+        auto word_end = std::find_if_not(it, std::end(str), IsWordChar);
+        if (word_end - it > static_cast<ptrdiff_t>(longest.size()))
+            longest.assign(it, word_end);
+        it = std::find_if(word_end, std::end(str), IsWordChar);
+    }
+    return longest;
+}
+
+}
+
+size_t TextDictionary::Intern(const std::string& text)
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    auto it = ids_.find(text);
+    if (it != std::end(ids_))
+        return it->second;
+
+    auto id = count() + 1;
+    ids_.emplace(text, id);
+    heap_.append(text.c_str(), text.size() + 1);
+    offsets_.push_back(heap_.size());
+    if (indexed_)
+        Index(id);
+    return id;
+}
+
+void TextDictionary::set_indexed(bool enabled)
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    if (enabled && !indexed_)
+        for (size_t id = 1; id <= count(); ++id)
+            Index(id);
+    else if ( !enabled) {
+        words_.clear();
+        word_ids_.clear();
+        postings_.clear();
+        grams_.clear();
+    }
+    indexed_ = enabled;
+}
+
+void TextDictionary::Index(size_t id)
+{
+    const auto kEnd = text(id) + length(id);
+
+    for (auto pos = std::find_if(text(id), kEnd, IsWordChar); pos != kEnd; ) {
+        auto word_end = std::find_if_not(pos, kEnd, IsWordChar);
+        auto inserted = word_ids_.emplace(std::string{pos, word_end}, words_.size());
+        if (inserted.second) {
+            words_.push_back(inserted.first->first);
+            postings_.emplace_back();
+            IndexWord(inserted.first->second);
+        }
+        auto& ids = postings_[inserted.first->second];
+        // Ids are indexed in increasing order
+        if (ids.empty() || ids.back() != id)
+            ids.push_back(id);
+        pos = std::find_if(word_end, kEnd, IsWordChar);
+    }
+}
+
+void TextDictionary::IndexWord(size_t word_id)
+{
+    const auto& word = words_[word_id];
+
+    for (size_t length = 1; length <= std::min(kGram, word.size()); ++length)
+        for (size_t pos = 0; pos + length <= word.size(); ++pos) {
+            auto& word_ids = grams_[GramKey(word.data() + pos, length)];
+            if (word_ids.empty() || word_ids.back() != word_id)
+                word_ids.push_back(word_id);
+        }
+}
+
+TextDictionary::Matches TextDictionary::Search(const std::string& needle) const
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+
+    // Each word of the needle lies within a word of the texts containing
+    // it, the candidates are the texts using a word containing the longest
+    auto word = LongestWord(needle);
+    if ( !indexed_ || word.empty())
+        return Scan(needle);
+
+    // A word of up to `kGram' bytes is an n-gram, its words all hold it.
+    // Otherwise the words holding its rarest n-gram are verified.
+    Matches matches(count() + 1, false);
+    Matches verified(count() + 1, false);
+    const std::vector<size_t>* candidates = nullptr;
+    for (size_t pos = 0; pos + std::min(kGram, word.size()) <= word.size(); ++pos) {
+        auto it = grams_.find(GramKey(word.data() + pos, std::min(kGram, word.size())));
+        if (it == std::end(grams_))
+            return matches;
+        if (candidates == nullptr || it->second.size() < candidates->size())
+            candidates = &it->second;
+    }
+
+    for (auto word_id : *candidates)
+        if (word.size() <= kGram || words_[word_id].find(word) != std::string::npos)
+            for (auto id : postings_[word_id])
+                if ( !verified[id]) {
+                    verified[id] = true;
+                    matches[id] = Find(text(id), text(id) + length(id), needle) != nullptr;
+                }
+    return matches;
+}
+
+TextDictionary::Matches TextDictionary::Scan(const std::string& needle) const
+{
+    Matches matches(count() + 1, false);
+    const auto kHeap = heap_.data();
+    const auto kEnd = kHeap + heap_.size();
+
+    // The needle holds no NUL, a match never spans two texts
+    for (auto pos = kHeap; pos < kEnd; ) {
+        auto match = Find(pos, kEnd, needle);
+        if (match == nullptr)
+            break;
+        auto id = std::upper_bound(std::begin(offsets_), std::end(offsets_),
+                                   static_cast<size_t>(match - kHeap)) - std::begin(offsets_);
+        matches[id] = true;
+        pos = kHeap + offsets_[id];
+    }
+    return matches;
+}
+
+}
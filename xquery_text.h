@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+#include "xquery_xml.h"
+#include "xquery_misc.h"
+
+namespace xquery
+{
+
+/*
+ * Dense ids of the distinct text contents, shared by the documents and the
+ * query constants so that equal texts have equal ids (0 is never an id).
+ * The contents are stored back to back in a heap, NUL terminated, which
+ * `contains()' scans unless the texts are indexed by their words. The words
+ * are themselves indexed by their substrings of up to three bytes (n-grams),
+ * so the words containing a needle are found without scanning them all.
+ * Texts are interned and searched by concurrent evaluations.
+ */
+class TextDictionary : public NonCopyable, public NonMoveable
+{
+    public:
+        // Indexed by id
+        using Matches = std::vector<bool>;
+
+        TextDictionary() = default;
+        ~TextDictionary() = default;
+
+        size_t Intern(const std::string& text);
+        // Texts containing `needle'
+        Matches Search(const std::string& needle) const;
+
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            return count();
+        }
+        void set_indexed(bool enabled);
+
+    private:
+        size_t count() const
+        {
+            return offsets_.size() - 1;
+        }
+        const char* text(size_t id) const
+        {
+            return heap_.data() + offsets_[id - 1];
+        }
+        size_t length(size_t id) const
+        {
+            return offsets_[id] - offsets_[id - 1] - 1;
+        }
+        void Index(size_t id);
+        void IndexWord(size_t word_id);
+        Matches Scan(const std::string& needle) const;
+
+        std::unordered_map<std::string, size_t> ids_;
+        std::string                             heap_;
+        // Start of every text, then the end of the heap
+        std::vector<size_t>                     offsets_{0};
+        // Inverted index, from the words to the ids of the texts using them,
+        // and from the n-grams to the words holding them (ids in increasing
+        // order)
+        bool                                                 indexed_ = false;
+        std::vector<std::string>                             words_;
+        std::unordered_map<std::string, size_t>              word_ids_;
+        std::vector<std::vector<size_t>>                     postings_;
+        std::unordered_map<uint32_t, std::vector<size_t>>    grams_;
+        mutable std::mutex                                   mutex_;
+};
+
+// Dictionary id of the content of a text node, cached in its `psvi' field,
+// 0 if it is not encoded
+inline size_t TextId(const xmlNode* text)
+{
+    return reinterpret_cast<uintptr_t>(text->psvi);
+}
+
+inline void SetTextId(xmlNode* text, size_t id)
+{
+    text->psvi = reinterpret_cast<void*>(static_cast<uintptr_t>(id));
+}
+
+}
@@ -0,0 +1,116 @@
+#include <fstream>
+#include <iomanip>
+#include <cstdio>
+#include <cassert>
+#include <unistd.h>
+
+#include "xquery_trace.h"
+
+namespace xquery
+{
+
+namespace
+{
+
+std::atomic<size_t> tracers{0};
+
+void WriteJsonString(std::ostream& out, const std::string& str)
+{
+    out << '"';
+    for (auto c : str) {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        }
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+}
+
+std::atomic<Tracer*> Tracer::active_{nullptr};
+thread_local size_t Tracer::buffer_serial_ = 0;
+thread_local Tracer::Buffer* Tracer::buffer_ = nullptr;
+
+Tracer::Tracer() : serial_{++tracers}, start_{std::chrono::steady_clock::now()} {}
+
+Tracer::~Tracer()
+{
+    Stop();
+}
+
+void Tracer::Start()
+{
+    Tracer* none = nullptr;
+    auto started = active_.compare_exchange_strong(none, this);
+
+    assert(started || none == this);
+    static_cast<void>(started);
+}
+
+void Tracer::Stop()
+{
+    auto self = this;
+    active_.compare_exchange_strong(self, nullptr);
+}
+
+Tracer::Buffer& Tracer::ThreadBuffer()
+{
+    if (buffer_serial_ != serial_) {
+        std::lock_guard<std::mutex> lock{mutex_};
+
+        buffers_.emplace_back(new Buffer);
+        buffers_.back()->tid = buffers_.size();
+        buffer_serial_ = serial_;
+        buffer_ = buffers_.back().get();
+    }
+    return *buffer_;
+}
+
+void Tracer::Begin(const char* category, const std::string& name, size_t node)
+{
+    ThreadBuffer().events.push_back({name, category, Now(), node, 'B'});
+}
+
+void Tracer::End()
+{
+    ThreadBuffer().events.push_back({"", nullptr, Now(), kNoNode, 'E'});
+}
+
+void Tracer::Write(const std::string& filename) const
+{
+    std::ofstream out{filename};
+    auto pid = getpid();
+    bool first = true;
+
+    if ( !out.good())
+        throw std::ios_base::failure{"Could not open " + filename};
+    out << std::fixed << std::setprecision(3);
+
+    // Written once the threads are done, the buffers are no longer filled
+    out << "{\"traceEvents\":[";
+    for (const auto& buffer : buffers_)
+        for (const auto& event : buffer->events) {
+            out << (first ? "\n" : ",\n") << "{\"ph\":\"" << event.phase << '"'
+                << ",\"ts\":" << event.ns / 1e3
+                << ",\"pid\":" << pid << ",\"tid\":" << buffer->tid;
+            if (event.phase == 'B') {
+                out << ",\"cat\":\"" << event.category << "\",\"name\":";
+                WriteJsonString(out, event.name);
+                if (event.node != kNoNode)
+                    out << ",\"args\":{\"node\":" << event.node << '}';
+            }
+            out << '}';
+            first = false;
+        }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    if ( !out.good())
+        throw std::ios_base::failure{"Could not write " + filename};
+}
+
+}
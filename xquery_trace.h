@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <cstdint>
+
+#include "xquery_misc.h"
+
+namespace xquery
+{
+
+/*
+ * Timeline of the evaluations in the Chrome trace event format (opened by
+ * chrome://tracing or Perfetto). Every thread records the begin and end
+ * of its spans in a buffer of its own, the buffers are merged once written.
+ * Spans are recorded while a tracer is started only, otherwise a span
+ * costs a test.
+ */
+class Tracer : public NonCopyable, public NonMoveable
+{
+    public:
+        static constexpr size_t kNoNode = std::numeric_limits<size_t>::max();
+
+        Tracer();
+        ~Tracer();
+
+        // Records the spans of every thread until stopped, one tracer is
+        // started at a time
+        void Start();
+        void Stop();
+        // Throws `std::ios_base::failure'
+        void Write(const std::string& filename) const;
+
+        // Tracer started, null if none
+        static Tracer* active()
+        {
+            return active_.load(std::memory_order_relaxed);
+        }
+        // Span of the calling thread, about the AST node `node' if any
+        void Begin(const char* category, const std::string& name, size_t node);
+        void End();
+
+    private:
+        struct Event
+        {
+            std::string name;
+            const char* category;
+            uint64_t    ns;
+            size_t      node;
+            char        phase;
+        };
+        struct Buffer
+        {
+            std::vector<Event> events;
+            size_t             tid;
+        };
+
+        Buffer& ThreadBuffer();
+        uint64_t Now() const
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start_).count();
+        }
+
+        static std::atomic<Tracer*>          active_;
+        // Buffer of the calling thread, for the tracer `buffer_serial_' only
+        static thread_local size_t           buffer_serial_;
+        static thread_local Buffer*          buffer_;
+        // Tells the buffers of the tracers apart in the threads
+        size_t                               serial_;
+        std::chrono::steady_clock::time_point start_;
+        std::mutex                           mutex_;
+        std::vector<std::unique_ptr<Buffer>> buffers_;
+};
+
+// Span of the calling thread from construction to destruction
+class TraceSpan : public NonCopyable, public NonMoveable
+{
+    public:
+        TraceSpan(const char* category, const std::string& name, size_t node = Tracer::kNoNode)
+          : tracer_{Tracer::active()}
+        {
+            if (tracer_)
+                tracer_->Begin(category, name, node);
+        }
+        ~TraceSpan()
+        {
+            if (tracer_)
+                tracer_->End();
+        }
+
+    private:
+        Tracer* tracer_;
+};
+
+}